@@ -0,0 +1,120 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "fdm.h"
+
+/*
+ * Bloom filter used to avoid looking up keys which are definitely not in a
+ * cache. Keys are hashed once with 64-bit FNV-1a and the two halves combined
+ * to give each of the k bit positions.
+ */
+
+uint64_t	bloom_hash(const void *, size_t);
+
+uint64_t
+bloom_hash(const void *buf, size_t len)
+{
+	const u_char	*p = buf;
+	uint64_t	 h;
+
+	h = 14695981039346656037ULL;
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
+
+/*
+ * Create a filter for about n keys with a false positive rate of roughly one
+ * in rate, using no more than limit bytes.
+ */
+struct bloom *
+bloom_create(u_int n, u_int rate, size_t limit)
+{
+	struct bloom	*b;
+	uint64_t	 bits, r;
+	u_int		 k;
+
+	/* k is log2 of the rate and each key needs about 1.44k bits. */
+	k = 0;
+	for (r = 1; r < rate; r *= 2)
+		k++;
+	if (k == 0)
+		k = 1;
+	if (k > BLOOM_MAXHASHES)
+		k = BLOOM_MAXHASHES;
+
+	bits = ((uint64_t) n * k * 144) / 100;
+	if (bits < 8192)
+		bits = 8192;
+	if (bits / 8 > limit)
+		bits = (uint64_t) limit * 8;
+	if (bits < 8)
+		bits = 8;
+
+	b = xmalloc(sizeof *b);
+	b->bits = bits;
+	b->hashes = k;
+	b->data = xcalloc(1, (bits + 7) / 8);
+	return (b);
+}
+
+void
+bloom_free(struct bloom *b)
+{
+	xfree(b->data);
+	xfree(b);
+}
+
+void
+bloom_add(struct bloom *b, const void *buf, size_t len)
+{
+	uint64_t	h, h1, h2, bit;
+	u_int		i;
+
+	h = bloom_hash(buf, len);
+	h1 = h & 0xffffffff;
+	h2 = (h >> 32) | 1;
+	for (i = 0; i < b->hashes; i++) {
+		bit = (h1 + i * h2) % b->bits;
+		b->data[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/* Check for a key. Returns 0 only if it has definitely not been added. */
+int
+bloom_check(struct bloom *b, const void *buf, size_t len)
+{
+	uint64_t	h, h1, h2, bit;
+	u_int		i;
+
+	h = bloom_hash(buf, len);
+	h1 = h & 0xffffffff;
+	h2 = (h >> 32) | 1;
+	for (i = 0; i < b->hashes; i++) {
+		bit = (h1 + i * h2) % b->bits;
+		if (!(b->data[bit / 8] & (1 << (bit % 8))))
+			return (0);
+	}
+	return (1);
+}
@@ -27,6 +27,7 @@ __dead void	cache_op_remove(int , char **);
 __dead void	cache_op_list(int, char **);
 __dead void	cache_op_dump(int, char **);
 __dead void	cache_op_clear(int, char **);
+__dead void	cache_op_upgrade(int, char **);
 
 __dead void
 cache_op(int argc, char **argv)
@@ -49,6 +50,8 @@ cache_op(int argc, char **argv)
 		cache_op_dump(argc, argv);
 	if (strncmp(cmd, "clear", strlen(cmd)) == 0)
 		cache_op_clear(argc, argv);
+	if (strncmp(cmd, "upgrade", strlen(cmd)) == 0)
+		cache_op_upgrade(argc, argv);
 	usage();
 }
 
@@ -65,7 +68,7 @@ cache_op_add(int argc, char **argv)
 		exit(1);
 	}
 
-	if (db_add(db, argv[1]) != 0) {
+	if (db_add(db, argv[1], NULL) != 0) {
 		log_warnx("%s: cache error", argv[0]);
 		exit(1);
 	}
@@ -90,7 +93,7 @@ cache_op_remove(int argc, char **argv)
 		log_warnx("%s: key not found: %s", argv[0], argv[1]);
 		exit(1);
 	}
-	if (db_remove(db, argv[1]) != 0) {
+	if (db_remove(db, argv[1], NULL) != 0) {
 		log_warnx("%s: cache error", argv[0]);
 		exit(1);
 	}
@@ -175,3 +178,30 @@ cache_op_clear(int argc, char **argv)
 	exit(0);
 }
 
+__dead void
+cache_op_upgrade(int argc, char **argv)
+{
+	TDB_CONTEXT	*db;
+	u_int		 version;
+
+	if (argc != 1)
+		usage();
+
+	if ((db = db_open(argv[0])) == NULL) {
+		log_warn("%s", argv[0]);
+		exit(1);
+	}
+
+	if ((version = db_version(db)) == DB_VERSION) {
+		log_info("%s: already version %u", argv[0], version);
+		exit(0);
+	}
+	if (db_upgrade(db) != 0) {
+		log_warnx("%s: cache error", argv[0]);
+		exit(1);
+	}
+	log_info("%s: upgraded from version %u to %u", argv[0], version,
+	    DB_VERSION);
+
+	exit(0);
+}
@@ -26,6 +26,11 @@
 #include "match.h"
 
 int	child_deliver(struct child *, struct io *);
+int	child_deliver_cmd_line(struct match_command_data *, struct mail *,
+	    char *, char **);
+int	child_deliver_cmd_coproc(struct account *, const char *,
+	    struct coproc *, struct match_command_data *, struct mail *, int *,
+	    int *);
 
 int
 child_deliver(struct child *child, struct io *pio)
@@ -43,6 +48,9 @@ child_deliver(struct child *child, struct io *pio)
 	setproctitle("%s[%lu]", data->name, (u_long) geteuid());
 #endif
 
+	/* Keep only this user's coprocesses. */
+	coproc_close(data->uid);
+
 	/* Call the hook. */
 	memset(&msg, 0, sizeof msg);
 	data->hook(0, a, &msg, data, &msg.data.error);
@@ -75,6 +83,13 @@ child_deliver_action_hook(pid_t pid, struct account *a, struct msg *msg,
 
 	/* Check if this is the parent. */
 	if (pid != 0) {
+		/* Remember maildirs so later children need not check them. */
+		if (ti->deliver == &deliver_maildir &&
+		    *result == DELIVER_SUCCESS) {
+			deliver_maildir_add(
+			    data->uid, find_tag(m->tags, "mail_file"));
+		}
+
 		/* Use new mail if necessary. */
 		if (ti->deliver->type != DELIVER_WRBACK) {
 			xfree(dctx);
@@ -100,6 +115,7 @@ child_deliver_action_hook(pid_t pid, struct account *a, struct msg *msg,
 	dctx->udata->gid =  data->gid;
 	dctx->udata->name = xstrdup(find_tag(m->tags, "user"));
 	dctx->udata->home = xstrdup(find_tag(m->tags, "home"));
+	dctx->coproc = data->coproc;
 	log_debug2("%s: deliver user is: %s (%lu/%lu), home is: %s", a->name,
 	    dctx->udata->name, (u_long) dctx->udata->uid,
 	    (u_long) dctx->udata->gid, dctx->udata->home);
@@ -124,11 +140,9 @@ child_deliver_cmd_hook(pid_t pid, struct account *a, unused struct msg *msg,
 	struct mail			*m = data->mail;
 	struct match_command_data	*cmddata = data->cmddata;
 	int				 flags, status, found = 0;
-	char				*s, *cause, *lbuf, *out, *err, tag[24];
+	char				*s, *cause = NULL, *lbuf = NULL, *out, *err;
 	size_t				 llen;
 	struct cmd			*cmd = NULL;
-	struct rmlist			 rml;
-	u_int				 i;
 
 	/* If this is the parent, do nothing. */
 	if (pid != 0) {
@@ -146,6 +160,13 @@ child_deliver_cmd_hook(pid_t pid, struct account *a, unused struct msg *msg,
 
 	log_debug2("%s: %s: started (ret=%d re=%s)", a->name, s, cmddata->ret,
 	    cmddata->re.str == NULL ? "none" : cmddata->re.str);
+	if (cmddata->coproc) {
+		if (child_deliver_cmd_coproc(
+		    a, s, data->coproc, cmddata, m, &status, &found) != 0)
+			goto error;
+		goto done;
+	}
+
 	flags = CMD_ONCE;
 	if (cmddata->pipe)
 		flags |= CMD_IN;
@@ -156,6 +177,7 @@ child_deliver_cmd_hook(pid_t pid, struct account *a, unused struct msg *msg,
 		log_warnx("%s: %s: %s", a->name, s, cause);
 		goto error;
 	}
+	cmd_set_file(cmd, m->shm.fd, m->off);
 
 	llen = IO_LINESIZE;
 	lbuf = xmalloc(llen);
@@ -184,31 +206,22 @@ child_deliver_cmd_hook(pid_t pid, struct account *a, unused struct msg *msg,
 		if (found)
 			continue;
 
-		found = re_string(&cmddata->re, out, &rml, &cause);
+		found = child_deliver_cmd_line(cmddata, m, out, &cause);
 		if (found == -1) {
 			log_warnx("%s: %s", a->name, cause);
 			goto error;
 		}
-		if (found != 1)
-			continue;
-		/* Save the matches. */
-		if (!rml.valid)
-			continue;
-		for (i = 0; i < NPMATCH; i++) {
-			if (!rml.list[i].valid)
-				break;
-			xsnprintf(tag, sizeof tag, "command%u", i);
-			add_tag(&m->tags, tag, "%.*s", (int) (rml.list[i].eo -
-			    rml.list[i].so), out + rml.list[i].so);
-		}
 	}
 	status--;
 
+done:
 	log_debug2("%s: %s: returned %d, found %d", a->name, s, status, found);
 
-	cmd_free(cmd);
+	if (cmd != NULL)
+		cmd_free(cmd);
 	xfree(s);
-	xfree(lbuf);
+	if (lbuf != NULL)
+		xfree(lbuf);
 
 	status = cmddata->ret == status;
 	if (cmddata->ret != -1 && cmddata->re.str != NULL)
@@ -232,3 +245,77 @@ error:
 		xfree(lbuf);
 	*result = MATCH_ERROR;
 }
+
+/* Check a line of command output against the regexp and save the matches. */
+int
+child_deliver_cmd_line(struct match_command_data *cmddata, struct mail *m,
+    char *out, char **cause)
+{
+	struct rmlist	rml;
+	char		tag[24];
+	u_int		i;
+	int		found;
+
+	found = re_string(&cmddata->re, out, &rml, cause);
+	if (found != 1 || !rml.valid)
+		return (found);
+	for (i = 0; i < NPMATCH; i++) {
+		if (!rml.list[i].valid)
+			break;
+		xsnprintf(tag, sizeof tag, "command%u", i);
+		add_tag(&m->tags, tag, "%.*s", (int) (rml.list[i].eo -
+		    rml.list[i].so), out + rml.list[i].so);
+	}
+	return (found);
+}
+
+/* Run a match command as a coprocess and check each line of its output. */
+int
+child_deliver_cmd_coproc(struct account *a, const char *s, struct coproc *cp,
+    struct match_command_data *cmddata, struct mail *m, int *status,
+    int *found)
+{
+	char		*cause, *out, *line, *ptr;
+	size_t		 outlen;
+	int		 n;
+
+	if (cp == NULL) {
+		log_warnx("%s: %s: coprocess not running", a->name, s);
+		return (-1);
+	}
+	if (cmddata->pipe) {
+		n = coproc_run(cp, m->data, m->size, status, &out, &outlen,
+		    conf.timeout, &cause);
+	} else {
+		n = coproc_run(cp, NULL, 0, status, &out, &outlen,
+		    conf.timeout, &cause);
+	}
+	if (n != 0) {
+		log_warnx("%s: %s: %s", a->name, s, cause);
+		xfree(cause);
+		return (-1);
+	}
+
+	line = out;
+	while (line < out + outlen) {
+		if ((ptr = memchr(line, '\n', out + outlen - line)) != NULL)
+			*ptr = '\0';
+		log_debug3("%s: %s: out: %s", a->name, s, line);
+		if (!*found && cmddata->re.str != NULL) {
+			*found = child_deliver_cmd_line(cmddata, m, line,
+			    &cause);
+			if (*found == -1) {
+				log_warnx("%s: %s", a->name, cause);
+				xfree(cause);
+				xfree(out);
+				return (-1);
+			}
+		}
+		if (ptr == NULL)
+			break;
+		line = ptr + 1;
+	}
+
+	xfree(out);
+	return (0);
+}
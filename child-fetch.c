@@ -47,6 +47,18 @@ int	fetch_dequeue(struct account *, struct mail_ctx *);
 
 const char *account_get_method(struct account *);
 
+void	open_cache_bloom(struct account *, struct cache *, int);
+void	close_cache_bloom(struct cache *);
+int	check_cache_bloom(struct account *, struct cache *, char *);
+void	lose_cache_bloom(struct account *, struct cache *);
+int	cachepending_cmp(struct cachepending *, struct cachepending *);
+int	pend_cache(struct account *, struct cache *, char *, int);
+int	flush_cache(struct account *, struct cache *);
+int	flush_caches(struct account *, int);
+
+RB_PROTOTYPE(cachependings, cachepending, entry, cachepending_cmp);
+RB_GENERATE(cachependings, cachepending, entry, cachepending_cmp);
+
 struct mail_queue	 fetch_matchq;
 struct mail_queue	 fetch_deliverq;
 
@@ -71,20 +83,225 @@ open_cache(struct account *a, struct cache *cache)
 
 	n = db_size(cache->db);
 	log_debug3("%s: opened cache %s: %d keys", a->name, cache->path, n);
+	cache->flushed = time(NULL);
 
-	if (cache->expire == 0)
-		return (0);
-	if (db_expire(cache->db, cache->expire) != 0) {
-		log_warnx("%s: %s: expiry failed", a->name, cache->path);
-		return (-1);
+	if (cache->bloom_size != 0)
+		open_cache_bloom(a, cache, n);
+	return (0);
+}
+
+/*
+ * Build a filter from the keys in the cache. It is marked with how far it has
+ * read the cache, so keys added later by others can be added to it.
+ */
+void
+open_cache_bloom(struct account *a, struct cache *cache, int n)
+{
+	if (db_version(cache->db) != DB_VERSION) {
+		log_warnx("%s: %s: cache must be upgraded to use a filter",
+		    a->name, cache->path);
+		return;
 	}
 
-	n -= db_size(cache->db);
+	/* Leave room for the cache to double before the rate suffers. */
 	if (n < 0)
 		n = 0;
-	log_debug3("%s: cache %s: expired %d keys", a->name, cache->path, n);
+	cache->bloom = bloom_create(n * 2, cache->bloom_rate, cache->bloom_size);
+	cache->bloom_mark = xcalloc(1, sizeof *cache->bloom_mark);
+	if (db_fill_bloom(cache->db, cache->bloom, cache->bloom_mark) != 0) {
+		log_warnx("%s: %s: can't build filter", a->name, cache->path);
+		close_cache_bloom(cache);
+		return;
+	}
+	log_debug3("%s: cache %s: filter of %llu bits, %u hashes", a->name,
+	    cache->path, (unsigned long long) cache->bloom->bits,
+	    cache->bloom->hashes);
+}
+
+void
+close_cache_bloom(struct cache *cache)
+{
+	bloom_free(cache->bloom);
+	cache->bloom = NULL;
+	xfree(cache->bloom_mark);
+	cache->bloom_mark = NULL;
+}
+
+/*
+ * Make sure the filter has any keys others have added to the cache since it
+ * last looked. Returns 1 if it can be used for the key.
+ */
+int
+check_cache_bloom(struct account *a, struct cache *cache, char *key)
+{
+	if (cache->bloom == NULL)
+		return (0);
+	if (db_update_bloom(
+	    cache->db, cache->bloom, cache->bloom_mark, key) != 0) {
+		lose_cache_bloom(a, cache);
+		return (0);
+	}
+	return (1);
+}
+
+void
+lose_cache_bloom(struct account *a, struct cache *cache)
+{
+	log_debug3("%s: cache %s: can't update filter, dropping it", a->name,
+	    cache->path);
+	close_cache_bloom(cache);
+}
+
+int
+cachepending_cmp(struct cachepending *cp1, struct cachepending *cp2)
+{
+	return (strcmp(cp1->key, cp2->key));
+}
+
+/* Buffer a change to a cache, replacing any earlier change to the same key. */
+int
+pend_cache(struct account *a, struct cache *cache, char *key, int add)
+{
+	struct cachepending	find, *cp;
+
+	find.key = key;
+	if ((cp = RB_FIND(cachependings, &cache->pendings, &find)) == NULL) {
+		cp = xmalloc(sizeof *cp);
+		cp->key = xstrdup(key);
+		RB_INSERT(cachependings, &cache->pendings, cp);
+	}
+	cp->add = add;
+
+	if (add && cache->bloom != NULL)
+		bloom_add(cache->bloom, key, strlen(key));
+
+	if (time(NULL) - cache->flushed >= (time_t) cache->write_behind)
+		return (flush_cache(a, cache));
+	return (0);
+}
+
+/*
+ * Write the buffered changes to a cache in a single transaction. The filter
+ * already has the added keys.
+ */
+int
+flush_cache(struct account *a, struct cache *cache)
+{
+	struct cachepending	*cp;
+	u_int			 n;
+
+	cache->flushed = time(NULL);
+	if (RB_EMPTY(&cache->pendings))
+		return (0);
+
+	if (db_begin(cache->db) != 0) {
+		log_warnx("%s: %s: can't start transaction", a->name,
+		    cache->path);
+		return (-1);
+	}
+
+	n = 0;
+	RB_FOREACH(cp, cachependings, &cache->pendings) {
+		if (cp->add) {
+			if (db_add(cache->db, cp->key, cache->bloom_mark) != 0)
+				goto error;
+		} else if (db_contains(cache->db, cp->key)) {
+			if (db_remove(
+			    cache->db, cp->key, cache->bloom_mark) != 0)
+				goto error;
+		}
+		n++;
+	}
 
+	if (db_commit(cache->db) != 0) {
+		log_warnx("%s: %s: can't commit transaction", a->name,
+		    cache->path);
+		return (-1);
+	}
+	log_debug3("%s: cache %s: wrote %u changes", a->name, cache->path, n);
+
+	while (!RB_EMPTY(&cache->pendings)) {
+		cp = RB_ROOT(&cache->pendings);
+		RB_REMOVE(cachependings, &cache->pendings, cp);
+		xfree(cp->key);
+		xfree(cp);
+	}
 	return (0);
+
+error:
+	db_cancel(cache->db);
+	log_warnx("%s: %s: error writing %s", a->name, cache->path, cp->key);
+	return (-1);
+}
+
+/* Flush any caches which are due, or all of them if force is set. */
+int
+flush_caches(struct account *a, int force)
+{
+	struct cache	*cache;
+	time_t		 now;
+	int		 error;
+
+	now = time(NULL);
+	error = 0;
+	TAILQ_FOREACH(cache, &conf.caches, entry) {
+		if (cache->db == NULL || cache->write_behind == 0)
+			continue;
+		if (!force && now - cache->flushed < (time_t) cache->write_behind)
+			continue;
+		if (flush_cache(a, cache) != 0)
+			error = 1;
+	}
+	return (error);
+}
+
+/*
+ * Write all buffered cache changes. Called by the fetch states before they
+ * delete mail, so a failure leaves the mail to be fetched again.
+ */
+int
+cache_flush(struct account *a)
+{
+	return (flush_caches(a, 1));
+}
+
+/* Add a key, to the filter first so it is never missing from it. */
+int
+cache_add(struct account *a, struct cache *cache, char *key)
+{
+	if (cache->write_behind != 0)
+		return (pend_cache(a, cache, key, 1));
+
+	if (cache->bloom != NULL)
+		bloom_add(cache->bloom, key, strlen(key));
+	return (db_add(cache->db, key, cache->bloom_mark));
+}
+
+int
+cache_remove(struct account *a, struct cache *cache, char *key)
+{
+	if (cache->write_behind != 0)
+		return (pend_cache(a, cache, key, 0));
+
+	/* Removing a key can't make the filter wrong, just less useful. */
+	return (db_remove(cache->db, key, cache->bloom_mark));
+}
+
+int
+cache_contains(struct account *a, struct cache *cache, char *key)
+{
+	struct cachepending	find, *cp;
+
+	find.key = key;
+	cp = RB_FIND(cachependings, &cache->pendings, &find);
+	if (cp != NULL)
+		return (cp->add);
+
+	if (check_cache_bloom(a, cache, key)) {
+		if (!bloom_check(cache->bloom, key, strlen(key)))
+			return (0);
+	}
+	return (db_contains(cache->db, key));
 }
 
 int
@@ -106,6 +323,9 @@ child_fetch(struct child *child, struct io *pio)
 	log_debug2("%s: user is %lu", a->name, (u_long) geteuid());
 	tim = get_time();
 
+	/* Coprocesses are only used by the deliver children. */
+	coproc_close((uid_t) -1);
+
 	/* Process fetch or poll. */
 	log_debug2("%s: started processing", a->name);
 	flags = 0;
@@ -388,6 +608,10 @@ fetch_account(struct account *a, struct io *pio, int nflags, double tim)
 		if (fetch_deliver(a, msgp, &msgbuf) != 0)
 			goto abort;
 
+		/* Write buffered cache changes if due. */
+		if (flush_caches(a, 0) != 0)
+			goto abort;
+
 		/* Check for purge and set flag if necessary. */
 		if (fetch_purge(a))
 			fctx.flags |= FETCH_PURGE;
@@ -491,12 +715,22 @@ finished:
 	fetch_free();
 	ARRAY_FREE(&iol);
 
-	/* Close caches. */
+	/* Write any buffered changes and close caches. */
+	if (flush_caches(a, 1) != 0)
+		aborted = 1;
 	TAILQ_FOREACH(cache, &conf.caches, entry) {
+		if (cache->bloom != NULL)
+			close_cache_bloom(cache);
 		if (cache->db != NULL)
 			db_close(cache->db);
 	}
 
+	/* Log out of any IMAP or LMTP servers mail was delivered to. */
+	deliver_imap_close();
+	deliver_lmtp_close();
+
+	sslreport(a->name);
+
 	/* Print results. */
 	if (nflags & FETCH_POLL)
 		log_info("%s: %u messages found", a->name, a->fetch->total(a));
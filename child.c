@@ -20,6 +20,7 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "fdm.h"
@@ -109,6 +110,10 @@ child_start(struct children *children, uid_t uid, gid_t gid,
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) != 0)
 		fatal("socketpair failed");
 
+	/* Don't let coprocesses started by the parent inherit its end. */
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1)
+		fatal("fcntl failed");
+
 	child = xcalloc(1, sizeof *child);
 	child->io = io_create(fds[0], NULL, IO_CRLF);
 	child->data = data;
@@ -22,17 +22,155 @@
 #include <fcntl.h>
 #include <paths.h>
 #include <signal.h>
+#include <spawn.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "fdm.h"
 
+/* Characters which mean a command must be run by the shell. */
+#define CMD_SHELLCHARS "|&;<>()$`\\\"'*?[]{}~#=!\n"
+
+extern char   **environ;
+
+char	      **cmd_argv(const char *);
+void		cmd_free_argv(char **);
+pid_t		cmd_spawn(const char *, int, int, int, int, int, int, char **);
+ssize_t		cmd_write(struct cmd *);
+
 #define CMD_DEBUG(cmd, fmt, ...)
 #ifndef CMD_DEBUG
 #define CMD_DEBUG(cmd, fmt, ...) \
 	log_debug3("%s: (%d) " fmt, __func__, cmd->pid, ## __VA_ARGS__)
 #endif
 
+/*
+ * Split a command into arguments if it can be run without the shell, that is
+ * if it is only words separated by spaces or tabs.
+ */
+char **
+cmd_argv(const char *s)
+{
+	char		**argv;
+	const char	 *ptr;
+	size_t		  len;
+	u_int		  argc;
+
+	if (s[strcspn(s, CMD_SHELLCHARS)] != '\0')
+		return (NULL);
+
+	argv = NULL;
+	argc = 0;
+	for (ptr = s; *ptr != '\0'; ptr += len) {
+		ptr += strspn(ptr, " \t");
+		if ((len = strcspn(ptr, " \t")) == 0)
+			break;
+		argv = xrealloc(argv, argc + 2, sizeof *argv);
+		argv[argc] = xmalloc(len + 1);
+		memcpy(argv[argc], ptr, len);
+		argv[argc][len] = '\0';
+		argc++;
+	}
+	if (argc == 0)
+		return (NULL);
+	argv[argc] = NULL;
+	return (argv);
+}
+
+void
+cmd_free_argv(char **argv)
+{
+	u_int	i;
+
+	for (i = 0; argv[i] != NULL; i++)
+		xfree(argv[i]);
+	xfree(argv);
+}
+
+/*
+ * Start the child with posix_spawn, which avoids copying the page tables of a
+ * large process, with the given pipe ends as its stdin, stdout and stderr. The
+ * other ends are closed in the child. Commands with no shell syntax are run
+ * directly; if this fails (for example because the command is a shell
+ * builtin), the shell is tried instead.
+ */
+pid_t
+cmd_spawn(const char *s, int in0, int in1, int out0, int out1, int err0,
+    int err1, char **cause)
+{
+	posix_spawn_file_actions_t	 fa;
+	posix_spawnattr_t		 sa;
+	sigset_t			 set;
+	pid_t				 pid;
+	char				**argv;
+	char				*sh_argv[4];
+	int				 error;
+
+	if ((error = posix_spawn_file_actions_init(&fa)) != 0) {
+		xasprintf(cause, "posix_spawn: %s", strerror(error));
+		return (-1);
+	}
+	if ((error = posix_spawnattr_init(&sa)) != 0) {
+		posix_spawn_file_actions_destroy(&fa);
+		xasprintf(cause, "posix_spawn: %s", strerror(error));
+		return (-1);
+	}
+
+	if (in1 != -1)
+		posix_spawn_file_actions_addclose(&fa, in1);
+	if (out0 != -1)
+		posix_spawn_file_actions_addclose(&fa, out0);
+	posix_spawn_file_actions_addclose(&fa, err0);
+	posix_spawn_file_actions_adddup2(&fa, in0, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out1, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, err1, STDERR_FILENO);
+	posix_spawn_file_actions_addclose(&fa, in0);
+	posix_spawn_file_actions_addclose(&fa, out1);
+	posix_spawn_file_actions_addclose(&fa, err1);
+
+	/* Put back the signals fdm catches or ignores. */
+	sigemptyset(&set);
+#ifdef SIGINFO
+	sigaddset(&set, SIGINFO);
+#endif
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGPIPE);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGCHLD);
+	posix_spawnattr_setsigdefault(&sa, &set);
+	posix_spawnattr_setflags(&sa, POSIX_SPAWN_SETSIGDEF);
+
+	error = ENOEXEC;
+	if ((argv = cmd_argv(s)) != NULL) {
+		error = posix_spawnp(&pid, argv[0], &fa, &sa, argv, environ);
+		if (error != 0)
+			log_debug3("%s: %s", argv[0], strerror(error));
+		cmd_free_argv(argv);
+	}
+	if (error != 0) {
+		sh_argv[0] = xstrdup("sh");
+		sh_argv[1] = xstrdup("-c");
+		sh_argv[2] = xstrdup(s);
+		sh_argv[3] = NULL;
+		error = posix_spawn(
+		    &pid, _PATH_BSHELL, &fa, &sa, sh_argv, environ);
+		xfree(sh_argv[0]);
+		xfree(sh_argv[1]);
+		xfree(sh_argv[2]);
+	}
+
+	posix_spawnattr_destroy(&sa);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (error != 0) {
+		xasprintf(cause, "posix_spawn: %s", strerror(error));
+		return (-1);
+	}
+	return (pid);
+}
+
 /* Start a command. */
 struct cmd *
 cmd_start(const char *s, int flags, const char *buf, size_t len, char **cause)
@@ -43,6 +181,7 @@ cmd_start(const char *s, int flags, const char *buf, size_t len, char **cause)
 	cmd = xmalloc(sizeof *cmd);
 	cmd->pid = -1;
 	cmd->flags = flags;
+	cmd->fd = -1;
 
 	if (buf != NULL && len != 0 && flags & CMD_IN) {
 		cmd->buf = buf;
@@ -90,54 +229,11 @@ cmd_start(const char *s, int flags, const char *buf, size_t len, char **cause)
 		goto error;
 	}
 
-	/* Fork the child. */
-	switch (cmd->pid = fork()) {
-	case -1:
-		xasprintf(cause, "fork: %s", strerror(errno));
+	/* Start the child. */
+	cmd->pid = cmd_spawn(s, fd_in[0], fd_in[1], fd_out[0], fd_out[1],
+	    fd_err[0], fd_err[1], cause);
+	if (cmd->pid == -1)
 		goto error;
-	case 0:
-		/* Child. */
-		cmd->pid = getpid();
-		CMD_DEBUG(cmd, "started (child)");
-
-		if (fd_in[1] != -1)
-			close(fd_in[1]);
-		if (fd_out[0] != -1)
-			close(fd_out[0]);
-		close(fd_err[0]);
-
-		if (dup2(fd_in[0], STDIN_FILENO) == -1)
-			fatal("dup2(stdin) failed");
-		close(fd_in[0]);
-		if (dup2(fd_out[1], STDOUT_FILENO) == -1)
-			fatal("dup2(stdout) failed");
-		close(fd_out[1]);
-		if (dup2(fd_err[1], STDERR_FILENO) == -1)
-			fatal("dup2(stderr) failed");
-		close(fd_err[1]);
-
-#ifdef SIGINFO
-		if (signal(SIGINFO, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-#endif
-		if (signal(SIGUSR1, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGINT, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGTERM, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGPIPE, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGUSR1, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGUSR2, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-		if (signal(SIGCHLD, SIG_DFL) == SIG_ERR)
-			fatal("signal failed");
-
-		execl(_PATH_BSHELL, "sh", "-c", s, (char *) NULL);
-		fatal("execl failed");
-	}
 	CMD_DEBUG(cmd, "started (parent)");
 
 	/* XXX Check if the child has actually started. */
@@ -195,6 +291,57 @@ error:
 	return (NULL);
 }
 
+/*
+ * Give the file and offset at which the buffer passed to cmd_start may also
+ * be found, so it can be spliced into the command's stdin without copying it
+ * through the buffer. The file must not change while the command is running.
+ */
+void
+cmd_set_file(struct cmd *cmd, int fd, off_t off)
+{
+	if (cmd->len == 0)
+		return;
+	cmd->fd = fd;
+	cmd->off = off;
+}
+
+/* Write as much of the buffer as possible to stdin. */
+ssize_t
+cmd_write(struct cmd *cmd)
+{
+#ifdef HAVE_SPLICE
+	ssize_t	n;
+	loff_t	off;
+
+	if (cmd->fd != -1) {
+		off = cmd->off;
+		n = splice(cmd->fd, &off, cmd->io_in->fd, NULL, cmd->len,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n > 0 || (n == -1 && errno != EINVAL && errno != ENOSYS))
+			return (n);
+		/* Not supported for this file, write it instead. */
+		cmd->fd = -1;
+	}
+#endif
+	return (write(cmd->io_in->fd, cmd->buf, cmd->len));
+}
+
+/* Return the amount of stdout waiting to be read with CMD_RAW. */
+size_t
+cmd_pending(struct cmd *cmd)
+{
+	if (cmd->io_out == NULL)
+		return (0);
+	return (IO_RDSIZE(cmd->io_out));
+}
+
+/* Read a block of stdout with CMD_RAW. */
+void
+cmd_read(struct cmd *cmd, void *buf, size_t len)
+{
+	buffer_read(cmd->io_out->rd, buf, len);
+}
+
 /*
  * Poll a command. Returns -1 on error, 0 if output is found, or the child's
  * return code + 1 if it has exited.
@@ -226,7 +373,7 @@ cmd_poll(struct cmd *cmd, char **out, char **err,
 	 */
 	if (cmd->len != 0 && cmd->io_in != NULL && !IO_CLOSED(cmd->io_in)) {
 		CMD_DEBUG(cmd, "writing, %zu left", cmd->len);
-		n = write(cmd->io_in->fd, cmd->buf, cmd->len);
+		n = cmd_write(cmd);
 		CMD_DEBUG(cmd, "write returned %zd (errno=%d)", n, errno);
 		switch (n) {
 		case 0:
@@ -249,6 +396,7 @@ cmd_poll(struct cmd *cmd, char **out, char **err,
 			return (-1);
 		default:
 			cmd->buf += n;
+			cmd->off += n;
 			cmd->len -= n;
 			break;
 		}
@@ -332,7 +480,11 @@ cmd_poll(struct cmd *cmd, char **out, char **err,
 			return (0);
 		}
 	}
-	if (cmd->io_out != NULL) {
+	if (cmd->io_out != NULL && cmd->flags & CMD_RAW) {
+		/* Leave the data for cmd_read. */
+		if (IO_RDSIZE(cmd->io_out) != 0)
+			return (0);
+	} else if (cmd->io_out != NULL) {
 		CMD_DEBUG(cmd, "out has %zu bytes", IO_RDSIZE(cmd->io_out));
 		*out = io_readline2(cmd->io_out, lbuf, llen);
 		if (*out != NULL) {
@@ -18,19 +18,24 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
@@ -40,8 +45,35 @@
 char   *check_alt_names(char *, char *, X509 *);
 int	sslverify(struct server *, SSL *, char **);
 int	getport(char *);
+int	connectaddrs(struct addrinfo *, int, char **);
+int	connectwait(int, int, double);
 int	httpproxy(struct server *, struct proxy *, struct io *, int, char **);
 int	socks5proxy(struct server *, struct proxy *, struct io *, int, char **);
+SSL_CTX *sslctx(int);
+struct sslsession *sslsession_find(struct server *);
+char   *sslsession_path(struct sslsession *);
+void	sslsession_load(struct sslsession *);
+void	sslsession_save(struct sslsession *);
+int	sslsession_new(SSL *, SSL_SESSION *);
+
+/*
+ * Last TLS session for each server, offered to resume the next connection.
+ * Sessions are kept for the life of the process and, if ssl-session-cache is
+ * set, in a file for each server in that directory.
+ */
+struct sslsession {
+	char			*key;
+	SSL_SESSION		*session;
+
+	TAILQ_ENTRY(sslsession)	 entry;
+};
+TAILQ_HEAD(, sslsession) sslsessions = TAILQ_HEAD_INITIALIZER(sslsessions);
+
+/* Contexts are created once, one with and one without old TLS versions. */
+SSL_CTX		*sslctxs[2];
+
+u_int		 sslconnects;
+u_int		 sslresumed;
 
 char *
 sslerror(const char *fn)
@@ -563,18 +595,21 @@ httpproxy(struct server *srv,
 	}
 }
 
-SSL *
-makessl(struct server *srv, int fd, int verify, int timeout, char **cause)
+SSL_CTX *
+sslctx(int insecure)
 {
 	SSL_CTX	*ctx;
-	SSL	*ssl;
-	int	 n, mode;
+
+	if (sslctxs[insecure] != NULL)
+		return (sslctxs[insecure]);
 
 	ctx = SSL_CTX_new(SSLv23_client_method());
+	if (ctx == NULL)
+		return (NULL);
 	SSL_CTX_set_options(ctx, SSL_OP_ALL);
 
 	/* Disable insecure SSL/TLS versions. */
-	if (!srv->insecure) {
+	if (!insecure) {
 		SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
 		SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
 		SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1);
@@ -583,6 +618,162 @@ makessl(struct server *srv, int fd, int verify, int timeout, char **cause)
 	SSL_CTX_set_default_verify_paths(ctx);
 	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
+	/* Sessions are kept by the callback, not in the context. */
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, sslsession_new);
+
+	sslctxs[insecure] = ctx;
+	return (ctx);
+}
+
+/* Find the session entry for a server, loading it from file the first time. */
+struct sslsession *
+sslsession_find(struct server *srv)
+{
+	struct sslsession	*ss;
+	char			*key;
+
+	xasprintf(&key, "%s,%s", srv->host, srv->port);
+	TAILQ_FOREACH(ss, &sslsessions, entry) {
+		if (strcmp(ss->key, key) == 0) {
+			xfree(key);
+			return (ss);
+		}
+	}
+
+	ss = xcalloc(1, sizeof *ss);
+	ss->key = key;
+	TAILQ_INSERT_TAIL(&sslsessions, ss, entry);
+
+	if (conf.ssl_cache != NULL)
+		sslsession_load(ss);
+	return (ss);
+}
+
+/* Get the cache file path for a session. */
+char *
+sslsession_path(struct sslsession *ss)
+{
+	char	*path, *ptr;
+
+	xasprintf(&path, "%s/%s", conf.ssl_cache, ss->key);
+	for (ptr = path + strlen(conf.ssl_cache) + 1; *ptr != '\0'; ptr++) {
+		if (!isalnum((u_char) *ptr) && strchr(".,-_", *ptr) == NULL)
+			*ptr = '_';
+	}
+	return (path);
+}
+
+void
+sslsession_load(struct sslsession *ss)
+{
+	SSL_SESSION	*session;
+	FILE		*f;
+	char		*path;
+
+	path = sslsession_path(ss);
+	if ((f = fopen(path, "r")) == NULL) {
+		xfree(path);
+		return;
+	}
+	session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+	fclose(f);
+
+	if (session == NULL) {
+		log_debug2("%s: invalid TLS session", path);
+		ERR_clear_error();
+	} else if (SSL_SESSION_get_time(session) +
+	    SSL_SESSION_get_timeout(session) < time(NULL)) {
+		log_debug3("%s: TLS session expired", path);
+		SSL_SESSION_free(session);
+	} else
+		ss->session = session;
+	xfree(path);
+}
+
+/* Write a session to its file. Errors are not fatal. */
+void
+sslsession_save(struct sslsession *ss)
+{
+	FILE	*f;
+	char	*path, *tmp;
+	int	 fd;
+
+	path = sslsession_path(ss);
+	xasprintf(&tmp, "%s.%ld", path, (long) getpid());
+
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) == -1)
+		goto error;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto error;
+	}
+	if (!PEM_write_SSL_SESSION(f, ss->session)) {
+		ERR_clear_error();
+		fclose(f);
+		goto error;
+	}
+	if (fclose(f) != 0)
+		goto error;
+	if (rename(tmp, path) != 0)
+		goto error;
+
+	xfree(tmp);
+	xfree(path);
+	return;
+
+error:
+	log_debug2("%s: can't save TLS session: %s", path, strerror(errno));
+	unlink(tmp);
+	xfree(tmp);
+	xfree(path);
+}
+
+/*
+ * New session callback. With TLS 1.3 this may be called after the handshake
+ * when the server sends a ticket.
+ */
+int
+sslsession_new(SSL *ssl, SSL_SESSION *session)
+{
+	struct sslsession	*ss;
+
+	if ((ss = SSL_get_app_data(ssl)) == NULL)
+		return (0);
+
+	if (ss->session != NULL)
+		SSL_SESSION_free(ss->session);
+	ss->session = session;
+	if (conf.ssl_cache != NULL)
+		sslsession_save(ss);
+	return (1);
+}
+
+/* Log how many TLS connections were made and resumed. */
+void
+sslreport(const char *name)
+{
+	if (sslconnects == 0)
+		return;
+	log_debug("%s: %u TLS connections, %u resumed", name, sslconnects,
+	    sslresumed);
+}
+
+SSL *
+makessl(struct server *srv, int fd, int verify, int timeout, char **cause)
+{
+	SSL_CTX			*ctx;
+	SSL			*ssl = NULL;
+	struct sslsession	*ss;
+	int			 n, mode;
+	double			 limit;
+
+	if ((ctx = sslctx(srv->insecure ? 1 : 0)) == NULL) {
+		*cause = sslerror("SSL_CTX_new");
+		return (NULL);
+	}
+
 	ssl = SSL_new(ctx);
 	if (ssl == NULL) {
 		*cause = sslerror("SSL_new");
@@ -594,37 +785,47 @@ makessl(struct server *srv, int fd, int verify, int timeout, char **cause)
 		goto error;
 	}
 
-	/*
-	 * Switch the socket to blocking mode to be sure we have received the
-	 * certificate.
-	 */
+	/* Offer the last session for this server, if any. */
+	ss = sslsession_find(srv);
+	SSL_set_app_data(ssl, ss);
+	if (ss->session != NULL && SSL_set_session(ssl, ss->session) != 1)
+		ERR_clear_error();
+
+	/* The handshake is done with the socket in non-blocking mode. */
 	if ((mode = fcntl(fd, F_GETFL)) == -1)
 		fatal("fcntl failed");
-	if (fcntl(fd, F_SETFL, mode & ~O_NONBLOCK) == -1)
+	if (fcntl(fd, F_SETFL, mode|O_NONBLOCK) == -1)
 		fatal("fcntl failed");
 
-	/* Set the timeout. */
-	timer_set(timeout / 1000);
-
-	/* Connect with SSL.  */
+	/*
+	 * Connect with SSL, waiting for the socket whenever it is needed until
+	 * the handshake is complete and the certificate received.
+	 */
 	SSL_set_connect_state(ssl);
-	if ((n = SSL_connect(ssl)) < 1) {
-		timer_cancel();
-		if (timer_expired()) {
-			xasprintf(
-			    cause, "SSL_connect: %s", strerror(ETIMEDOUT));
+	limit = get_time() + timeout / 1000.0;
+	while ((n = SSL_connect(ssl)) != 1) {
+		switch (n = SSL_get_error(ssl, n)) {
+		case SSL_ERROR_WANT_READ:
+			n = connectwait(fd, POLLIN, limit);
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			n = connectwait(fd, POLLOUT, limit);
+			break;
+		default:
+			*cause = sslerror2(n, "SSL_connect");
+			goto error;
+		}
+		if (n != 0) {
+			xasprintf(cause, "SSL_connect: %s", strerror(n));
 			goto error;
 		}
-		*cause = sslerror2(SSL_get_error(ssl, n), "SSL_connect");
-		goto error;
 	}
 
-	/* Reset non-blocking mode. */
-	if (fcntl(fd, F_SETFL, mode|O_NONBLOCK) == -1)
-		fatal("fcntl failed");
-
-	/* Clear the timeout. */
-	timer_cancel();
+	sslconnects++;
+	if (SSL_session_reused(ssl)) {
+		sslresumed++;
+		log_debug2("%s: resumed TLS session", srv->host);
+	}
 
 	/* Verify certificate. */
 	if (verify && sslverify(srv, ssl, cause) != 0)
@@ -633,20 +834,182 @@ makessl(struct server *srv, int fd, int verify, int timeout, char **cause)
 	return (ssl);
 
 error:
-	SSL_CTX_free(ctx);
 	if (ssl != NULL)
 		SSL_free(ssl);
 	return (NULL);
 }
 
+/*
+ * Wait for a socket until the time limit. Returns 0 if ready, or an errno
+ * value.
+ */
+int
+connectwait(int fd, int events, double limit)
+{
+	struct pollfd	pfd;
+	double		left;
+
+	for (;;) {
+		left = limit - get_time();
+		if (left <= 0)
+			return (ETIMEDOUT);
+
+		pfd.fd = fd;
+		pfd.events = events;
+		switch (poll(&pfd, 1, left * 1000 + 1)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		case 0:
+			continue;
+		}
+		return (0);
+	}
+}
+
+/*
+ * Connect to the first address which answers. Addresses are tried in the
+ * order given but alternating between address families, and a new attempt is
+ * started every connect-stagger milliseconds while the earlier ones are still
+ * waiting, so an unreachable address does not hold up the others. Returns the
+ * non-blocking socket or -1.
+ */
+int
+connectaddrs(struct addrinfo *ais, int timeout, char **cause)
+{
+	struct addrinfo		*ai;
+	struct pollfd		*pfds;
+	ARRAY_DECL(, struct addrinfo *) order, other;
+	double			 limit, next, now, wait;
+	u_int			 i, j, n, npfds;
+	int			 fd, error, mode;
+	socklen_t		 len;
+	const char		*fn;
+
+	/* Build the order to try: alternate families, keeping the first. */
+	ARRAY_INIT(&order);
+	ARRAY_INIT(&other);
+	for (ai = ais; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family == ais->ai_family)
+			ARRAY_ADD(&order, ai);
+		else
+			ARRAY_ADD(&other, ai);
+	}
+	n = ARRAY_LENGTH(&order) + ARRAY_LENGTH(&other);
+	for (i = 0; i < ARRAY_LENGTH(&other); i++) {
+		j = 2 * i + 1;
+		if (j > ARRAY_LENGTH(&order))
+			j = ARRAY_LENGTH(&order);
+		ARRAY_INSERT(&order, j, ARRAY_ITEM(&other, i));
+	}
+	ARRAY_FREE(&other);
+
+	pfds = xcalloc(n, sizeof *pfds);
+	npfds = 0;
+
+	fd = -1;
+	fn = "connect";
+	error = ETIMEDOUT;
+
+	limit = get_time() + timeout / 1000.0;
+	next = 0;
+	i = 0;
+	for (;;) {
+		now = get_time();
+
+		/* Start the next attempt if it is time. */
+		if (i < n && (npfds == 0 || now >= next)) {
+			ai = ARRAY_ITEM(&order, i++);
+			next = now + conf.connect_stagger / 1000.0;
+
+			fd = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol);
+			if (fd < 0) {
+				fn = "socket";
+				error = errno;
+				next = now;
+				continue;
+			}
+			if ((mode = fcntl(fd, F_GETFL)) == -1)
+				fatal("fcntl failed");
+			if (fcntl(fd, F_SETFL, mode|O_NONBLOCK) == -1)
+				fatal("fcntl failed");
+
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			if (errno != EINPROGRESS && errno != EINTR) {
+				fn = "connect";
+				error = errno;
+				close(fd);
+				fd = -1;
+				next = now;
+				continue;
+			}
+			pfds[npfds].fd = fd;
+			pfds[npfds].events = POLLOUT;
+			npfds++;
+			fd = -1;
+			continue;
+		}
+		if (npfds == 0)
+			break;
+
+		if (now >= limit) {
+			fn = "connect";
+			error = ETIMEDOUT;
+			break;
+		}
+		wait = limit - now;
+		if (i < n && next - now < wait)
+			wait = next - now;
+
+		if (poll(pfds, npfds, wait * 1000 + 1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll failed");
+		}
+
+		/* Check for attempts which have finished. */
+		for (j = 0; j < npfds; j++) {
+			if (pfds[j].revents == 0)
+				continue;
+
+			len = sizeof error;
+			if (getsockopt(pfds[j].fd,
+			    SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+				error = errno;
+			if (error == 0) {
+				fd = pfds[j].fd;
+				pfds[j] = pfds[--npfds];
+				break;
+			}
+			fn = "connect";
+			close(pfds[j].fd);
+			pfds[j--] = pfds[--npfds];
+			next = now;	/* start the next now */
+		}
+		if (fd != -1)
+			break;
+	}
+
+	/* Close any other attempts still waiting. */
+	for (j = 0; j < npfds; j++)
+		close(pfds[j].fd);
+	xfree(pfds);
+	ARRAY_FREE(&order);
+
+	if (fd == -1)
+		xasprintf(cause, "%s: %s", fn, strerror(error));
+	return (fd);
+}
+
 struct io *
 connectio(
     struct server *srv, int verify, const char *eol, int timeout, char **cause)
 {
 	int		 fd = -1, error = 0;
 	struct addrinfo	 hints;
-	struct addrinfo	*ai;
-	const char	*fn = NULL;
 	SSL		*ssl;
 
 	if (srv->ai == NULL) {
@@ -660,30 +1023,8 @@ connectio(
 		}
 	}
 
-	for (ai = srv->ai; ai != NULL; ai = ai->ai_next) {
-	retry:
-		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (fd < 0) {
-			fn = "socket";
-			continue;
-		}
-		if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-			error = errno;
-			close(fd);
-			errno = error;
-			if (errno == EINTR)
-				goto retry;
-			fd = -1;
-			fn = "connect";
-			continue;
-		}
-		break;
-	}
-
-	if (fd < 0) {
-		xasprintf(cause, "%s: %s", fn, strerror(errno));
+	if ((fd = connectaddrs(srv->ai, timeout, cause)) == -1)
 		return (NULL);
-	}
 	if (!srv->ssl)
 		return (io_create(fd, NULL, eol));
 
@@ -694,3 +1035,32 @@ connectio(
 	}
 	return (io_create(fd, ssl, eol));
 }
+
+struct io *
+connectunix(const char *path, const char *eol, char **cause)
+{
+	struct sockaddr_un	sun;
+	int			fd, error;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof sun.sun_path) >=
+	    sizeof sun.sun_path) {
+		xasprintf(cause, "%s: %s", path, strerror(ENAMETOOLONG));
+		return (NULL);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		xasprintf(cause, "socket: %s", strerror(errno));
+		return (NULL);
+	}
+	while (connect(fd, (struct sockaddr *) &sun, sizeof sun) < 0) {
+		if (errno == EINTR)
+			continue;
+		error = errno;
+		close(fd);
+		xasprintf(cause, "connect: %s: %s", path, strerror(error));
+		return (NULL);
+	}
+	return (io_create(fd, NULL, eol));
+}
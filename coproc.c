@@ -0,0 +1,477 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdm.h"
+
+/*
+ * Coprocesses are commands which are started once and then given each mail in
+ * turn rather than being run for every mail. They are started by the parent,
+ * so the deliver and command children, which are forked from it, inherit the
+ * pipes. Each mail is written as its length in decimal and a newline followed
+ * by the mail, and the command replies with its exit status and the length of
+ * its output separated by a space, a newline and the output. Children take a
+ * lock before talking to a coprocess, so only one uses it at a time.
+ *
+ * The command is expanded once, in the parent, and the child is given the
+ * coprocess itself rather than looking it up again. At most MAXCOPROCS are kept
+ * running; past that, the least recently used is stopped by closing its stdin,
+ * so any child still using it can finish, and it is reaped later.
+ */
+
+struct coproc	*coproc_find(const char *, uid_t);
+int	coproc_reap(struct coproc *);
+void	coproc_evict(void);
+void	coproc_free(struct coproc *);
+int	coproc_lock(struct coproc *, int, char **);
+int	coproc_header(char *, int *, size_t *);
+
+TAILQ_HEAD(, coproc) coprocs = TAILQ_HEAD_INITIALIZER(coprocs);
+u_int	coproc_used;
+
+/* Find a running coprocess. Stopped ones have their stdin closed. */
+struct coproc *
+coproc_find(const char *cmd, uid_t uid)
+{
+	struct coproc	*cp;
+
+	TAILQ_FOREACH(cp, &coprocs, entry) {
+		if (cp->pid != -1 && cp->in != -1 && cp->uid == uid &&
+		    strcmp(cp->cmd, cmd) == 0)
+			return (cp);
+	}
+	return (NULL);
+}
+
+/*
+ * Reap a coprocess if it has exited but the parent has not yet noticed, and
+ * free it. Returns 1 if it was reaped.
+ */
+int
+coproc_reap(struct coproc *cp)
+{
+	int	status;
+
+	if (waitpid(cp->pid, &status, WNOHANG) != cp->pid)
+		return (0);
+	log_debug2("parent: coprocess %ld exited: %s", (long) cp->pid, cp->cmd);
+	TAILQ_REMOVE(&coprocs, cp, entry);
+	coproc_free(cp);
+	return (1);
+}
+
+/* Stop the least recently used coprocess if there are too many running. */
+void
+coproc_evict(void)
+{
+	struct coproc	*cp, *lru = NULL;
+	u_int		 n = 0;
+
+	TAILQ_FOREACH(cp, &coprocs, entry) {
+		if (cp->in == -1)
+			continue;
+		n++;
+		if (lru == NULL || cp->used < lru->used)
+			lru = cp;
+	}
+	if (n < MAXCOPROCS)
+		return;
+
+	log_debug2("parent: stopping coprocess %ld: %s", (long) lru->pid,
+	    lru->cmd);
+	close(lru->in);
+	lru->in = -1;
+	close(lru->out);
+	lru->out = -1;
+	close(lru->lock);
+	lru->lock = -1;
+}
+
+/* Start a coprocess in the parent, unless it is already running. */
+struct coproc *
+coproc_start(const char *cmd, uid_t uid, gid_t gid, char **cause)
+{
+	struct coproc	*cp;
+	int		 fd_in[2], fd_out[2], fd_lock;
+	FILE		*f;
+	pid_t		 pid;
+
+	if ((cp = coproc_find(cmd, uid)) != NULL && !coproc_reap(cp)) {
+		cp->used = ++coproc_used;
+		return (cp);
+	}
+	coproc_evict();
+
+	if ((f = tmpfile()) == NULL) {
+		xasprintf(cause, "tmpfile: %s", strerror(errno));
+		return (NULL);
+	}
+	fd_lock = dup(fileno(f));
+	fclose(f);
+	if (fd_lock == -1) {
+		xasprintf(cause, "dup: %s", strerror(errno));
+		return (NULL);
+	}
+
+	if (pipe(fd_in) != 0) {
+		xasprintf(cause, "pipe: %s", strerror(errno));
+		close(fd_lock);
+		return (NULL);
+	}
+	if (pipe(fd_out) != 0) {
+		xasprintf(cause, "pipe: %s", strerror(errno));
+		close(fd_in[0]);
+		close(fd_in[1]);
+		close(fd_lock);
+		return (NULL);
+	}
+
+	switch (pid = fork()) {
+	case -1:
+		xasprintf(cause, "fork: %s", strerror(errno));
+		close(fd_in[0]);
+		close(fd_in[1]);
+		close(fd_out[0]);
+		close(fd_out[1]);
+		close(fd_lock);
+		return (NULL);
+	case 0:
+		close(fd_in[1]);
+		close(fd_out[0]);
+		close(fd_lock);
+
+		if (dup2(fd_in[0], STDIN_FILENO) == -1)
+			fatal("dup2(stdin) failed");
+		close(fd_in[0]);
+		if (dup2(fd_out[1], STDOUT_FILENO) == -1)
+			fatal("dup2(stdout) failed");
+		close(fd_out[1]);
+
+		if (signal(SIGPIPE, SIG_DFL) == SIG_ERR)
+			fatal("signal failed");
+		if (signal(SIGUSR2, SIG_DFL) == SIG_ERR)
+			fatal("signal failed");
+
+		if (geteuid() == 0)
+			dropto(uid, gid);
+
+		execl(_PATH_BSHELL, "sh", "-c", cmd, (char *) NULL);
+		fatal("execl failed");
+	}
+	close(fd_in[0]);
+	close(fd_out[1]);
+
+	/*
+	 * The children poll these, so make them nonblocking, and don't let
+	 * commands run by the children inherit them.
+	 */
+	if (fcntl(fd_in[1], F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl failed");
+	if (fcntl(fd_out[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl failed");
+	fcntl(fd_in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fd_out[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fd_lock, F_SETFD, FD_CLOEXEC);
+
+	cp = xcalloc(1, sizeof *cp);
+	cp->cmd = xstrdup(cmd);
+	cp->uid = uid;
+	cp->pid = pid;
+	cp->in = fd_in[1];
+	cp->out = fd_out[0];
+	cp->lock = fd_lock;
+	cp->used = ++coproc_used;
+	TAILQ_INSERT_TAIL(&coprocs, cp, entry);
+
+	log_debug2("parent: coprocess %ld started (uid %lu): %s", (long) pid,
+	    (u_long) uid, cmd);
+	return (cp);
+}
+
+void
+coproc_free(struct coproc *cp)
+{
+	if (cp->in != -1)
+		close(cp->in);
+	if (cp->out != -1)
+		close(cp->out);
+	if (cp->lock != -1)
+		close(cp->lock);
+	xfree(cp->cmd);
+	xfree(cp);
+}
+
+/*
+ * Called by the parent when a child it doesn't know about exits. Returns 1 if
+ * it was a coprocess, which will be started again when it is next needed.
+ */
+int
+coproc_died(pid_t pid)
+{
+	struct coproc	*cp;
+
+	TAILQ_FOREACH(cp, &coprocs, entry) {
+		if (cp->pid == pid) {
+			log_debug2("parent: coprocess %ld exited: %s",
+			    (long) pid, cp->cmd);
+			TAILQ_REMOVE(&coprocs, cp, entry);
+			coproc_free(cp);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/* Stop all coprocesses in the parent, waiting for them to exit. */
+void
+coproc_stop(void)
+{
+	struct coproc	*cp;
+	pid_t		 pid;
+	int		 status;
+
+	while (!TAILQ_EMPTY(&coprocs)) {
+		cp = TAILQ_FIRST(&coprocs);
+		TAILQ_REMOVE(&coprocs, cp, entry);
+
+		/* Closing stdin should make the command exit. */
+		if (cp->in != -1) {
+			close(cp->in);
+			cp->in = -1;
+		}
+
+		timer_set(conf.timeout / 1000);
+		do
+			pid = waitpid(cp->pid, &status, 0);
+		while (pid == -1 && errno == EINTR && !timer_expired());
+		timer_cancel();
+		if (pid == -1 && errno == EINTR) {
+			log_warnx("parent: coprocess %ld didn't exit: %s",
+			    (long) cp->pid, cp->cmd);
+			kill(cp->pid, SIGTERM);
+			waitpid(cp->pid, &status, 0);
+		}
+		coproc_free(cp);
+	}
+}
+
+/*
+ * Close coprocesses not belonging to a user in a child. Pass -1 to close
+ * them all.
+ */
+void
+coproc_close(uid_t uid)
+{
+	struct coproc	*cp, *cp1;
+
+	cp = TAILQ_FIRST(&coprocs);
+	while (cp != NULL) {
+		cp1 = TAILQ_NEXT(cp, entry);
+		if (cp->uid != uid) {
+			TAILQ_REMOVE(&coprocs, cp, entry);
+			coproc_free(cp);
+		}
+		cp = cp1;
+	}
+}
+
+int
+coproc_lock(struct coproc *cp, int type, char **cause)
+{
+	struct flock	fl;
+
+	memset(&fl, 0, sizeof fl);
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+
+	while (fcntl(cp->lock, F_SETLKW, &fl) == -1) {
+		if (errno != EINTR) {
+			if (cause != NULL)
+				xasprintf(cause, "fcntl: %s", strerror(errno));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Parse a reply header. */
+int
+coproc_header(char *hdr, int *status, size_t *size)
+{
+	const char	*errstr;
+	char		*ptr;
+
+	if ((ptr = strchr(hdr, ' ')) == NULL)
+		return (-1);
+	*ptr++ = '\0';
+
+	*status = strtonum(hdr, 0, 255, &errstr);
+	if (errstr != NULL)
+		return (-1);
+	*size = strtonum(ptr, 0, conf.max_size, &errstr);
+	if (errstr != NULL)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Give a mail to a coprocess and wait for its reply. The output is returned
+ * in a buffer which must be freed by the caller. If anything goes wrong, the
+ * coprocess is killed because there is no way to know what it will send next.
+ */
+int
+coproc_run(struct coproc *cp, const char *buf, size_t len, int *status,
+    char **out, size_t *outlen, int timeout, char **cause)
+{
+	struct pollfd	 pfd[2];
+	char		 hdr[32], *rbuf, *ptr;
+	size_t		 hlen, hoff, off, rsize, rlen, want, size;
+	ssize_t		 n;
+
+	if (cp->pid == -1) {
+		xasprintf(cause, "coprocess not running");
+		return (-1);
+	}
+	if (coproc_lock(cp, F_WRLCK, cause) != 0)
+		return (-1);
+
+	hlen = xsnprintf(hdr, sizeof hdr, "%zu\n", len);
+	hoff = off = 0;
+
+	rsize = IO_BLOCKSIZE;
+	rbuf = xmalloc(rsize);
+	rlen = 0;
+	want = SIZE_MAX;
+	size = 0;
+
+	/*
+	 * Read while writing, so a command which replies before reading all of
+	 * a large mail can't block. It must still read the whole mail, so the
+	 * rest is written after the reply, and anything after the reply is an
+	 * error since it would be taken as the reply for the next mail.
+	 */
+	while (want == SIZE_MAX || rlen < want || hoff < hlen || off < len) {
+		pfd[0].fd = -1;
+		if (hoff < hlen || off < len)
+			pfd[0].fd = cp->in;
+		pfd[0].events = POLLOUT;
+		pfd[1].fd = cp->out;
+		pfd[1].events = POLLIN;
+
+		switch (poll(pfd, 2, timeout)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			xasprintf(cause, "poll: %s", strerror(errno));
+			goto error;
+		case 0:
+			xasprintf(cause, "timed out");
+			goto error;
+		}
+
+		if (pfd[0].fd != -1 && pfd[0].revents != 0) {
+			if (hoff < hlen)
+				n = write(cp->in, hdr + hoff, hlen - hoff);
+			else
+				n = write(cp->in, buf + off, len - off);
+			if (n == -1 && errno != EINTR && errno != EAGAIN) {
+				xasprintf(cause, "write: %s", strerror(errno));
+				goto error;
+			}
+			if (n > 0 && hoff < hlen)
+				hoff += n;
+			else if (n > 0)
+				off += n;
+		}
+
+		if (pfd[1].revents == 0)
+			continue;
+		if (rsize - rlen < IO_BLOCKSIZE) {
+			rbuf = xrealloc(rbuf, 2, rsize);
+			rsize *= 2;
+		}
+		n = read(cp->out, rbuf + rlen, rsize - rlen);
+		if (n == 0) {
+			xasprintf(cause, "coprocess closed");
+			goto error;
+		}
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			xasprintf(cause, "read: %s", strerror(errno));
+			goto error;
+		}
+		rlen += n;
+
+		if (want != SIZE_MAX) {
+			if (rlen > want) {
+				xasprintf(cause, "invalid reply");
+				goto error;
+			}
+			continue;
+		}
+		if ((ptr = memchr(rbuf, '\n', rlen)) == NULL) {
+			if (rlen >= sizeof hdr) {
+				xasprintf(cause, "invalid reply");
+				goto error;
+			}
+			continue;
+		}
+		*ptr = '\0';
+		if (coproc_header(rbuf, status, &size) != 0) {
+			xasprintf(cause, "invalid reply");
+			goto error;
+		}
+		want = (ptr + 1 - rbuf) + size;
+
+		/* Make room for the whole reply now its size is known. */
+		if (want + 1 > rsize) {
+			rbuf = xrealloc(rbuf, 1, want + 1);
+			rsize = want + 1;
+		}
+		if (rlen > want) {
+			xasprintf(cause, "invalid reply");
+			goto error;
+		}
+	}
+
+	memmove(rbuf, rbuf + (want - size), size);
+	rbuf[size] = '\0';
+	*out = rbuf;
+	*outlen = size;
+
+	coproc_lock(cp, F_UNLCK, NULL);
+	return (0);
+
+error:
+	xfree(rbuf);
+	kill(cp->pid, SIGTERM);
+	coproc_lock(cp, F_UNLCK, NULL);
+	return (-1);
+}
@@ -19,8 +19,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifndef _PUBLIC_
 #define _PUBLIC_
@@ -32,17 +36,84 @@
 int	db_print_item(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *);
 int	db_expire_item(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *);
 int	db_clear_item(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *);
+int	db_fill_bloom_item(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *);
+int	db_upgrade_item(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *);
+int	db_upgrade_cmp(const void *, const void *);
+int	db_create(TDB_CONTEXT *);
+int	db_get_header(TDB_CONTEXT *, struct cacheheader *);
+int	db_put_header(TDB_CONTEXT *, struct cacheheader *);
+int	db_get_shard(TDB_CONTEXT *, u_int, struct cacheshard *);
+int	db_put_shard(TDB_CONTEXT *, u_int, struct cacheshard *);
+u_int	db_shard(const char *, size_t);
+size_t	db_shard_key(char *, u_int);
+size_t	db_chunk_key(char *, uint64_t, u_int, uint64_t);
+int	db_lock(TDB_CONTEXT *, TDB_DATA);
+void	db_unlock(TDB_CONTEXT *, TDB_DATA);
+int	db_lock_all(TDB_CONTEXT *);
+void	db_unlock_all(TDB_CONTEXT *);
+int	db_index(TDB_CONTEXT *, u_int, struct cacheshard *, TDB_DATA, uint64_t);
+void	db_mark(TDB_CONTEXT *, struct cachemark *, int, u_int,
+	    struct cacheshard *);
+int	db_update_chunk(TDB_CONTEXT *, struct bloom *, uint64_t, u_int,
+	    uint64_t, size_t, size_t *);
+int	db_expire_chunks(TDB_CONTEXT *, u_int, uint64_t, uint64_t);
+
+/*
+ * As well as the items themselves, the database holds a header with the
+ * format version and the oldest bucket, and the keys are split by hash into
+ * DB_SHARDS shards. Each shard has a fixed-size record with its number of
+ * items and where its keys are being added, and for each bucket of
+ * DB_BUCKETTIME seconds a list of chunks of at most DB_CHUNKKEYS keys added
+ * during it. Adding a key therefore only rewrites its shard record and one
+ * small chunk, and expiry only needs to look at the buckets which have passed
+ * since it was last run rather than every item.
+ *
+ * These records have keys starting with a NUL so cannot clash with items. None
+ * of them is ever the size of a struct cacheitem, so older versions of fdm,
+ * which expect every record to be an item, fail to list, expire or clear the
+ * cache rather than taking them for items. Databases from earlier versions,
+ * which have no header, are used as they are, with only the items, until they
+ * are upgraded.
+ */
+#define DB_ISMETA(key) ((key).dsize > 0 && (key).dptr[0] == '\0')
+
+struct dbupgrade {
+	uint64_t	 tim;
+	char		*key;
+	size_t		 len;
+};
+ARRAY_DECL(dbupgrades, struct dbupgrade);
+
+static char	 db_hdrkey[] = "\0header";
+
+/* Database with a transaction open, which holds every lock already. */
+static TDB_CONTEXT *db_txn;
 
 TDB_CONTEXT *
 db_open(char *path)
 {
 	TDB_CONTEXT	*db;
+	u_int		 version;
 
 #ifndef DB_UNSAFE
-	db = tdb_open(path, 0, 0, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	db = tdb_open(path, 0, TDB_SEQNUM, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
 #else
-	db = tdb_open(path, 0, TDB_NOLOCK, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	db = tdb_open(path, 0, TDB_NOLOCK|TDB_SEQNUM,
+	    O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
 #endif
+	if (db == NULL)
+		return (NULL);
+
+	if ((version = db_version(db)) > DB_VERSION) {
+		log_warnx("%s: cache version %u not supported", path, version);
+		tdb_close(db);
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (version != DB_VERSION && db_create(db) != 0) {
+		tdb_close(db);
+		return (NULL);
+	}
 	return (db);
 }
 
@@ -53,34 +124,513 @@ db_close(TDB_CONTEXT *db)
 }
 
 int
-db_add(TDB_CONTEXT *db, char *k)
+db_lock(TDB_CONTEXT *db, TDB_DATA key)
+{
+	if (db == db_txn)
+		return (0);
+	return (tdb_chainlock(db, key));
+}
+
+void
+db_unlock(TDB_CONTEXT *db, TDB_DATA key)
+{
+	if (db == db_txn)
+		return;
+	tdb_chainunlock(db, key);
+}
+
+/*
+ * Lock the database for a change to more than one record. This is the chain
+ * lock of the header and must be taken before any other: tdb_store and the
+ * rest lock the chains of the records they change, which may be shared with
+ * other records, so if two processes could each hold one chain lock while
+ * waiting for another they could deadlock. With this held first, only one
+ * process at a time does that.
+ */
+int
+db_lock_all(TDB_CONTEXT *db)
+{
+	TDB_DATA	key;
+
+	key.dptr = db_hdrkey;
+	key.dsize = (sizeof db_hdrkey) - 1;
+
+	return (db_lock(db, key));
+}
+
+void
+db_unlock_all(TDB_CONTEXT *db)
+{
+	TDB_DATA	key;
+
+	key.dptr = db_hdrkey;
+	key.dsize = (sizeof db_hdrkey) - 1;
+
+	db_unlock(db, key);
+}
+
+/* Return the version of the database. Those with no header are version 1. */
+u_int
+db_version(TDB_CONTEXT *db)
+{
+	TDB_DATA		key, value;
+	struct cacheheader	hdr;
+
+	key.dptr = db_hdrkey;
+	key.dsize = (sizeof db_hdrkey) - 1;
+
+	value = tdb_fetch(db, key);
+	if (value.dptr == NULL)
+		return (1);
+	if (value.dsize < sizeof hdr.magic + sizeof hdr.version) {
+		free(value.dptr);
+		return (1);
+	}
+	memcpy(&hdr, value.dptr, sizeof hdr.magic + sizeof hdr.version);
+	free(value.dptr);
+
+	if (letoh32(hdr.magic) != DB_MAGIC)
+		return (1);
+	return (letoh32(hdr.version));
+}
+
+/*
+ * Give an empty database the current header. Databases with items from an
+ * earlier version are left as they are, so older versions of fdm can still
+ * use them, until db_upgrade is asked for.
+ */
+int
+db_create(TDB_CONTEXT *db)
+{
+	struct cacheheader	hdr;
+	TDB_DATA		key;
+
+	if (db_lock_all(db) != 0)
+		return (-1);
+	if (db_version(db) != DB_VERSION) {
+		key = tdb_firstkey(db);
+		if (key.dptr != NULL)
+			free(key.dptr);
+		else {
+			hdr.first = time(NULL) / DB_BUCKETTIME;
+			if (db_put_header(db, &hdr) != 0) {
+				db_unlock_all(db);
+				return (-1);
+			}
+		}
+	}
+	db_unlock_all(db);
+	return (0);
+}
+
+int
+db_get_header(TDB_CONTEXT *db, struct cacheheader *hdr)
+{
+	TDB_DATA	key, value;
+
+	key.dptr = db_hdrkey;
+	key.dsize = (sizeof db_hdrkey) - 1;
+
+	value = tdb_fetch(db, key);
+	if (value.dptr == NULL)
+		return (-1);
+	if (value.dsize != sizeof *hdr) {
+		free(value.dptr);
+		return (-1);
+	}
+	memcpy(hdr, value.dptr, sizeof *hdr);
+	free(value.dptr);
+
+	if (letoh32(hdr->magic) != DB_MAGIC)
+		return (-1);
+	if (letoh32(hdr->version) != DB_VERSION)
+		return (-1);
+	hdr->first = letoh64(hdr->first);
+	return (0);
+}
+
+int
+db_put_header(TDB_CONTEXT *db, struct cacheheader *hdr)
+{
+	TDB_DATA		key, value;
+	struct cacheheader	v;
+
+	memset(&v, 0, sizeof v);
+	v.magic = htole32(DB_MAGIC);
+	v.version = htole32(DB_VERSION);
+	v.first = htole64(hdr->first);
+
+	key.dptr = db_hdrkey;
+	key.dsize = (sizeof db_hdrkey) - 1;
+
+	value.dptr = (char *) &v;
+	value.dsize = sizeof v;
+
+	return (tdb_store(db, key, value, TDB_REPLACE));
+}
+
+/* Get a shard record. A missing record is an empty shard. */
+int
+db_get_shard(TDB_CONTEXT *db, u_int shard, struct cacheshard *sh)
+{
+	TDB_DATA	key, value;
+	char		buf[DB_BUCKETKEYLEN];
+
+	key.dptr = buf;
+	key.dsize = db_shard_key(buf, shard);
+
+	value = tdb_fetch(db, key);
+	if (value.dptr == NULL) {
+		memset(sh, 0, sizeof *sh);
+		return (0);
+	}
+	if (value.dsize != sizeof *sh) {
+		free(value.dptr);
+		return (-1);
+	}
+	memcpy(sh, value.dptr, sizeof *sh);
+	free(value.dptr);
+
+	sh->items = letoh64(sh->items);
+	sh->bucket = letoh64(sh->bucket);
+	sh->chunk = letoh64(sh->chunk);
+	sh->keys = letoh32(sh->keys);
+	sh->size = letoh32(sh->size);
+	return (0);
+}
+
+int
+db_put_shard(TDB_CONTEXT *db, u_int shard, struct cacheshard *sh)
+{
+	TDB_DATA		key, value;
+	struct cacheshard	v;
+	char			buf[DB_BUCKETKEYLEN];
+
+	memset(&v, 0, sizeof v);
+	v.items = htole64(sh->items);
+	v.bucket = htole64(sh->bucket);
+	v.chunk = htole64(sh->chunk);
+	v.keys = htole32(sh->keys);
+	v.size = htole32(sh->size);
+
+	key.dptr = buf;
+	key.dsize = db_shard_key(buf, shard);
+
+	value.dptr = (char *) &v;
+	value.dsize = sizeof v;
+
+	return (tdb_store(db, key, value, TDB_REPLACE));
+}
+
+/* Find the shard for a key. This is part of the file format. */
+u_int
+db_shard(const char *k, size_t len)
+{
+	const u_char	*p = k;
+	uint32_t	 h;
+
+	h = 2166136261U;
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return (h % DB_SHARDS);
+}
+
+/* Fill in the key for a shard record. */
+size_t
+db_shard_key(char *buf, u_int shard)
+{
+	int	n;
+
+	buf[0] = '\0';
+	n = snprintf(buf + 1, DB_BUCKETKEYLEN - 1, "shard %u", shard);
+	return (n + 1);
+}
+
+/* Fill in the key for a chunk of a bucket. */
+size_t
+db_chunk_key(char *buf, uint64_t bucket, u_int shard, uint64_t chunk)
+{
+	int	n;
+
+	buf[0] = '\0';
+	n = snprintf(buf + 1, DB_BUCKETKEYLEN - 1, "bucket %llu %u %llu",
+	    (unsigned long long) bucket, shard, (unsigned long long) chunk);
+	if (n >= DB_BUCKETKEYLEN - 1)
+		n = DB_BUCKETKEYLEN - 2;
+	return (n + 1);
+}
+
+/*
+ * Add a key added at tim to the bucket's chunks for its shard, starting a new
+ * chunk when the last is full. The shard record is updated but not written.
+ */
+int
+db_index(TDB_CONTEXT *db, u_int shard, struct cacheshard *sh, TDB_DATA key,
+    uint64_t tim)
+{
+	TDB_DATA	bkey, bvalue;
+	char		buf[DB_BUCKETKEYLEN];
+	uint64_t	bucket;
+	int		error;
+
+	bucket = tim / DB_BUCKETTIME;
+	if (bucket != sh->bucket) {
+		sh->bucket = bucket;
+		sh->chunk = 0;
+		sh->keys = 0;
+		sh->size = 0;
+	} else if (sh->keys >= DB_CHUNKKEYS) {
+		sh->chunk++;
+		sh->keys = 0;
+		sh->size = 0;
+	}
+
+	bkey.dptr = buf;
+	bkey.dsize = db_chunk_key(buf, sh->bucket, shard, sh->chunk);
+
+	/*
+	 * The key with its terminator, and another if the chunk would be the
+	 * size of an item. Empty keys are skipped when the chunk is read.
+	 */
+	bvalue.dsize = key.dsize + 1;
+	if (sh->size + bvalue.dsize == sizeof (struct cacheitem))
+		bvalue.dsize++;
+	bvalue.dptr = xcalloc(1, bvalue.dsize);
+	memcpy(bvalue.dptr, key.dptr, key.dsize);
+
+	error = tdb_append(db, bkey, bvalue);
+	xfree(bvalue.dptr);
+	if (error != 0)
+		return (-1);
+
+	sh->keys++;
+	sh->size += bvalue.dsize;
+	return (0);
+}
+
+int
+db_upgrade_item(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA value, void *ptr)
+{
+	struct dbupgrades	*items = ptr;
+	struct dbupgrade	 item;
+	struct cacheitem	 v;
+
+	/* Anything left from an earlier format is rebuilt. */
+	if (DB_ISMETA(key))
+		return (tdb_delete(tdb, key));
+	if (value.dsize != sizeof v)
+		return (-1);
+	memcpy(&v, value.dptr, sizeof v);
+
+	item.tim = letoh64(v.tim);
+	item.key = xmalloc(key.dsize);
+	memcpy(item.key, key.dptr, key.dsize);
+	item.len = key.dsize;
+	ARRAY_ADD(items, item);
+
+	return (0);
+}
+
+int
+db_upgrade_cmp(const void *ptr1, const void *ptr2)
+{
+	const struct dbupgrade	*item1 = ptr1, *item2 = ptr2;
+
+	if (item1->tim < item2->tim)
+		return (-1);
+	return (item1->tim > item2->tim);
+}
+
+/*
+ * Add the header, shards and buckets to a database from an earlier version.
+ * This needs one pass over every item and is only done when asked for, since
+ * older versions of fdm can't use the database afterwards. The items are
+ * sorted by time so the chunks of each bucket can be filled in order.
+ */
+int
+db_upgrade(TDB_CONTEXT *db)
+{
+	struct dbupgrades	 items;
+	struct dbupgrade	*item;
+	struct cacheheader	 hdr;
+	struct cacheshard	 shards[DB_SHARDS];
+	TDB_DATA		 key;
+	u_int			 version, i, shard;
+
+	if (db_lock_all(db) != 0)
+		return (-1);
+	if ((version = db_version(db)) >= DB_VERSION) {
+		db_unlock_all(db);
+		return (0);
+	}
+
+	ARRAY_INIT(&items);
+	if (tdb_traverse(db, db_upgrade_item, &items) == -1)
+		goto error;
+	if (!ARRAY_EMPTY(&items)) {
+		qsort(ARRAY_DATA(&items), ARRAY_LENGTH(&items),
+		    ARRAY_ITEMSIZE(&items), db_upgrade_cmp);
+	}
+
+	memset(shards, 0, sizeof shards);
+	hdr.first = time(NULL) / DB_BUCKETTIME;
+	for (i = 0; i < ARRAY_LENGTH(&items); i++) {
+		item = &ARRAY_ITEM(&items, i);
+		if (i == 0 && item->tim / DB_BUCKETTIME < hdr.first)
+			hdr.first = item->tim / DB_BUCKETTIME;
+
+		key.dptr = item->key;
+		key.dsize = item->len;
+		shard = db_shard(item->key, item->len);
+		if (db_index(db, shard, &shards[shard], key, item->tim) != 0)
+			goto error;
+		shards[shard].items++;
+	}
+	for (i = 0; i < DB_SHARDS; i++) {
+		if (db_put_shard(db, i, &shards[i]) != 0)
+			goto error;
+	}
+	if (db_put_header(db, &hdr) != 0)
+		goto error;
+
+	for (i = 0; i < ARRAY_LENGTH(&items); i++)
+		xfree(ARRAY_ITEM(&items, i).key);
+	ARRAY_FREE(&items);
+
+	db_unlock_all(db);
+	return (0);
+
+error:
+	for (i = 0; i < ARRAY_LENGTH(&items); i++)
+		xfree(ARRAY_ITEM(&items, i).key);
+	ARRAY_FREE(&items);
+
+	db_unlock_all(db);
+	return (-1);
+}
+
+/*
+ * Move a filter's mark past a change just made with the database locked. Each
+ * shard whose mark was the sequence number before the change has seen
+ * everything else, so its mark becomes the new sequence number and, for the
+ * shard which was changed, its new index position. Others are left to be
+ * brought up to date when next used.
+ */
+void
+db_mark(TDB_CONTEXT *db, struct cachemark *mark, int before, u_int shard,
+    struct cacheshard *sh)
+{
+	int	after;
+	u_int	i;
+
+	if (mark == NULL)
+		return;
+	after = tdb_get_seqnum(db);
+
+	for (i = 0; i < DB_SHARDS; i++) {
+		if (mark->seqnum[i] != before)
+			continue;
+		mark->seqnum[i] = after;
+		if (i == shard && sh != NULL)
+			memcpy(&mark->shard[i], sh, sizeof mark->shard[i]);
+	}
+}
+
+/* Add a key. If mark is given, it is moved past the change. */
+int
+db_add(TDB_CONTEXT *db, char *k, struct cachemark *mark)
 {
 	TDB_DATA		key, value;
 	struct cacheitem	v;
+	struct cacheshard	sh;
 	uint64_t		tim;
+	u_int			shard;
+	int			before, exists;
+
+	key.dptr = k;
+	key.dsize = strlen(k);
+	shard = db_shard(key.dptr, key.dsize);
 
 	memset(&v, 0, sizeof v);
 	tim = time(NULL);
 	v.tim = htole64(tim);
 
-	key.dptr = k;
-	key.dsize = strlen(k);
-
 	value.dptr = (char *) &v;
 	value.dsize = sizeof v;
 
-	return (tdb_store(db, key, value, TDB_REPLACE));
+	if (db_lock_all(db) != 0)
+		return (-1);
+	if (db_version(db) != DB_VERSION) {
+		if (tdb_store(db, key, value, TDB_REPLACE) != 0)
+			goto error;
+		db_unlock_all(db);
+		return (0);
+	}
+	before = tdb_get_seqnum(db);
+	if (db_get_shard(db, shard, &sh) != 0)
+		goto error;
+
+	exists = tdb_exists(db, key);
+	if (tdb_store(db, key, value, TDB_REPLACE) != 0)
+		goto error;
+	if (db_index(db, shard, &sh, key, tim) != 0)
+		goto error;
+	if (!exists)
+		sh.items++;
+	if (db_put_shard(db, shard, &sh) != 0)
+		goto error;
+
+	db_mark(db, mark, before, shard, &sh);
+	db_unlock_all(db);
+	return (0);
+
+error:
+	db_unlock_all(db);
+	return (-1);
 }
 
+/* Remove a key. The filter still has it, which only costs a lookup. */
 int
-db_remove(TDB_CONTEXT *db, char *k)
+db_remove(TDB_CONTEXT *db, char *k, struct cachemark *mark)
 {
 	TDB_DATA		key;
+	struct cacheshard	sh;
+	u_int			shard;
+	int			before;
 
 	key.dptr = k;
 	key.dsize = strlen(k);
+	shard = db_shard(key.dptr, key.dsize);
+
+	if (db_lock_all(db) != 0)
+		return (-1);
+	if (db_version(db) != DB_VERSION) {
+		if (tdb_delete(db, key) != 0)
+			goto error;
+		db_unlock_all(db);
+		return (0);
+	}
+	before = tdb_get_seqnum(db);
+	if (db_get_shard(db, shard, &sh) != 0)
+		goto error;
+
+	/* The key is left in its chunk and skipped when it is expired. */
+	if (tdb_delete(db, key) != 0)
+		goto error;
+	if (sh.items > 0)
+		sh.items--;
+	if (db_put_shard(db, shard, &sh) != 0)
+		goto error;
 
-	return (tdb_delete(db, key));
+	db_mark(db, mark, before, shard, NULL);
+	db_unlock_all(db);
+	return (0);
+
+error:
+	db_unlock_all(db);
+	return (-1);
 }
 
 int
@@ -97,7 +647,22 @@ db_contains(TDB_CONTEXT *db, char *k)
 int
 db_size(TDB_CONTEXT *db)
 {
-	return (tdb_traverse(db, NULL, NULL));
+	struct cacheshard	sh;
+	uint64_t		items;
+	u_int			i;
+
+	if (db_version(db) != DB_VERSION)
+		return (tdb_traverse(db, NULL, NULL));
+
+	items = 0;
+	for (i = 0; i < DB_SHARDS; i++) {
+		if (db_get_shard(db, i, &sh) != 0)
+			return (-1);
+		items += sh.items;
+	}
+	if (items > INT_MAX)
+		return (INT_MAX);
+	return (items);
 }
 
 int
@@ -108,6 +673,8 @@ db_print_item(
 	struct cacheitem	v;
 	uint64_t		tim;
 
+	if (DB_ISMETA(key))
+		return (0);
 	if (value.dsize != sizeof v)
 		return (-1);
 	memcpy(&v, value.dptr, sizeof v);
@@ -126,6 +693,69 @@ db_print(TDB_CONTEXT *db, void (*p)(const char *, ...))
 	return (0);
 }
 
+/*
+ * Expire the items in a shard's chunks of a bucket which are older than lim.
+ * The database must be locked.
+ */
+int
+db_expire_chunks(TDB_CONTEXT *db, u_int shard, uint64_t bucket, uint64_t lim)
+{
+	TDB_DATA		key, value, bkey, bvalue;
+	struct cacheitem	v;
+	struct cacheshard	sh;
+	char			buf[DB_BUCKETKEYLEN], *ptr, *end;
+	uint64_t		chunk;
+
+	if (db_get_shard(db, shard, &sh) != 0)
+		return (-1);
+
+	bkey.dptr = buf;
+	for (chunk = 0;; chunk++) {
+		bkey.dsize = db_chunk_key(buf, bucket, shard, chunk);
+		bvalue = tdb_fetch(db, bkey);
+		if (bvalue.dptr == NULL)
+			break;
+
+		ptr = bvalue.dptr;
+		end = ptr + bvalue.dsize;
+		while (ptr < end) {
+			key.dptr = ptr;
+			key.dsize = strnlen(ptr, end - ptr);
+			ptr += key.dsize + 1;
+			if (key.dsize == 0)
+				continue;
+
+			/*
+			 * The item may have been removed, or added again later
+			 * and so also be in a newer bucket.
+			 */
+			value = tdb_fetch(db, key);
+			if (value.dptr == NULL)
+				continue;
+			if (value.dsize != sizeof v) {
+				free(value.dptr);
+				continue;
+			}
+			memcpy(&v, value.dptr, sizeof v);
+			free(value.dptr);
+			if (letoh64(v.tim) >= lim)
+				continue;
+
+			if (tdb_delete(db, key) != 0) {
+				free(bvalue.dptr);
+				return (-1);
+			}
+			if (sh.items > 0)
+				sh.items--;
+		}
+		free(bvalue.dptr);
+
+		if (tdb_delete(db, bkey) != 0)
+			return (-1);
+	}
+	return (db_put_shard(db, shard, &sh));
+}
+
 int
 db_expire_item(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA value, void *ptr)
 {
@@ -141,34 +771,260 @@ db_expire_item(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA value, void *ptr)
 	return (0);
 }
 
+/*
+ * Expire items older than age. Only buckets which have ended since the last
+ * expiry are examined, so items may outlive age by up to DB_BUCKETTIME. Keys
+ * are added to the bucket for the time they are added with the database
+ * locked, so nothing can be added to a bucket after it has ended. Databases
+ * which have not been upgraded have no buckets and every item is read.
+ */
 int
 db_expire(TDB_CONTEXT *db, uint64_t age)
 {
-	uint64_t	lim;
+	struct cacheheader	hdr;
+	uint64_t		lim, last;
+	u_int			i;
 
 	lim = time(NULL);
 	if (lim <= age)
 		return (0);
 	lim -= age;
+	last = lim / DB_BUCKETTIME;
 
-	if (tdb_traverse(db, db_expire_item, &lim) == -1)
+	if (db_lock_all(db) != 0)
 		return (-1);
+	if (db_version(db) != DB_VERSION) {
+		if (tdb_traverse(db, db_expire_item, &lim) == -1)
+			goto error;
+		db_unlock_all(db);
+		return (0);
+	}
+	if (db_get_header(db, &hdr) != 0)
+		goto error;
+
+	for (; hdr.first < last; hdr.first++) {
+		for (i = 0; i < DB_SHARDS; i++) {
+			if (db_expire_chunks(db, i, hdr.first, lim) != 0)
+				goto error;
+		}
+	}
+	if (db_put_header(db, &hdr) != 0)
+		goto error;
+
+	db_unlock_all(db);
 	return (0);
+
+error:
+	db_unlock_all(db);
+	return (-1);
 }
 
 int
-db_clear_item(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA value, unused void *ptr)
+db_clear_item(
+    TDB_CONTEXT *tdb, TDB_DATA key, unused TDB_DATA value, unused void *ptr)
 {
-	if (value.dsize != sizeof (struct cacheitem))
-		return (-1);
-
 	return (tdb_delete(tdb, key));
 }
 
+/*
+ * Remove everything. Missing shard records are empty so only the header is
+ * put back, if there was one.
+ */
 int
 db_clear(TDB_CONTEXT *db)
 {
+	struct cacheheader	hdr;
+	u_int			version;
+
+	if (db_lock_all(db) != 0)
+		return (-1);
+	version = db_version(db);
+
 	if (tdb_traverse(db, db_clear_item, NULL) == -1)
+		goto error;
+	if (version != DB_VERSION) {
+		db_unlock_all(db);
+		return (0);
+	}
+
+	hdr.first = time(NULL) / DB_BUCKETTIME;
+	if (db_put_header(db, &hdr) != 0)
+		goto error;
+
+	db_unlock_all(db);
+	return (0);
+
+error:
+	db_unlock_all(db);
+	return (-1);
+}
+
+/*
+ * Start a transaction, so a set of changes is written all at once. Chain locks
+ * are not taken while it is open.
+ */
+int
+db_begin(TDB_CONTEXT *db)
+{
+	if (tdb_transaction_start(db) != 0)
 		return (-1);
+	db_txn = db;
+	return (0);
+}
+
+int
+db_commit(TDB_CONTEXT *db)
+{
+	db_txn = NULL;
+	return (tdb_transaction_commit(db));
+}
+
+void
+db_cancel(TDB_CONTEXT *db)
+{
+	db_txn = NULL;
+	tdb_transaction_cancel(db);
+}
+
+int
+db_fill_bloom_item(
+    unused TDB_CONTEXT *tdb, TDB_DATA key, unused TDB_DATA value, void *ptr)
+{
+	struct bloom	*b = ptr;
+
+	if (!DB_ISMETA(key))
+		bloom_add(b, key.dptr, key.dsize);
+	return (0);
+}
+
+/*
+ * Fill a filter with every key. The mark is taken first, so keys added while
+ * the keys are read are either read or found by db_update_bloom later. Keys
+ * added to an empty shard will be in the current bucket or a later one.
+ * Databases which have not been upgraded have no index to mark.
+ */
+int
+db_fill_bloom(TDB_CONTEXT *db, struct bloom *b, struct cachemark *mark)
+{
+	int	seqnum;
+	u_int	i;
+
+	if (db_version(db) != DB_VERSION)
+		return (-1);
+
+	seqnum = tdb_get_seqnum(db);
+	for (i = 0; i < DB_SHARDS; i++) {
+		mark->seqnum[i] = seqnum;
+		if (db_get_shard(db, i, &mark->shard[i]) != 0)
+			return (-1);
+		if (mark->shard[i].bucket == 0)
+			mark->shard[i].bucket = time(NULL) / DB_BUCKETTIME;
+	}
+
+	if (tdb_traverse(db, db_fill_bloom_item, b) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Add the keys in a chunk from off to a filter. Returns 1 if there is no such
+ * chunk, otherwise 0 with its size in len.
+ */
+int
+db_update_chunk(TDB_CONTEXT *db, struct bloom *b, uint64_t bucket, u_int shard,
+    uint64_t chunk, size_t off, size_t *len)
+{
+	TDB_DATA	bkey, bvalue;
+	char		buf[DB_BUCKETKEYLEN], *ptr, *end;
+	size_t		n;
+
+	bkey.dptr = buf;
+	bkey.dsize = db_chunk_key(buf, bucket, shard, chunk);
+	bvalue = tdb_fetch(db, bkey);
+	if (bvalue.dptr == NULL)
+		return (1);
+
+	ptr = bvalue.dptr;
+	end = ptr + bvalue.dsize;
+	if (off < bvalue.dsize)
+		ptr += off;
+	else
+		ptr = end;
+	while (ptr < end) {
+		n = strnlen(ptr, end - ptr);
+		if (n != 0)
+			bloom_add(b, ptr, n);
+		ptr += n + 1;
+	}
+	*len = bvalue.dsize;
+
+	free(bvalue.dptr);
+	return (0);
+}
+
+/*
+ * Bring a filter up to date for the shard of a key, whoever has changed the
+ * database. If its mark is not the current sequence number, the keys added to
+ * the shard's chunks since it was taken are added to the filter: keys are
+ * only ever appended to the last chunk of the current bucket. Keys removed
+ * by others are left in the filter, which only costs a lookup. Returns -1 if
+ * the filter can't be brought up to date, for example because the chunks it
+ * had read were rebuilt, and must not be used.
+ */
+int
+db_update_bloom(TDB_CONTEXT *db, struct bloom *b, struct cachemark *mark,
+    char *k)
+{
+	struct cacheshard	 sh, *pos;
+	uint64_t		 bucket, chunk;
+	size_t			 off, len;
+	u_int			 shard;
+	int			 seqnum;
+
+	shard = db_shard(k, strlen(k));
+	seqnum = tdb_get_seqnum(db);
+	if (mark->seqnum[shard] == seqnum)
+		return (0);
+
+	if (db_get_shard(db, shard, &sh) != 0)
+		return (-1);
+	pos = &mark->shard[shard];
+
+	/* Nothing has been added to an empty or cleared shard. */
+	if (sh.bucket == 0) {
+		mark->seqnum[shard] = seqnum;
+		return (0);
+	}
+	if (sh.bucket < pos->bucket ||
+	    sh.bucket - pos->bucket > DB_MARKBUCKETS)
+		return (-1);
+	if (sh.bucket == pos->bucket && (sh.chunk < pos->chunk ||
+	    (sh.chunk == pos->chunk && sh.size < pos->size)))
+		return (-1);
+
+	/*
+	 * Read from where the mark was to the shard's last chunk. Buckets
+	 * between may have any number of chunks, so stop at the first missing.
+	 */
+	for (bucket = pos->bucket; bucket <= sh.bucket; bucket++) {
+		chunk = 0;
+		off = 0;
+		if (bucket == pos->bucket) {
+			chunk = pos->chunk;
+			off = pos->size;
+		}
+		for (;; chunk++) {
+			if (bucket == sh.bucket && chunk > sh.chunk)
+				break;
+			if (db_update_chunk(db, b, bucket, shard, chunk, off,
+			    &len) != 0)
+				break;
+			pos->bucket = bucket;
+			pos->chunk = chunk;
+			pos->size = len;
+			off = 0;
+		}
+	}
+	mark->seqnum[shard] = seqnum;
 	return (0);
 }
@@ -53,7 +53,7 @@ deliver_add_to_cache_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 		if (strcmp(data->path, cache->path) == 0) {
 			if (open_cache(a, cache) != 0)
 				goto error;
-			if (db_add(cache->db, key) != 0) {
+			if (cache_add(a, cache, key) != 0) {
 				log_warnx("%s: error adding to cache %s: %s",
 				    a->name, cache->path, key);
 				goto error;
@@ -49,9 +49,36 @@ int	 deliver_imap_waitcontinue(struct account *, struct fetch_ctx *,
 int	 deliver_imap_waitappend(struct account *, struct fetch_ctx *,
 	     struct io *, char **);
 
+struct deliver_imap_session *deliver_imap_find(struct deliver_imap_data *);
+struct deliver_imap_session *deliver_imap_open(
+	     struct account *, struct deliver_imap_data *);
+void	 deliver_imap_free(struct deliver_imap_session *, int);
+int	 deliver_imap_literal(struct account *, struct deliver_imap_session *,
+	     const char *, size_t, char **);
+int	 deliver_imap_append(struct account *, struct deliver_imap_session *,
+	     struct mail *, const char *);
+int	 deliver_imap_create(struct account *, struct deliver_imap_session *,
+	     const char *);
+
+/*
+ * An open, logged in connection to a server. Delivery is done in the fetch
+ * child, so these are kept for every mail from the account and closed when it
+ * has finished.
+ */
+struct deliver_imap_session {
+	struct account		*account;
+
+	struct fetch_imap_data	 fdata;
+	struct fetch_ctx	 fctx;
+
+	TAILQ_ENTRY(deliver_imap_session) entry;
+};
+TAILQ_HEAD(, deliver_imap_session) deliver_imap_sessions =
+    TAILQ_HEAD_INITIALIZER(deliver_imap_sessions);
+
 struct deliver deliver_imap = {
 	"imap",
-	DELIVER_ASUSER,
+	DELIVER_INCHILD,
 	deliver_imap_deliver,
 	deliver_imap_desc
 };
@@ -138,11 +165,11 @@ deliver_imap_waitappend(struct account *a, struct fetch_ctx *fctx,
 
 	for (;;) {
 		if (deliver_imap_poll(a, io) != 0) {
-			line = NULL;
+			*line = NULL;
 			return (IMAP_TAG_ERROR);
 		}
 		if (data->getln(a, fctx, line) != 0) {
-			line = NULL;
+			*line = NULL;
 			return (IMAP_TAG_ERROR);
 		}
 		if (*line == NULL)
@@ -160,18 +187,43 @@ deliver_imap_waitappend(struct account *a, struct fetch_ctx *fctx,
 	return (tag);
 }
 
-int
-deliver_imap_deliver(struct deliver_ctx *dctx, struct actitem *ti)
+/* Find an open session for a server and user. */
+struct deliver_imap_session *
+deliver_imap_find(struct deliver_imap_data *data)
 {
-	struct account			*a = dctx->account;
-	struct mail			*m = dctx->mail;
-	struct deliver_imap_data	*data = ti->data;
+	struct deliver_imap_session	*ds;
+	struct fetch_imap_data		*fdata;
+
+	TAILQ_FOREACH(ds, &deliver_imap_sessions, entry) {
+		fdata = &ds->fdata;
+		if (fdata->server.ssl != data->server.ssl)
+			continue;
+		if (strcmp(fdata->server.host, data->server.host) != 0)
+			continue;
+		if (strcmp(fdata->server.port, data->server.port) != 0)
+			continue;
+		if (fdata->user == NULL || data->user == NULL) {
+			if (fdata->user != data->user)
+				continue;
+		} else if (strcmp(fdata->user, data->user) != 0)
+			continue;
+		return (ds);
+	}
+	return (NULL);
+}
+
+/* Connect and log in, using the fetch code until select1 is reached. */
+struct deliver_imap_session *
+deliver_imap_open(struct account *a, struct deliver_imap_data *data)
+{
+	struct deliver_imap_session	*ds;
+	struct fetch_imap_data		*fdata;
 	struct io			*io;
-	struct fetch_ctx		 fctx;
-	struct fetch_imap_data		 fdata;
-	char				*cause, *folder, *ptr, *line;
-	size_t				 len, maillen;
-	u_int				 total, body;
+	char				*cause;
+	void				*old;
+
+	ds = xcalloc(1, sizeof *ds);
+	ds->account = a;
 
 	/* Connect to the IMAP server. */
 	io = connectproxy(&data->server,
@@ -179,54 +231,126 @@ deliver_imap_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	if (io == NULL) {
 		log_warnx("%s: %s", a->name, cause);
 		xfree(cause);
-		return (DELIVER_FAILURE);
+		xfree(ds);
+		return (NULL);
 	}
 	if (conf.debug > 3 && !conf.syslog)
 		io->dup_fd = STDOUT_FILENO;
 
-	/* Work out the folder name. */
-	folder = replacestr(&data->folder, m->tags, m, &m->rml);
-	if (folder == NULL || *folder == '\0') {
-		log_warnx("%s: empty folder", a->name);
-		goto error;
+	/* Fake up the fetch context for the fetch code. */
+	fdata = &ds->fdata;
+	fdata->user = data->user;
+	fdata->pass = data->pass;
+	fdata->nocrammd5 = data->nocrammd5;
+	fdata->nologin = data->nologin;
+	fdata->starttls = data->starttls;
+	memcpy(&fdata->server, &data->server, sizeof fdata->server);
+	fdata->io = io;
+	fdata->only = FETCH_ONLY_ALL;
+
+	old = a->data;
+	a->data = fdata;
+	fetch_imap_state_init(a, &ds->fctx);
+	ds->fctx.state = imap_state_connected;
+	ds->fctx.llen = IO_LINESIZE;
+	ds->fctx.lbuf = xmalloc(ds->fctx.llen);
+	if (deliver_imap_pollto(imap_state_select1, a, io, &ds->fctx) != 0) {
+		fdata->disconnect(a);
+		a->data = old;
+
+		xfree(ds->fctx.lbuf);
+		xfree(ds);
+		return (NULL);
 	}
+	a->data = old;
 
-	/* Fake up the fetch context for the fetch code. */
-	memset(&fdata, 0, sizeof fdata);
-	fdata.user = data->user;
-	fdata.pass = data->pass;
-	fdata.nocrammd5 = data->nocrammd5;
-	fdata.nologin = data->nologin;
-	memcpy(&fdata.server, &data->server, sizeof fdata.server);
-	fdata.io = io;
-	fdata.only = FETCH_ONLY_ALL;
-	a->data = &fdata;
-	fetch_imap_state_init(a, &fctx);
-	fctx.state = imap_state_connected;
-	fctx.llen = IO_LINESIZE;
-	fctx.lbuf = xmalloc(fctx.llen);
-
-	/* Use the fetch code until the select1 state is reached. */
-	if (deliver_imap_pollto(imap_state_select1, a, io, &fctx) != 0)
-		goto error;
-
-retry:
-	/* Send an append command. */
-	if (imap_putln(a, "%u APPEND {%zu}", ++fdata.tag, strlen(folder)) != 0)
-		goto error;
-	switch (deliver_imap_waitappend(a, &fctx, io, &line)) {
-	case IMAP_TAG_ERROR:
-		if (line != NULL)
-			imap_invalid(a, line);
-		goto error;
+	log_debug2("%s: opened IMAP session to %s", a->name, fdata->server.host);
+	TAILQ_INSERT_TAIL(&deliver_imap_sessions, ds, entry);
+	return (ds);
+}
+
+/* Close a session, logging out if possible. Must be called with a->data set. */
+void
+deliver_imap_free(struct deliver_imap_session *ds, int logout)
+{
+	struct account		*a = ds->account;
+	struct fetch_imap_data	*fdata = &ds->fdata;
+	char			*line;
+
+	if (logout && fdata->io != NULL) {
+		if (imap_putln(a, "%u LOGOUT", ++fdata->tag) == 0)
+			deliver_imap_waitokay(a, &ds->fctx, fdata->io, &line);
+	}
+	fdata->disconnect(a);
+
+	TAILQ_REMOVE(&deliver_imap_sessions, ds, entry);
+	xfree(ds->fctx.lbuf);
+	xfree(ds);
+}
+
+/* Log out of all open sessions. */
+void
+deliver_imap_close(void)
+{
+	struct deliver_imap_session	*ds;
+	struct account			*a;
+	void				*old;
+
+	while (!TAILQ_EMPTY(&deliver_imap_sessions)) {
+		ds = TAILQ_FIRST(&deliver_imap_sessions);
+		a = ds->account;
+
+		old = a->data;
+		a->data = &ds->fdata;
+		deliver_imap_free(ds, 1);
+		a->data = old;
+	}
+}
+
+/* Send a literal, without waiting for the server if it has LITERAL+. */
+int
+deliver_imap_literal(struct account *a, struct deliver_imap_session *ds,
+    const char *fmt, size_t size, char **line)
+{
+	struct fetch_imap_data	*fdata = &ds->fdata;
+
+	if (fdata->capa & IMAP_CAPA_LITERALPLUS)
+		return (imap_putln(a, "%s{%zu+}", fmt, size) != 0);
+
+	if (imap_putln(a, "%s{%zu}", fmt, size) != 0)
+		return (1);
+	switch (deliver_imap_waitappend(a, &ds->fctx, fdata->io, line)) {
 	case IMAP_TAG_CONTINUE:
-		break;
-	default:
-		if (imap_no(line) && strstr(line, "[TRYCREATE]") != NULL)
-			goto try_create;
-		imap_invalid(a, line);
-		goto error;
+		return (0);
+	case IMAP_TAG_ERROR:
+		if (*line != NULL)
+			imap_invalid(a, *line);
+		return (1);
 	}
+	return (-1);
+}
+
+/*
+ * Append a mail to a folder. Returns 0 on success, 1 on error or -1 if the
+ * folder needs to be created.
+ */
+int
+deliver_imap_append(struct account *a, struct deliver_imap_session *ds,
+    struct mail *m, const char *folder)
+{
+	struct fetch_imap_data	*fdata = &ds->fdata;
+	struct io		*io = fdata->io;
+	char			*cause, *ptr, *line, *cmd;
+	size_t			 len, maillen;
+	u_int			 total, body;
+	int			 error;
+
+	/* Send an append command. */
+	xasprintf(&cmd, "%u APPEND ", ++fdata->tag);
+	error = deliver_imap_literal(a, ds, cmd, strlen(folder), &line);
+	xfree(cmd);
+	if (error != 0)
+		goto invalid;
 
 	/*
 	 * Send the mail size, not forgetting lines are CRLF terminated. The
@@ -235,30 +359,18 @@ retry:
 	 */
 	count_lines(m, &total, &body);
 	maillen = m->size + total - 1;
-	if (fdata.capa & IMAP_CAPA_XYZZY) {
+	if (fdata->capa & IMAP_CAPA_XYZZY) {
 		log_debug2("%s: adjusting size: actual %zu", a->name, maillen);
 		maillen = m->size;
 	}
-	if (fdata.capa & IMAP_CAPA_NOSPACE) {
-		if (imap_putln(a, "%s{%zu}", folder, maillen) != 0)
-			goto error;
-	} else {
-		if (imap_putln(a, "%s {%zu}", folder, maillen) != 0)
-			goto error;
-	}
-	switch (deliver_imap_waitappend(a, &fctx, io, &line)) {
-	case IMAP_TAG_ERROR:
-		if (line != NULL)
-			imap_invalid(a, line);
-		goto error;
-	case IMAP_TAG_CONTINUE:
-		break;
-	default:
-		if (imap_no(line) && strstr(line, "[TRYCREATE]") != NULL)
-			goto try_create;
-		imap_invalid(a, line);
-		goto error;
-	}
+	if (fdata->capa & IMAP_CAPA_NOSPACE)
+		xasprintf(&cmd, "%s", folder);
+	else
+		xasprintf(&cmd, "%s ", folder);
+	error = deliver_imap_literal(a, ds, cmd, maillen, &line);
+	xfree(cmd);
+	if (error != 0)
+		goto invalid;
 
 	/* Send the mail data. */
 	line_init(m, &ptr, &len);
@@ -271,60 +383,120 @@ retry:
 		if (io_update(io, conf.timeout, &cause) != 1) {
 			log_warnx("%s: %s", a->name, cause);
 			xfree(cause);
-			goto error;
+			return (1);
 		}
 
 		line_next(m, &ptr, &len);
 	}
 
 	/* Wait for an okay from the server. */
-	switch (deliver_imap_waitappend(a, &fctx, io, &line)) {
+	switch (deliver_imap_waitappend(a, &ds->fctx, io, &line)) {
 	case IMAP_TAG_ERROR:
 	case IMAP_TAG_CONTINUE:
 		if (line != NULL)
 			imap_invalid(a, line);
-		goto error;
-	default:
-		if (imap_okay(line))
-			break;
-		if (strstr(line, "[TRYCREATE]") != NULL)
-			goto try_create;
+		return (1);
+	}
+	if (imap_okay(line))
+		return (0);
+	if (strstr(line, "[TRYCREATE]") != NULL)
+		return (-1);
+	imap_invalid(a, line);
+	return (1);
+
+invalid:
+	/* A tagged response instead of a continuation. */
+	if (error == -1) {
+		if (imap_no(line) && strstr(line, "[TRYCREATE]") != NULL)
+			return (-1);
 		imap_invalid(a, line);
-		goto error;
 	}
+	return (1);
+}
 
-	if (imap_putln(a, "%u LOGOUT", ++fdata.tag) != 0)
-		goto error;
-	if (deliver_imap_waitokay(a, &fctx, io, &line) != 0)
-		goto error;
+/* Create a folder. */
+int
+deliver_imap_create(struct account *a, struct deliver_imap_session *ds,
+    const char *folder)
+{
+	struct fetch_imap_data	*fdata = &ds->fdata;
+	char			*line, *cmd;
+	int			 error;
+
+	xasprintf(&cmd, "%u CREATE ", ++fdata->tag);
+	error = deliver_imap_literal(a, ds, cmd, strlen(folder), &line);
+	xfree(cmd);
+	if (error != 0) {
+		if (error == -1)
+			imap_invalid(a, line);
+		return (1);
+	}
+	if (imap_putln(a, "%s", folder) != 0)
+		return (1);
+	return (deliver_imap_waitokay(a, &ds->fctx, fdata->io, &line));
+}
 
-	xfree(fctx.lbuf);
-	xfree(folder);
+int
+deliver_imap_deliver(struct deliver_ctx *dctx, struct actitem *ti)
+{
+	struct account			*a = dctx->account;
+	struct mail			*m = dctx->mail;
+	struct deliver_imap_data	*data = ti->data;
+	struct deliver_imap_session	*ds;
+	char				*folder;
+	void				*old;
+	int				 error, reused, created;
 
-	fdata.disconnect(a);
-	return (DELIVER_SUCCESS);
+	/* Work out the folder name. */
+	folder = replacestr(&data->folder, m->tags, m, &m->rml);
+	if (folder == NULL || *folder == '\0') {
+		log_warnx("%s: empty folder", a->name);
+		if (folder != NULL)
+			xfree(folder);
+		return (DELIVER_FAILURE);
+	}
 
-try_create:	/* XXX function? */
-	/* Try to create the folder. */
-	if (imap_putln(a, "%u CREATE {%zu}", ++fdata.tag, strlen(folder)) != 0)
-		goto error;
-	if (deliver_imap_waitcontinue(a, &fctx, io, &line) != 0)
-		goto error;
-	if (imap_putln(a, "%s", folder) != 0)
-		goto error;
-	if (deliver_imap_waitokay(a, &fctx, io, &line) != 0)
-		goto error;
-	goto retry;
+	/*
+	 * Use an existing session if there is one. The server may have closed
+	 * it since it was last used, so if that fails, try a new one.
+	 */
+	reused = 1;
+	if ((ds = deliver_imap_find(data)) == NULL) {
+		reused = 0;
+		ds = deliver_imap_open(a, data);
+	}
 
-error:
-	io_writeline(io, "QUIT");
-	io_flush(io, conf.timeout, NULL);
+	created = 0;
+	while (ds != NULL) {
+		old = a->data;
+		a->data = &ds->fdata;
+
+		error = deliver_imap_append(a, ds, m, folder);
+		if (error == -1 && !created) {
+			/* Try to create the folder, once. */
+			created = 1;
+			if (deliver_imap_create(a, ds, folder) == 0) {
+				a->data = old;
+				continue;
+			}
+			error = 1;
+		}
+		if (error == 0) {
+			a->data = old;
+			xfree(folder);
+			return (DELIVER_SUCCESS);
+		}
+		deliver_imap_free(ds, 0);
+		a->data = old;
 
-	xfree(fctx.lbuf);
-	if (folder != NULL)
-		xfree(folder);
+		if (!reused)
+			break;
+		log_debug2("%s: IMAP session failed; reconnecting", a->name);
+		reused = 0;
+		ds = deliver_imap_open(a, data);
+	}
 
-	fdata.disconnect(a);
+	xfree(folder);
 	return (DELIVER_FAILURE);
 }
 
@@ -0,0 +1,421 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include "fdm.h"
+#include "deliver.h"
+
+/*
+ * LMTP delivery. This is done in the fetch child so that the session can be
+ * kept open for every mail from the account. LMTP servers must support
+ * pipelining, so the MAIL, RCPT and DATA commands are sent together and the
+ * replies read afterwards. The server gives a reply for each recipient at the
+ * end of the data.
+ */
+
+int	 deliver_lmtp_deliver(struct deliver_ctx *, struct actitem *);
+void	 deliver_lmtp_desc(struct actitem *, char *, size_t);
+
+struct deliver_lmtp_session *deliver_lmtp_find(struct deliver_lmtp_data *);
+struct deliver_lmtp_session *deliver_lmtp_open(
+	     struct account *, struct deliver_lmtp_data *);
+void	 deliver_lmtp_free(struct deliver_lmtp_session *, int);
+int	 deliver_lmtp_reply(struct deliver_lmtp_session *, char **, char **);
+int	 deliver_lmtp_send(struct account *, struct deliver_lmtp_session *,
+	     struct mail *, const char *, struct strings *);
+
+struct deliver deliver_lmtp = {
+	"lmtp",
+	DELIVER_INCHILD,
+	deliver_lmtp_deliver,
+	deliver_lmtp_desc
+};
+
+/* An open session, after LHLO. */
+struct deliver_lmtp_session {
+	char		*name;		/* path or host and port */
+	struct io	*io;
+
+	char		*lbuf;
+	size_t		 llen;
+
+	TAILQ_ENTRY(deliver_lmtp_session) entry;
+};
+TAILQ_HEAD(, deliver_lmtp_session) deliver_lmtp_sessions =
+    TAILQ_HEAD_INITIALIZER(deliver_lmtp_sessions);
+
+/*
+ * Read a reply, which may be spread over several lines. Returns the code, or
+ * -1 on error with cause set.
+ */
+int
+deliver_lmtp_reply(struct deliver_lmtp_session *ls, char **line, char **cause)
+{
+	const char	*errstr;
+	char		 ch;
+	int		 code;
+
+	for (;;) {
+		switch (io_pollline2(ls->io,
+		    line, &ls->lbuf, &ls->llen, conf.timeout, cause)) {
+		case 0:
+			*cause = xstrdup("connection unexpectedly closed");
+			return (-1);
+		case -1:
+			return (-1);
+		}
+		if (strlen(*line) < 3 || ((*line)[3] != ' ' &&
+		    (*line)[3] != '-' && (*line)[3] != '\0'))
+			break;
+		if ((*line)[3] == '-')
+			continue;
+
+		ch = (*line)[3];
+		(*line)[3] = '\0';
+		code = strtonum(*line, 100, 599, &errstr);
+		(*line)[3] = ch;
+		if (errstr != NULL)
+			break;
+		return (code);
+	}
+	xasprintf(cause, "invalid response: %s", *line);
+	return (-1);
+}
+
+/* Find an open session for a socket or server. */
+struct deliver_lmtp_session *
+deliver_lmtp_find(struct deliver_lmtp_data *data)
+{
+	struct deliver_lmtp_session	*ls;
+	char				*name;
+
+	if (data->path != NULL)
+		name = xstrdup(data->path);
+	else
+		xasprintf(&name, "%s:%s", data->server.host, data->server.port);
+	TAILQ_FOREACH(ls, &deliver_lmtp_sessions, entry) {
+		if (strcmp(ls->name, name) == 0)
+			break;
+	}
+	xfree(name);
+	return (ls);
+}
+
+/* Connect and wait for the greeting, then send LHLO. */
+struct deliver_lmtp_session *
+deliver_lmtp_open(struct account *a, struct deliver_lmtp_data *data)
+{
+	struct deliver_lmtp_session	*ls;
+	char				*cause, *line;
+
+	ls = xcalloc(1, sizeof *ls);
+	if (data->path != NULL) {
+		ls->name = xstrdup(data->path);
+		ls->io = connectunix(data->path, IO_CRLF, &cause);
+	} else {
+		xasprintf(&ls->name, "%s:%s",
+		    data->server.host, data->server.port);
+		ls->io = connectproxy(&data->server, conf.verify_certs,
+		    a->proxy, IO_CRLF, conf.timeout, &cause);
+	}
+	if (ls->io == NULL) {
+		log_warnx("%s: %s", a->name, cause);
+		xfree(cause);
+		xfree(ls->name);
+		xfree(ls);
+		return (NULL);
+	}
+	if (conf.debug > 3 && !conf.syslog)
+		ls->io->dup_fd = STDOUT_FILENO;
+
+	ls->llen = IO_LINESIZE;
+	ls->lbuf = xmalloc(ls->llen);
+	TAILQ_INSERT_TAIL(&deliver_lmtp_sessions, ls, entry);
+
+	switch (deliver_lmtp_reply(ls, &line, &cause)) {
+	case -1:
+		goto error;
+	case 220:
+		break;
+	default:
+		goto invalid;
+	}
+
+	if (conf.host_fqdn != NULL)
+		io_writeline(ls->io, "LHLO %s", conf.host_fqdn);
+	else
+		io_writeline(ls->io, "LHLO %s", conf.host_name);
+	switch (deliver_lmtp_reply(ls, &line, &cause)) {
+	case -1:
+		goto error;
+	case 250:
+		break;
+	default:
+		goto invalid;
+	}
+
+	log_debug2("%s: opened LMTP session to %s", a->name, ls->name);
+	return (ls);
+
+invalid:
+	xasprintf(&cause, "unexpected response: %s", line);
+error:
+	log_warnx("%s: %s: %s", a->name, ls->name, cause);
+	xfree(cause);
+	deliver_lmtp_free(ls, 0);
+	return (NULL);
+}
+
+/* Close a session, sending QUIT if it is still usable. */
+void
+deliver_lmtp_free(struct deliver_lmtp_session *ls, int quit)
+{
+	char	*cause, *line;
+
+	if (quit) {
+		io_writeline(ls->io, "QUIT");
+		if (deliver_lmtp_reply(ls, &line, &cause) == -1)
+			xfree(cause);
+	}
+
+	TAILQ_REMOVE(&deliver_lmtp_sessions, ls, entry);
+	io_close(ls->io);
+	io_free(ls->io);
+	xfree(ls->lbuf);
+	xfree(ls->name);
+	xfree(ls);
+}
+
+/* Close all open sessions. */
+void
+deliver_lmtp_close(void)
+{
+	while (!TAILQ_EMPTY(&deliver_lmtp_sessions))
+		deliver_lmtp_free(TAILQ_FIRST(&deliver_lmtp_sessions), 1);
+}
+
+/*
+ * Send one transaction. Returns 0 if every recipient accepted the mail, 1 if
+ * any did not, or -1 if the session is broken.
+ */
+int
+deliver_lmtp_send(struct account *a, struct deliver_lmtp_session *ls,
+    struct mail *m, const char *from, struct strings *rcpts)
+{
+	struct io	*io = ls->io;
+	char		*cause, *line, *ptr;
+	size_t		 len, n;
+	u_int		 i, accepted;
+	int		 code, failed;
+	ARRAY_DECL(, u_int) ok;
+
+	/* Send the envelope all together. */
+	io_writeline(io, "MAIL FROM:<%s>", from);
+	for (i = 0; i < ARRAY_LENGTH(rcpts); i++)
+		io_writeline(io, "RCPT TO:<%s>", ARRAY_ITEM(rcpts, i));
+	io_writeline(io, "DATA");
+
+	failed = 0;
+	ARRAY_INIT(&ok);
+
+	if ((code = deliver_lmtp_reply(ls, &line, &cause)) == -1)
+		goto error;
+	if (code != 250) {
+		log_warnx("%s: %s: MAIL FROM failed: %s", a->name, ls->name,
+		    line);
+		failed = 1;
+	}
+	for (i = 0; i < ARRAY_LENGTH(rcpts); i++) {
+		if ((code = deliver_lmtp_reply(ls, &line, &cause)) == -1)
+			goto error;
+		if (code == 250 || code == 251)
+			ARRAY_ADD(&ok, i);
+		else {
+			log_warnx("%s: %s: %s: rejected: %s", a->name,
+			    ls->name, ARRAY_ITEM(rcpts, i), line);
+			failed = 1;
+		}
+	}
+	if ((code = deliver_lmtp_reply(ls, &line, &cause)) == -1)
+		goto error;
+	if (code != 354) {
+		/* No data expected, so the session is fine after RSET. */
+		if (ARRAY_LENGTH(&ok) != 0) {
+			log_warnx("%s: %s: DATA failed: %s", a->name,
+			    ls->name, line);
+		}
+		io_writeline(io, "RSET");
+		if ((code = deliver_lmtp_reply(ls, &line, &cause)) == -1)
+			goto error;
+		ARRAY_FREE(&ok);
+		return (1);
+	}
+
+	line_init(m, &ptr, &len);
+	while (ptr != NULL) {
+		/* The last line may not end with a newline. */
+		n = len;
+		if (ptr[n - 1] == '\n')
+			n--;
+		if (n > 0) {
+			if (*ptr == '.')
+				io_write(io, ".", 1);
+			io_write(io, ptr, n);
+		}
+		io_writeline(io, NULL);
+
+		/* Update if necessary. */
+		if (io_update(io, conf.timeout, &cause) != 1)
+			goto error;
+
+		line_next(m, &ptr, &len);
+	}
+	io_writeline(io, ".");
+
+	/* There is a reply for each recipient which was accepted. */
+	accepted = 0;
+	for (i = 0; i < ARRAY_LENGTH(&ok); i++) {
+		if ((code = deliver_lmtp_reply(ls, &line, &cause)) == -1)
+			goto error;
+		if (code == 250) {
+			accepted++;
+			continue;
+		}
+		log_warnx("%s: %s: %s: not delivered: %s", a->name, ls->name,
+		    ARRAY_ITEM(rcpts, ARRAY_ITEM(&ok, i)), line);
+		failed = 1;
+	}
+	log_debug2("%s: %s: delivered to %u of %u recipients", a->name,
+	    ls->name, accepted, ARRAY_LENGTH(rcpts));
+
+	ARRAY_FREE(&ok);
+	return (failed);
+
+error:
+	log_warnx("%s: %s: %s", a->name, ls->name, cause);
+	xfree(cause);
+	ARRAY_FREE(&ok);
+	return (-1);
+}
+
+int
+deliver_lmtp_deliver(struct deliver_ctx *dctx, struct actitem *ti)
+{
+	struct account			*a = dctx->account;
+	struct mail			*m = dctx->mail;
+	struct deliver_lmtp_data	*data = ti->data;
+	struct deliver_lmtp_session	*ls;
+	struct strings			 rcpts;
+	char				*from, *user, *s;
+	u_int				 i;
+	int				 error, reused;
+
+	if (conf.host_fqdn != NULL)
+		xasprintf(&user, "%s@%s", dctx->udata->name, conf.host_fqdn);
+	else
+		xasprintf(&user, "%s@%s", dctx->udata->name, conf.host_name);
+
+	ARRAY_INIT(&rcpts);
+	if (data->to == NULL)
+		ARRAY_ADD(&rcpts, xstrdup(user));
+	else {
+		for (i = 0; i < ARRAY_LENGTH(data->to); i++) {
+			s = replacestr(
+			    &ARRAY_ITEM(data->to, i), m->tags, m, &m->rml);
+			if (s == NULL || *s == '\0') {
+				if (s != NULL)
+					xfree(s);
+				log_warnx("%s: empty to", a->name);
+				from = NULL;
+				error = 1;
+				goto out;
+			}
+			ARRAY_ADD(&rcpts, s);
+		}
+	}
+	if (data->from.str == NULL)
+		from = xstrdup(user);
+	else {
+		from = replacestr(&data->from, m->tags, m, &m->rml);
+		if (from == NULL || *from == '\0') {
+			log_warnx("%s: empty from", a->name);
+			error = 1;
+			goto out;
+		}
+	}
+
+	/*
+	 * Use an existing session if there is one, or open a new one. If the
+	 * server has closed an existing session, try once with a new one.
+	 */
+	reused = 1;
+	if ((ls = deliver_lmtp_find(data)) == NULL) {
+		reused = 0;
+		ls = deliver_lmtp_open(a, data);
+	}
+	error = 1;
+	while (ls != NULL) {
+		error = deliver_lmtp_send(a, ls, m, from, &rcpts);
+		if (error != -1)
+			break;
+		deliver_lmtp_free(ls, 0);
+		error = 1;
+
+		if (!reused)
+			break;
+		log_debug2("%s: LMTP session failed; reconnecting", a->name);
+		reused = 0;
+		ls = deliver_lmtp_open(a, data);
+	}
+
+out:
+	for (i = 0; i < ARRAY_LENGTH(&rcpts); i++)
+		xfree(ARRAY_ITEM(&rcpts, i));
+	ARRAY_FREE(&rcpts);
+	if (from != NULL)
+		xfree(from);
+	xfree(user);
+
+	if (error != 0)
+		return (DELIVER_FAILURE);
+	return (DELIVER_SUCCESS);
+}
+
+void
+deliver_lmtp_desc(struct actitem *ti, char *buf, size_t len)
+{
+	struct deliver_lmtp_data	*data = ti->data;
+	char				*to;
+
+	if (data->to == NULL)
+		to = xstrdup("");
+	else
+		to = fmt_replstrs(" to ", data->to);
+
+	if (data->path != NULL)
+		xsnprintf(buf, len, "lmtp socket \"%s\"%s", data->path, to);
+	else {
+		xsnprintf(buf, len, "lmtp server \"%s\" port %s%s",
+		    data->server.host, data->server.port, to);
+	}
+	xfree(to);
+}
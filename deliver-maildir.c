@@ -17,6 +17,7 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <errno.h>
@@ -30,11 +31,48 @@
 #include "fdm.h"
 #include "deliver.h"
 
+/*
+ * Maildirs which have been delivered to, so do not need to be checked or
+ * created again. Each delivery is in a new child, so this is filled by the
+ * parent when a delivery finishes and inherited by later children.
+ */
+struct deliver_maildir_seen {
+	uid_t				 uid;
+	char				*path;
+
+	RB_ENTRY(deliver_maildir_seen)	 entry;
+};
+RB_HEAD(deliver_maildir_seens, deliver_maildir_seen);
+
 int	 deliver_maildir_deliver(struct deliver_ctx *, struct actitem *);
 void	 deliver_maildir_desc(struct actitem *, char *, size_t);
 
 char	*deliver_maildir_host(void);
 int	 deliver_maildir_create(struct account *, const char *);
+int	 deliver_maildir_cmp(struct deliver_maildir_seen *,
+	     struct deliver_maildir_seen *);
+int	 deliver_maildir_check(struct account *, const char *, uid_t);
+int	 deliver_maildir_link(struct account *, struct mail *, const char *,
+	     char *, size_t);
+#ifdef O_TMPFILE
+int	 deliver_maildir_unnamed(struct account *, struct mail *, const char *,
+	     int *, char *, size_t);
+#endif
+
+RB_PROTOTYPE(deliver_maildir_seens,
+    deliver_maildir_seen, entry, deliver_maildir_cmp);
+RB_GENERATE(deliver_maildir_seens,
+    deliver_maildir_seen, entry, deliver_maildir_cmp);
+struct deliver_maildir_seens deliver_maildir_dirs =
+    RB_INITIALIZER(&deliver_maildir_dirs);
+
+/* Count of names tried, to make each unique. */
+u_int	deliver_maildir_delivered;
+
+#ifdef O_TMPFILE
+/* Set if unnamed files cannot be used. */
+int	deliver_maildir_nounnamed;
+#endif
 
 struct deliver deliver_maildir = {
 	"maildir",
@@ -43,6 +81,50 @@ struct deliver deliver_maildir = {
 	deliver_maildir_desc
 };
 
+int
+deliver_maildir_cmp(struct deliver_maildir_seen *ms1,
+    struct deliver_maildir_seen *ms2)
+{
+	if (ms1->uid != ms2->uid)
+		return (ms1->uid < ms2->uid ? -1 : 1);
+	return (strcmp(ms1->path, ms2->path));
+}
+
+/*
+ * Remember the maildir a mail was delivered to, given the mail file. Called in
+ * the parent.
+ */
+void
+deliver_maildir_add(uid_t uid, const char *file)
+{
+	struct deliver_maildir_seen	 find, *ms;
+	const char			*ptr;
+	size_t				 len;
+
+	/* The file is in maildir/new. */
+	if (file == NULL || (ptr = strrchr(file, '/')) == NULL)
+		return;
+	len = ptr - file;
+	if (len < 4 || strncmp(ptr - 4, "/new", 4) != 0)
+		return;
+	len -= 4;
+
+	find.uid = uid;
+	find.path = xmalloc(len + 1);
+	memcpy(find.path, file, len);
+	find.path[len] = '\0';
+	ms = RB_FIND(deliver_maildir_seens, &deliver_maildir_dirs, &find);
+	if (ms != NULL) {
+		xfree(find.path);
+		return;
+	}
+
+	ms = xmalloc(sizeof *ms);
+	ms->uid = uid;
+	ms->path = find.path;
+	RB_INSERT(deliver_maildir_seens, &deliver_maildir_dirs, ms);
+}
+
 /*
  * Return hostname with '/' replaced with "\057" and ':' with "\072". This is a
  * bit inefficient but sod it. Why they couldn't both be replaced by _ is
@@ -50,21 +132,26 @@ struct deliver deliver_maildir = {
  *
  * The hostname will be truncated if these additions make it longer than
  * MAXHOSTNAMELEN. No clue if this is right.
+ *
+ * The name is that found at startup and is worked out only once.
  */
 char *
 deliver_maildir_host(void)
 {
 	static char	host1[MAXHOSTNAMELEN], host2[MAXHOSTNAMELEN];
+	static char    *host;
 	char		ch;
 	size_t		first, last;
 
-	if (gethostname(host1, sizeof host1) != 0)
-		fatal("gethostname failed");
+	if (host != NULL)
+		return (host);
+
+	strlcpy(host1, conf.host_name, sizeof host1);
 	*host2 = '\0';
 
 	last = strcspn(host1, "/:");
 	if (host1[last] == '\0')
-		return (host1);
+		return (host = host1);
 
 	first = 0;
 	do {
@@ -86,7 +173,21 @@ deliver_maildir_host(void)
 		last = strcspn(host1 + first, "/:");
 	} while (ch != '\0');
 
-	return (host2);
+	return (host = host2);
+}
+
+/* Create the maildir unless it is already known to exist. */
+int
+deliver_maildir_check(struct account *a, const char *path, uid_t uid)
+{
+	struct deliver_maildir_seen	find, *ms;
+
+	find.uid = uid;
+	find.path = (char *) path;
+	ms = RB_FIND(deliver_maildir_seens, &deliver_maildir_dirs, &find);
+	if (ms == NULL)
+		return (deliver_maildir_create(a, path));
+	return (0);
 }
 
 /* Create a new maildir. */
@@ -135,20 +236,165 @@ error:
 	return (-1);
 }
 
+/*
+ * Link the file from an earlier maildir delivery of the same mail into this
+ * maildir rather than writing it again. This is only done if the file belongs
+ * to this user and still matches the mail. Returns 1 if the mail should be
+ * written instead.
+ */
+int
+deliver_maildir_link(struct account *a, struct mail *m, const char *path,
+    char *dst, size_t dstlen)
+{
+	struct stat	 sb;
+	const char	*src;
+	void		*base;
+	int		 fd, same;
+
+	if ((src = find_tag(m->tags, "mail_file")) == NULL || m->size == 0)
+		return (1);
+
+	if ((fd = open(src, O_RDONLY, 0)) == -1)
+		return (1);
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_uid != geteuid() || (size_t) sb.st_size != m->size) {
+		close(fd);
+		return (1);
+	}
+	base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return (1);
+	same = (memcmp(base, m->data, m->size) == 0);
+	munmap(base, m->size);
+	if (!same) {
+		log_debug3("%s: %s: mail has changed", a->name, src);
+		return (1);
+	}
+
+	for (;;) {
+		if (ppath(dst, dstlen, "%s/new/%ld.%ld_%u.%s", path,
+		    (long) time(NULL), (long) getpid(),
+		    deliver_maildir_delivered++, deliver_maildir_host()) != 0)
+			return (1);
+		log_debug2("%s: linking %s to %s", a->name, src, dst);
+
+		if (link(src, dst) == 0)
+			return (0);
+		if (errno != EEXIST) {
+			log_debug2("%s: %s: %s", a->name, dst, strerror(errno));
+			return (1);
+		}
+	}
+}
+
+#ifdef O_TMPFILE
+/*
+ * Write the mail to an unnamed file in tmp and link it straight into new, so
+ * there is no temporary name to clean up if anything goes wrong. Returns 1 if
+ * the file system or kernel does not support this, and the usual way should
+ * be used.
+ */
+int
+deliver_maildir_unnamed(struct account *a, struct mail *m, const char *path,
+    int *created, char *dst, size_t dstlen)
+{
+	struct stat	 sb;
+	char		 src[MAXPATHLEN], fdpath[64];
+	int		 fd;
+
+	if (deliver_maildir_nounnamed)
+		return (1);
+
+	if (ppath(src, sizeof src, "%s/tmp", path) != 0) {
+		log_warn("%s: %s/tmp", a->name, path);
+		return (-1);
+	}
+	while ((fd = open(src, O_TMPFILE|O_WRONLY, FILEMODE)) == -1) {
+		if (errno == ENOENT && !*created) {
+			log_debug2("%s: %s: missing", a->name, path);
+			if (deliver_maildir_create(a, path) != 0)
+				return (-1);
+			*created = 1;
+			continue;
+		}
+		if (errno == EISDIR || errno == EOPNOTSUPP || errno == EINVAL) {
+			log_debug2("%s: %s: unnamed files not supported",
+			    a->name, src);
+			deliver_maildir_nounnamed = 1;
+			return (1);
+		}
+		log_warn("%s: %s", a->name, src);
+		return (-1);
+	}
+	if (conf.file_group != (gid_t) -1) {
+		if (fchown(fd, -1, conf.file_group) != 0)
+			goto error;
+	}
+
+	/* Write the message. */
+	log_debug2("%s: writing to unnamed file in %s", a->name, src);
+	if (mail_write(m, fd) != 0)
+		goto error;
+	if (conf.durability == DURABILITY_PERMAIL && fsync(fd) != 0)
+		goto error;
+
+	/* Link it into new, trying another name if this one exists. */
+	xsnprintf(fdpath, sizeof fdpath, "/proc/self/fd/%d", fd);
+	for (;;) {
+		if (ppath(dst, dstlen, "%s/new/%ld.%ld_%u.%s", path,
+		    (long) time(NULL), (long) getpid(),
+		    deliver_maildir_delivered++, deliver_maildir_host()) != 0)
+			goto error;
+		log_debug3("%s: trying %s", a->name, dst);
+
+		if (linkat(AT_FDCWD, fdpath, AT_FDCWD, dst,
+		    AT_SYMLINK_FOLLOW) == 0)
+			break;
+		if (errno == EEXIST)
+			continue;
+		if (errno == ENOENT && stat(fdpath, &sb) != 0) {
+			/* No /proc. */
+			log_debug2("%s: %s: can't link unnamed file", a->name,
+			    fdpath);
+			deliver_maildir_nounnamed = 1;
+			close(fd);
+			return (1);
+		}
+		if (errno == ENOENT && !*created) {
+			log_debug2("%s: %s: missing", a->name, path);
+			if (deliver_maildir_create(a, path) != 0) {
+				close(fd);
+				return (-1);
+			}
+			*created = 1;
+			continue;
+		}
+		goto error;
+	}
+	close(fd);
+	return (0);
+
+error:
+	log_warn("%s: %s", a->name, dst);
+	close(fd);
+	return (-1);
+}
+#endif
+
 int
 deliver_maildir_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 {
 	struct account			*a = dctx->account;
 	struct mail			*m = dctx->mail;
 	struct deliver_maildir_data	*data = ti->data;
-	static u_int			 delivered = 0;
 	char				*host, *name, *path;
 	char				 src[MAXPATHLEN], dst[MAXPATHLEN];
-	int				 fd;
-	ssize_t				 n;
+	int				 fd, created;
 
 	name = NULL;
 	fd = -1;
+	created = 0;
 
 	path = replacepath(&data->path, m->tags, m, &m->rml, dctx->udata->home);
 	if (path == NULL || *path == '\0') {
@@ -158,9 +404,25 @@ deliver_maildir_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	log_debug2("%s: saving to maildir %s", a->name, path);
 
 	/* Create the maildir. */
-	if (deliver_maildir_create(a, path) != 0)
+	if (deliver_maildir_check(a, path, dctx->udata->uid) != 0)
 		goto error;
 
+	/* Link the mail if it was already delivered to another maildir. */
+	*dst = '\0';
+	if (conf.maildir_links &&
+	    deliver_maildir_link(a, m, path, dst, sizeof dst) == 0)
+		goto done;
+
+#ifdef O_TMPFILE
+	switch (deliver_maildir_unnamed(
+	    a, m, path, &created, dst, sizeof dst)) {
+	case 0:
+		goto done;
+	case -1:
+		goto error;
+	}
+#endif
+
 	/* Find host name. */
 	host = deliver_maildir_host();
 
@@ -169,8 +431,8 @@ restart:
 	do {
 		if (name != NULL)
 			xfree(name);
-		xasprintf(&name, "%ld.%ld_%u.%s",
-		    (long) time(NULL), (long) getpid(), delivered, host);
+		xasprintf(&name, "%ld.%ld_%u.%s", (long) time(NULL),
+		    (long) getpid(), deliver_maildir_delivered, host);
 
 		if (ppath(src, sizeof src, "%s/tmp/%s", path, name) != 0) {
 			log_warn("%s: %s/tmp/%s", a->name, path, name);
@@ -179,17 +441,26 @@ restart:
 		log_debug3("%s: trying %s/tmp/%s", a->name, path, name);
 
 		fd = xcreate(src, O_WRONLY, -1, conf.file_group, FILEMODE);
+		if (fd == -1 && errno == ENOENT && !created) {
+			/* The maildir has gone: create it again. */
+			log_debug2("%s: %s: missing", a->name, path);
+			if (deliver_maildir_create(a, path) != 0)
+				goto error;
+			created = 1;
+			continue;
+		}
 		if (fd == -1 && errno != EEXIST)
 			goto error_log;
 
-		delivered++;
+		deliver_maildir_delivered++;
 	} while (fd == -1);
 	cleanup_register(src);
 
 	/* Write the message. */
 	log_debug2("%s: writing to %s", a->name, src);
-	n = write(fd, m->data, m->size);
-	if (n < 0 || (size_t) n != m->size || fsync(fd) != 0)
+	if (mail_write(m, fd) != 0)
+		goto error_cleanup;
+	if (conf.durability == DURABILITY_PERMAIL && fsync(fd) != 0)
 		goto error_cleanup;
 	close(fd);
 	fd = -1;
@@ -208,15 +479,26 @@ restart:
 			cleanup_deregister(src);
 			goto restart;
 		}
+		if (errno == ENOENT && !created) {
+			log_debug2("%s: %s: missing", a->name, path);
+			cleanup_deregister(src);
+			unlink(src);
+			if (deliver_maildir_create(a, path) != 0)
+				goto error;
+			created = 1;
+			goto restart;
+		}
 		goto error_cleanup;
 	}
 
 	cleanup_deregister(src);
 
+done:
 	/* Save the mail file as a tag. */
 	add_tag(&m->tags, "mail_file", "%s", dst);
 
-	xfree(name);
+	if (name != NULL)
+		xfree(name);
 	xfree(path);
 	return (DELIVER_SUCCESS);
 
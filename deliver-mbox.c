@@ -37,6 +37,7 @@ int	 deliver_mbox_deliver(struct deliver_ctx *, struct actitem *);
 void	 deliver_mbox_desc(struct actitem *, char *, size_t);
 
 int	 deliver_mbox_write(FILE *, gzFile, const void *, size_t);
+int	 deliver_mbox_quote(struct mail *);
 
 struct deliver deliver_mbox = {
 	"mbox",
@@ -63,6 +64,25 @@ deliver_mbox_write(FILE *f, gzFile gzf, const void *buf, size_t len)
 	return (0);
 }
 
+/* Check if any line after the first needs a from line quoted. */
+int
+deliver_mbox_quote(struct mail *m)
+{
+	char	*ptr, *end;
+
+	ptr = m->data;
+	end = m->data + m->size;
+	while ((ptr = memchr(ptr, '\n', end - ptr)) != NULL) {
+		/* Skip leading >s. */
+		ptr++;
+		while (ptr < end && *ptr == '>')
+			ptr++;
+		if (end - ptr >= 5 && strncmp(ptr, "From ", 5) == 0)
+			return (1);
+	}
+	return (0);
+}
+
 int
 deliver_mbox_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 {
@@ -171,7 +191,15 @@ deliver_mbox_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	log_debug3("%s: using from line: %s", a->name, from);
 	xfree(from);
 
-	/* Write the mail, escaping from lines. */
+	/*
+	 * If there is nothing to quote and no compression, write the mail
+	 * directly. Otherwise write it a line at a time, escaping from lines.
+	 */
+	if (gzf == NULL && !deliver_mbox_quote(m)) {
+		if (fflush(f) != 0 || mail_write(m, fd) != 0)
+			goto error_unblock;
+		goto done;
+	}
 	line_init(m, &ptr, &len);
 	while (ptr != NULL) {
 		if (ptr != m->data) {
@@ -197,6 +225,7 @@ deliver_mbox_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 		line_next(m, &ptr, &len);
 	}
 
+done:
 	/* Append newlines. */
 	if (deliver_mbox_write(f, gzf, "\n\n", 2) < 0)
 		goto error_unblock;
@@ -211,7 +240,7 @@ deliver_mbox_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 			goto error_unblock;
 		}
 	}
-	if (fsync(fd) != 0)
+	if (conf.durability == DURABILITY_PERMAIL && fsync(fd) != 0)
 		goto error_unblock;
 
 	if (sigprocmask(SIG_SETMASK, &oset, NULL) < 0)
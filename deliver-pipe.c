@@ -46,8 +46,10 @@ deliver_pipe_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	char				*s, *cause, *err;
 	int				 status;
 	struct cmd			*cmd = NULL;
-	char				*lbuf;
-	size_t				 llen;
+	struct coproc			*cp = dctx->coproc;
+	char				*lbuf, *out;
+	size_t				 llen, outlen;
+	int				 n;
 
 	s = replacepath(&data->cmd, m->tags, m, &m->rml, dctx->udata->home);
 	if (s == NULL || *s == '\0') {
@@ -55,9 +57,31 @@ deliver_pipe_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 		goto error;
 	}
 
+	if (ti->coproc != NULL) {
+		if (cp == NULL) {
+			log_warnx("%s: %s: coprocess not running", a->name, s);
+			goto error;
+		}
+		log_debug2("%s: %s to coprocess \"%s\"", a->name,
+		    data->pipe ? "piping" : "executing", s);
+		if (data->pipe)
+			n = coproc_run(cp, m->data, m->size, &status, &out,
+			    &outlen, conf.timeout, &cause);
+		else {
+			n = coproc_run(cp, NULL, 0, &status, &out, &outlen,
+			    conf.timeout, &cause);
+		}
+		if (n != 0)
+			goto error_cause;
+		xfree(out);
+		goto done;
+	}
+
 	if (data->pipe) {
 		log_debug2("%s: piping to \"%s\"", a->name, s);
 		cmd = cmd_start(s, CMD_IN|CMD_ONCE, m->data, m->size, &cause);
+		if (cmd != NULL)
+			cmd_set_file(cmd, m->shm.fd, m->off);
 	} else {
 		log_debug2("%s: executing \"%s\"", a->name, s);
 		cmd = cmd_start(s, 0, NULL, 0, &cause);
@@ -83,12 +107,14 @@ deliver_pipe_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 
 	xfree(lbuf);
 
+done:
 	if (status != 0) {
 		log_warnx("%s: %s: command returned %d", a->name, s, status);
 		goto error;
 	}
 
-	cmd_free(cmd);
+	if (cmd != NULL)
+		cmd_free(cmd);
 	xfree(s);
 	return (DELIVER_SUCCESS);
 
@@ -109,8 +135,6 @@ deliver_pipe_desc(struct actitem *ti, char *buf, size_t len)
 {
 	struct deliver_pipe_data	*data = ti->data;
 
-	if (data->pipe)
-		xsnprintf(buf, len, "pipe \"%s\"", data->cmd.str);
-	else
-		xsnprintf(buf, len, "exec \"%s\"", data->cmd.str);
+	xsnprintf(buf, len, "%s \"%s\"%s", data->pipe ? "pipe" : "exec",
+	    data->cmd.str, ti->coproc != NULL ? " coprocess" : "");
 }
@@ -54,8 +54,8 @@ deliver_remove_from_cache_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 		if (strcmp(data->path, cache->path) == 0) {
 			if (open_cache(a, cache) != 0)
 				goto error;
-			if (db_contains(cache->db, key) &&
-			    db_remove(cache->db, key) != 0) {
+			if (cache_contains(a, cache, key) &&
+			    cache_remove(a, cache, key) != 0) {
 				log_warnx(
 				    "%s: error removing from cache %s: %s",
 				    a->name, cache->path, key);
@@ -31,6 +31,7 @@
 
 int	 deliver_rewrite_deliver(struct deliver_ctx *, struct actitem *);
 void	 deliver_rewrite_desc(struct actitem *, char *, size_t);
+int	 deliver_rewrite_fix(struct mail *);
 
 struct deliver deliver_rewrite = {
 	"rewrite",
@@ -39,6 +40,33 @@ struct deliver deliver_rewrite = {
 	deliver_rewrite_desc
 };
 
+/*
+ * Tidy up the command output as it used to be read a line at a time: remove
+ * CRs at the end of lines and make sure the last line ends with a newline.
+ */
+int
+deliver_rewrite_fix(struct mail *md)
+{
+	char	*ptr, *end, *out;
+
+	end = md->data + md->size;
+	if ((ptr = memchr(md->data, '\r', md->size)) != NULL) {
+		for (out = ptr; ptr < end; ptr++) {
+			if (*ptr == '\r' && (ptr + 1 == end || ptr[1] == '\n'))
+				continue;
+			*out++ = *ptr;
+		}
+		md->size = out - md->data;
+	}
+
+	if (md->size != 0 && md->data[md->size - 1] != '\n') {
+		if (mail_resize(md, md->size + 1) != 0)
+			return (-1);
+		md->data[md->size++] = '\n';
+	}
+	return (0);
+}
+
 int
 deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 {
@@ -49,8 +77,9 @@ deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	char				*s, *cause, *out, *err;
 	int				 status;
 	struct cmd			*cmd = NULL;
+	struct coproc			*cp = dctx->coproc;
 	char				*lbuf;
-	size_t				 llen;
+	size_t				 llen, outlen, len;
 
 	s = replacepath(&data->cmd, m->tags, m, &m->rml, dctx->udata->home);
 	if (s == NULL || *s == '\0') {
@@ -62,9 +91,39 @@ deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 
 	md->size = 0;
 
-	cmd = cmd_start(s, CMD_IN|CMD_OUT|CMD_ONCE, m->data, m->size, &cause);
+	if (ti->coproc != NULL) {
+		if (cp == NULL) {
+			log_warnx("%s: %s: coprocess not running", a->name, s);
+			goto error;
+		}
+		if (coproc_run(cp, m->data, m->size, &status, &out, &outlen,
+		    conf.timeout, &cause) != 0)
+			goto error_cause;
+		if (status == 0 && outlen > 0) {
+			if (mail_resize(md, outlen) != 0) {
+				log_warnx("%s: %s: failed to resize mail",
+				    a->name, s);
+				xfree(out);
+				goto error;
+			}
+			memcpy(md->data, out, outlen);
+			md->size = outlen;
+		}
+		xfree(out);
+		goto done;
+	}
+
+	/* Most rewrites don't change the size much, so use it as a hint. */
+	if (mail_resize(md, m->size) != 0) {
+		log_warnx("%s: %s: failed to resize mail", a->name, s);
+		goto error;
+	}
+
+	cmd = cmd_start(
+	    s, CMD_IN|CMD_OUT|CMD_ONCE|CMD_RAW, m->data, m->size, &cause);
 	if (cmd == NULL)
 		goto error_cause;
+	cmd_set_file(cmd, m->shm.fd, m->off);
 	log_debug3("%s: %s: started", a->name, s);
 
 	llen = IO_LINESIZE;
@@ -72,7 +131,7 @@ deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 
 	do {
 		status = cmd_poll(
-		    cmd, &out, &err, &lbuf, &llen, conf.timeout, &cause);
+		    cmd, NULL, &err, &lbuf, &llen, conf.timeout, &cause);
 		if (status == -1) {
 			xfree(lbuf);
 			goto error_cause;
@@ -81,23 +140,33 @@ deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 			continue;
 		if (err != NULL)
 			log_warnx("%s: %s: %s", a->name, s, err);
-		if (out == NULL)
-			continue;
-		log_debug3("%s: %s: out: %s", a->name, s, out);
 
-		if (append_line(md, out, strlen(out)) != 0) {
-			log_warnx("%s: %s: failed to resize mail", s, a->name);
+		/* Copy whatever output is waiting straight into the mail. */
+		if ((len = cmd_pending(cmd)) == 0)
+			continue;
+		if (md->size + len > conf.max_size) {
+			log_warnx("%s: %s: oversize mail returned", a->name, s);
+			xfree(lbuf);
 			goto error;
 		}
-		if (md->size > conf.max_size) {
-			log_warnx("%s: %s: oversize mail returned", s, a->name);
+		if (mail_resize(md, md->size + len) != 0) {
+			log_warnx("%s: %s: failed to resize mail", a->name, s);
+			xfree(lbuf);
 			goto error;
 		}
+		cmd_read(cmd, md->data + md->size, len);
+		md->size += len;
 	} while (status == 0);
 	status--;
 
 	xfree(lbuf);
 
+	if (deliver_rewrite_fix(md) != 0) {
+		log_warnx("%s: %s: failed to resize mail", a->name, s);
+		goto error;
+	}
+
+done:
 	if (status != 0) {
 		log_warnx("%s: %s: command returned %d", a->name, s, status);
 		goto error;
@@ -109,7 +178,8 @@ deliver_rewrite_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 	}
 	md->body = find_body(md);
 
-	cmd_free(cmd);
+	if (cmd != NULL)
+		cmd_free(cmd);
 	xfree(s);
 	return (DELIVER_SUCCESS);
 
@@ -130,5 +200,6 @@ deliver_rewrite_desc(struct actitem *ti, char *buf, size_t len)
 {
 	struct deliver_rewrite_data	*data = ti->data;
 
-	xsnprintf(buf, len, "rewrite \"%s\"", data->cmd.str);
+	xsnprintf(buf, len, "rewrite \"%s\"%s", data->cmd.str,
+	    ti->coproc != NULL ? " coprocess" : "");
 }
@@ -32,10 +32,15 @@ int	 deliver_smtp_deliver(struct deliver_ctx *, struct actitem *);
 void	 deliver_smtp_desc(struct actitem *, char *, size_t);
 
 int	 deliver_smtp_code(char *);
+char	*deliver_smtp_address(struct deliver_ctx *, struct replstr *);
+int	 deliver_smtp_same(struct deliver_smtp_data *,
+	     struct deliver_smtp_data *);
+void	 deliver_smtp_batch(struct deliver_ctx *, const char *,
+	     struct deliver_ctxs *, struct strings *);
 
 struct deliver deliver_smtp = {
 	"smtp",
-	DELIVER_ASUSER,
+	DELIVER_INCHILD,
 	deliver_smtp_deliver,
 	deliver_smtp_desc
 };
@@ -62,59 +67,148 @@ deliver_smtp_code(char *line)
 	return (n);
 }
 
+/* Expand a from or to address, using the user and host if not given. */
+char *
+deliver_smtp_address(struct deliver_ctx *dctx, struct replstr *rs)
+{
+	struct mail	*m = dctx->mail;
+	char		*s;
+
+	if (rs->str == NULL) {
+		if (conf.host_fqdn != NULL) {
+			xasprintf(&s,
+			    "%s@%s", dctx->udata->name, conf.host_fqdn);
+		} else {
+			xasprintf(&s,
+			    "%s@%s", dctx->udata->name, conf.host_name);
+		}
+		return (s);
+	}
+
+	s = replacestr(rs, m->tags, m, &m->rml);
+	if (s != NULL && *s == '\0') {
+		xfree(s);
+		s = NULL;
+	}
+	return (s);
+}
+
+/* Check if two actions deliver to the same server. */
+int
+deliver_smtp_same(struct deliver_smtp_data *d1, struct deliver_smtp_data *d2)
+{
+	if (strcmp(d1->server.host, d2->server.host) != 0)
+		return (0);
+	if (strcmp(d1->server.port, d2->server.port) != 0)
+		return (0);
+	if (d1->server.ssl != d2->server.ssl)
+		return (0);
+	if (d1->server.verify != d2->server.verify)
+		return (0);
+	if (d1->server.insecure != d2->server.insecure)
+		return (0);
+	return (1);
+}
+
+/*
+ * Add any SMTP deliveries queued directly after this one for the same mail
+ * which go to the same server with the same from address, so they can be sent
+ * as extra recipients in one transaction. Each to is expanded with the tags
+ * as they will be when its own action is started.
+ */
+void
+deliver_smtp_batch(struct deliver_ctx *dctx, const char *from,
+    struct deliver_ctxs *batch, struct strings *tos)
+{
+	struct mail			*m = dctx->mail;
+	struct deliver_smtp_data	*data = dctx->actitem->data;
+	struct deliver_ctx		*next;
+	char				*nfrom, *nto;
+
+	next = dctx;
+	while ((next = TAILQ_NEXT(next, entry)) != NULL) {
+		if (next->actitem->deliver != &deliver_smtp)
+			break;
+		if (!deliver_smtp_same(data, next->actitem->data))
+			break;
+
+		add_tag(&m->tags, "action", "%s", next->action->name);
+		update_tags(&m->tags, next->udata);
+		nfrom = deliver_smtp_address(next,
+		    &((struct deliver_smtp_data *) next->actitem->data)->from);
+		nto = deliver_smtp_address(next,
+		    &((struct deliver_smtp_data *) next->actitem->data)->to);
+		add_tag(&m->tags, "action", "%s", dctx->action->name);
+		update_tags(&m->tags, dctx->udata);
+
+		if (nfrom == NULL || nto == NULL || strcmp(nfrom, from) != 0) {
+			if (nfrom != NULL)
+				xfree(nfrom);
+			if (nto != NULL)
+				xfree(nto);
+			break;
+		}
+		xfree(nfrom);
+
+		ARRAY_ADD(batch, next);
+		ARRAY_ADD(tos, nto);
+	}
+}
+
 int
 deliver_smtp_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 {
 	struct account			*a = dctx->account;
 	struct mail			*m = dctx->mail;
 	struct deliver_smtp_data	*data = ti->data;
-	int				 done, code;
+	int				 done, code, *ok;
 	struct io			*io;
 	char				*cause, *to, *from, *line, *ptr, *lbuf;
 	enum deliver_smtp_state		 state;
 	size_t				 len, llen;
+	struct deliver_ctxs		 batch;
+	struct strings			 tos;
+	struct deliver_ctx		*bctx;
+	u_int				 i, rcpt, accepted;
+
+	if ((to = deliver_smtp_address(dctx, &data->to)) == NULL) {
+		log_warnx("%s: empty to", a->name);
+		return (DELIVER_FAILURE);
+	}
+	if ((from = deliver_smtp_address(dctx, &data->from)) == NULL) {
+		log_warnx("%s: empty from", a->name);
+		xfree(to);
+		return (DELIVER_FAILURE);
+	}
+
+	ARRAY_INIT(&batch);
+	ARRAY_INIT(&tos);
+	ARRAY_ADD(&batch, dctx);
+	ARRAY_ADD(&tos, to);
+	deliver_smtp_batch(dctx, from, &batch, &tos);
+	if (ARRAY_LENGTH(&batch) > 1) {
+		log_debug2("%s: sending to %u recipients together", a->name,
+		    ARRAY_LENGTH(&batch));
+	}
+	ok = xcalloc(ARRAY_LENGTH(&batch), sizeof *ok);
+
+	llen = IO_LINESIZE;
+	lbuf = xmalloc(llen);
 
 	io = connectproxy(&data->server,
 	    conf.verify_certs, a->proxy, IO_CRLF, conf.timeout, &cause);
 	if (io == NULL) {
 		log_warnx("%s: %s", a->name, cause);
 		xfree(cause);
-		return (DELIVER_FAILURE);
+		goto failed;
 	}
 	if (conf.debug > 3 && !conf.syslog)
 		io->dup_fd = STDOUT_FILENO;
 
-	llen = IO_LINESIZE;
-	lbuf = xmalloc(llen);
-
-	if (conf.host_fqdn != NULL)
-		xasprintf(&ptr, "%s@%s", dctx->udata->name, conf.host_fqdn);
-	else
-		xasprintf(&ptr, "%s@%s", dctx->udata->name, conf.host_name);
-	if (data->to.str == NULL)
-		to = xstrdup(ptr);
-	else {
-		to = replacestr(&data->to, m->tags, m, &m->rml);
-		if (to == NULL || *to == '\0') {
-			xasprintf(&cause, "%s: empty to", a->name);
-			from = NULL;
-			goto error;
-		}
-	}
-	if (data->from.str == NULL)
-		from = xstrdup(ptr);
-	else {
-		from = replacestr(&data->from, m->tags, m, &m->rml);
-		if (from == NULL || *from == '\0') {
-			xasprintf(&cause, "%s: empty from", a->name);
-			goto error;
-		}
-	}
-	xfree(ptr);
-
 	state = SMTP_CONNECTING;
 	line = NULL;
 	done = 0;
+	rcpt = accepted = 0;
 	do {
 		switch (io_pollline2(io,
 		    &line, &lbuf, &llen, conf.timeout, &cause)) {
@@ -147,10 +241,35 @@ deliver_smtp_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 			if (code != 250)
 				goto error;
 			state = SMTP_TO;
-			io_writeline(io, "RCPT TO:<%s>", to);
+			io_writeline(io, "RCPT TO:<%s>", ARRAY_FIRST(&tos));
 			break;
 		case SMTP_TO:
-			if (code != 250)
+			/*
+			 * A rejected recipient fails its own action, which stops
+			 * the mail there, so the actions after it are never
+			 * started. Leave them out of the batch so their
+			 * recipients are not sent the mail either.
+			 */
+			if (code == 250 || code == 251) {
+				ok[rcpt] = 1;
+				accepted++;
+			} else {
+				if (ARRAY_LENGTH(&batch) > 1) {
+					bctx = ARRAY_ITEM(&batch, rcpt);
+					log_warnx("%s: action %s: recipient %s "
+					    "rejected: %s", a->name,
+					    bctx->action->name,
+					    ARRAY_ITEM(&tos, rcpt), line);
+				}
+				ARRAY_TRUNC(&batch,
+				    ARRAY_LENGTH(&batch) - rcpt - 1);
+			}
+			if (++rcpt < ARRAY_LENGTH(&batch)) {
+				io_writeline(io,
+				    "RCPT TO:<%s>", ARRAY_ITEM(&tos, rcpt));
+				break;
+			}
+			if (accepted == 0)
 				goto error;
 			state = SMTP_DATA;
 			io_writeline(io, "DATA");
@@ -196,14 +315,9 @@ deliver_smtp_deliver(struct deliver_ctx *dctx, struct actitem *ti)
 		}
 	} while (!done);
 
-	xfree(lbuf);
-	xfree(from);
-	xfree(to);
-
 	io_close(io);
 	io_free(io);
-
-	return (DELIVER_SUCCESS);
+	goto out;
 
 error:
 	if (cause != NULL) {
@@ -215,16 +329,38 @@ error:
 	io_writeline(io, "QUIT");
 	io_flush(io, conf.timeout, NULL);
 
-	xfree(lbuf);
-	if (from != NULL)
-		xfree(from);
-	if (to != NULL)
-		xfree(to);
-
 	io_close(io);
 	io_free(io);
 
-	return (DELIVER_FAILURE);
+failed:
+	memset(ok, 0, ARRAY_LENGTH(&batch) * sizeof *ok);
+
+out:
+	/*
+	 * Record the result for the other actions in the batch, to be returned
+	 * when they are started.
+	 */
+	for (i = 1; i < ARRAY_LENGTH(&batch); i++) {
+		bctx = ARRAY_ITEM(&batch, i);
+		bctx->batched = 1;
+		if (ok[i])
+			bctx->result = DELIVER_SUCCESS;
+		else
+			bctx->result = DELIVER_FAILURE;
+	}
+	done = ok[0];
+
+	xfree(ok);
+	xfree(lbuf);
+	xfree(from);
+	for (i = 0; i < ARRAY_LENGTH(&tos); i++)
+		xfree(ARRAY_ITEM(&tos, i));
+	ARRAY_FREE(&tos);
+	ARRAY_FREE(&batch);
+
+	if (!done)
+		return (DELIVER_FAILURE);
+	return (DELIVER_SUCCESS);
 }
 
 void
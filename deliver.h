@@ -35,11 +35,16 @@ struct deliver_ctx {
 	struct mail			*mail;
 
 	struct userdata			*udata;
+	struct coproc			*coproc;
 
 	struct mail			 wr_mail;
 
+	int				 batched; /* done with an earlier action */
+	int				 result;
+
 	TAILQ_ENTRY(deliver_ctx)	 entry;
 };
+ARRAY_DECL(deliver_ctxs, struct deliver_ctx *);
 
 /* Delivery types. */
 enum delivertype {
@@ -75,6 +80,15 @@ struct deliver_smtp_data {
 	struct replstr	from;
 };
 
+/* Deliver lmtp data. */
+struct deliver_lmtp_data {
+	struct server	 server;	/* host NULL if socket */
+	char		*path;
+
+	struct replstrs	*to;		/* NULL for default */
+	struct replstr	 from;
+};
+
 /* Deliver imap data. */
 struct deliver_imap_data {
 	char		*user;
@@ -152,8 +166,13 @@ struct deliver_remove_from_cache_data {
 /* deliver-smtp.c */
 extern struct deliver	 deliver_smtp;
 
+/* deliver-lmtp.c */
+extern struct deliver	 deliver_lmtp;
+void			 deliver_lmtp_close(void);
+
 /* deliver-imap.c */
 extern struct deliver	 deliver_imap;
+void			 deliver_imap_close(void);
 
 /* deliver-stdout.c */
 extern struct deliver	 deliver_stdout;
@@ -172,6 +191,7 @@ extern struct deliver	 deliver_keep;
 
 /* deliver-maildir.c */
 extern struct deliver	 deliver_maildir;
+void	 deliver_maildir_add(uid_t, const char *);
 
 /* deliver-remove-header.c */
 extern struct deliver	 deliver_remove_header;
@@ -43,6 +43,8 @@ const char		*malloc_options = "AFGJPRX";
 #endif
 
 void			 sighandler(int);
+void			 fill_users1(struct replstrs *);
+void			 fill_users2(struct rules *);
 struct child		*check_children(struct children *, u_int *);
 int			 wait_children(
 			     struct children *, struct children *, int);
@@ -97,6 +99,89 @@ fill_host(void)
 	getaddrs(host, &conf.host_fqdn, &conf.host_address);
 }
 
+/*
+ * Look up the users named in the configuration which need no tag replacement
+ * so they are in the lookup cache before any children are started.
+ */
+void
+fill_users(void)
+{
+	struct account	*a;
+	struct action	*t;
+
+	if (conf.lookup_expire == 0)
+		return;
+
+	TAILQ_FOREACH(a, &conf.accounts, entry)
+		fill_users1(a->users);
+	TAILQ_FOREACH(t, &conf.actions, entry)
+		fill_users1(t->users);
+	fill_users2(&conf.rules);
+}
+
+void
+fill_users1(struct replstrs *users)
+{
+	struct userdata	*ud;
+	const char	*user;
+	u_int		 i;
+
+	if (users == NULL)
+		return;
+	for (i = 0; i < ARRAY_LENGTH(users); i++) {
+		user = ARRAY_ITEM(users, i).str;
+		if (strchr(user, '%') != NULL)
+			continue;
+		if ((ud = user_lookup(user, conf.user_order)) != NULL)
+			user_free(ud);
+	}
+}
+
+void
+fill_users2(struct rules *rules)
+{
+	struct rule	*r;
+
+	TAILQ_FOREACH(r, rules, entry) {
+		fill_users1(r->users);
+		fill_users2(&r->rules);
+	}
+}
+
+/*
+ * Expire old items from the caches once, before any children are started,
+ * rather than in every child that opens them.
+ */
+void
+expire_caches(void)
+{
+	struct cache	*cache;
+	struct stat	 sb;
+	int		 n;
+
+	TAILQ_FOREACH(cache, &conf.caches, entry) {
+		if (cache->expire == 0)
+			continue;
+		if (stat(cache->path, &sb) != 0)
+			continue;
+
+		if ((cache->db = db_open(cache->path)) == NULL) {
+			log_warn("parent: %s", cache->path);
+			continue;
+		}
+		n = db_size(cache->db);
+		if (db_expire(cache->db, cache->expire) != 0)
+			log_warnx("parent: %s: expiry failed", cache->path);
+		else {
+			n -= db_size(cache->db);
+			log_debug2("parent: cache %s: expired %d keys",
+			    cache->path, n);
+		}
+		db_close(cache->db);
+		cache->db = NULL;
+	}
+}
+
 void
 dropto(uid_t uid, gid_t gid)
 {
@@ -199,6 +284,10 @@ wait_children(
 
 	flags = no_hang ? WNOHANG : 0;
 	for (;;) {
+		/* Coprocesses are not stopped until the end, so don't wait. */
+		if (!no_hang && ARRAY_EMPTY(children))
+			return (retcode);
+
 		log_debug3("parent: waiting for children");
 		/* Wait for a child. */
 		switch (pid = waitpid(WAIT_ANY, &status, flags)) {
@@ -234,8 +323,10 @@ wait_children(
 				break;
 		}
 		if (i == ARRAY_LENGTH(children)) {
-			log_debug2("parent: unidentified child %ld",
-			    (long) pid);
+			if (!coproc_died(pid)) {
+				log_debug2("parent: unidentified child %ld",
+				    (long) pid);
+			}
 			continue;
 		}
 
@@ -311,11 +402,16 @@ main(int argc, char **argv)
 	TAILQ_INIT(&conf.accounts);
 	TAILQ_INIT(&conf.rules);
 	TAILQ_INIT(&conf.actions);
+	RB_INIT(&conf.action_tree);
 	TAILQ_INIT(&conf.caches);
 	conf.lock_wait = 0;
 	conf.lock_timeout = DEFLOCKTIMEOUT;
 	conf.max_size = DEFMAILSIZE;
 	conf.timeout = DEFTIMEOUT;
+	conf.connect_stagger = DEFCONNECTSTAGGER;
+	conf.durability = DURABILITY_PERMAIL;
+	conf.group_count = DEFGROUPCOUNT;
+	conf.group_delay = DEFGROUPDELAY;
 	conf.lock_types = LOCK_FLOCK;
 	conf.impl_act = DECISION_NONE;
 	conf.purge_after = 0;
@@ -331,6 +427,7 @@ main(int argc, char **argv)
 	conf.user_order = xmalloc(sizeof *conf.user_order);
 	ARRAY_INIT(conf.user_order);
 	ARRAY_ADD(conf.user_order, passwd_lookup);
+	conf.lookup_expire = -1;
 
 	ARRAY_INIT(&conf.incl);
 	ARRAY_INIT(&conf.excl);
@@ -479,23 +576,23 @@ main(int argc, char **argv)
 	/* Set the umask. */
 	umask(conf.file_umask);
 
-	/* Check default and command users. */
-	if (conf.def_user == NULL) {
-		ud = user_lookup(conf.def_user, conf.user_order);
-		if (ud == NULL) {
-			log_warnx("unknown user: %s", conf.def_user);
-			exit(1);
-		}
-		user_free(ud);
+	/*
+	 * Check default and command users. This also puts them in the lookup
+	 * cache, which is inherited by the children.
+	 */
+	ud = user_lookup(conf.def_user, conf.user_order);
+	if (ud == NULL) {
+		log_warnx("unknown user: %s", conf.def_user);
+		exit(1);
 	}
-	if (conf.cmd_user == NULL) {
-		ud = user_lookup(conf.cmd_user, conf.user_order);
-		if (ud == NULL) {
-			log_warnx("unknown user: %s", conf.cmd_user);
-			exit(1);
-		}
-		user_free(ud);
+	user_free(ud);
+	ud = user_lookup(conf.cmd_user, conf.user_order);
+	if (ud == NULL) {
+		log_warnx("unknown user: %s", conf.cmd_user);
+		exit(1);
 	}
+	user_free(ud);
+	fill_users();
 
 	/* Print some locking info. */
 	*tmp = '\0';
@@ -524,8 +621,21 @@ main(int argc, char **argv)
 		off = strlcat(tmp, "delete-oversized, ", sizeof tmp);
 	if (conf.verify_certs)
 		off = strlcat(tmp, "verify-certificates, ", sizeof tmp);
+	if (conf.maildir_links)
+		off = strlcat(tmp, "maildir-links, ", sizeof tmp);
 	if (conf.ignore_errors)
 		off = strlcat(tmp, "ignore-errors, ", sizeof tmp);
+	if (sizeof tmp > off && conf.ssl_cache != NULL) {
+		off += xsnprintf(tmp + off, (sizeof tmp) - off,
+		    "ssl-session-cache=\"%s\", ", conf.ssl_cache);
+	}
+	if (conf.durability == DURABILITY_NONE)
+		off = strlcat(tmp, "durability=none, ", sizeof tmp);
+	else if (sizeof tmp > off && conf.durability == DURABILITY_GROUP) {
+		off += xsnprintf(tmp + off, (sizeof tmp) - off,
+		    "durability=group(%u,%d), ", conf.group_count,
+		    conf.group_delay);
+	}
 	if (sizeof tmp > off && conf.purge_after > 0) {
 		off += xsnprintf(tmp + off, (sizeof tmp) - off,
 		    "purge-after=%u, ", conf.purge_after);
@@ -538,6 +648,10 @@ main(int argc, char **argv)
 		off += xsnprintf(tmp + off, (sizeof tmp) - off,
 		    "timeout=%d, ", conf.timeout / 1000);
 	}
+	if (sizeof tmp > off && conf.connect_stagger != DEFCONNECTSTAGGER) {
+		off += xsnprintf(tmp + off, (sizeof tmp) - off,
+		    "connect-stagger=%d, ", conf.connect_stagger);
+	}
 	if (sizeof tmp > off) {
 		off += xsnprintf(tmp + off, (sizeof tmp) - off,
 		    "default-user=\"%s\", ", conf.def_user);
@@ -546,6 +660,12 @@ main(int argc, char **argv)
 		off += xsnprintf(tmp + off, (sizeof tmp) - off,
 		    "command-user=\"%s\", ", conf.cmd_user);
 	}
+	if (sizeof tmp > off && conf.lookup_expire == 0)
+		off = strlcat(tmp, "lookup-cache=none, ", sizeof tmp);
+	else if (sizeof tmp > off && conf.lookup_expire > 0) {
+		off += xsnprintf(tmp + off, (sizeof tmp) - off,
+		    "lookup-cache-expire=%lld, ", conf.lookup_expire);
+	}
 	if (sizeof tmp > off && conf.impl_act != DECISION_NONE) {
 		if (conf.impl_act == DECISION_DROP)
 			s = "drop";
@@ -715,6 +835,9 @@ retry:
 		goto out;
 	}
 
+	if (op == FDMOP_FETCH)
+		expire_caches();
+
 	/* Initialise the child process arrays. */
 	ARRAY_INIT(&children);
 	ARRAY_INIT(&dead_children);
@@ -763,7 +886,7 @@ retry:
 		/* Poll the io list. */
 		if (ARRAY_LENGTH(&iol) != 0) {
 			switch (io_polln(ARRAY_DATA(&iol), ARRAY_LENGTH(&iol),
-			    &dead_io, INFTIM, NULL)) {
+			    &dead_io, parent_deliver_timeout(), NULL)) {
 			case -1:
 			case 0:
 				break;
@@ -773,6 +896,7 @@ retry:
 			}
 		} else {
 			/* No more children. Sleep until all are waited. */
+			parent_deliver_flush();
 			if (wait_children(&children, &dead_children, 0) != 0)
 				res = 1;
 		}
@@ -796,6 +920,10 @@ retry:
 				fatalx("privsep_send error");
 		}
 
+		/* Send any held delivery results which are due. */
+		if (parent_deliver_timeout() == 0)
+			parent_deliver_flush();
+
 		/* Collect any dead children. */
 		if (sigchld && wait_children(&children, &dead_children, 1) != 0)
 			res = 1;
@@ -821,6 +949,9 @@ retry:
 	}
 	ARRAY_FREE(&iol);
 
+	/* Send anything still held for children which have gone. */
+	parent_deliver_flush();
+
 	/* Free the dead children. */
 	for (i = 0; i < ARRAY_LENGTH(&dead_children); i++) {
 		child = ARRAY_ITEM(&dead_children, i);
@@ -830,6 +961,9 @@ retry:
 	}
 	ARRAY_FREE(&dead_children);
 
+	/* Stop any coprocesses. */
+	coproc_stop();
+
 	if (sigint || sigterm) {
 		act.sa_handler = SIG_IGN;
 		if (sigaction(SIGINT, &act, NULL) < 0)
@@ -912,6 +1046,7 @@ out:
 	xfree(conf.cmd_user);
 	xfree(conf.user_home);
 	ARRAY_FREEALL(conf.user_order);
+	user_cache_free();
 	xfree(conf.host_name);
 	if (conf.host_fqdn != NULL)
 		xfree(conf.host_fqdn);
@@ -919,6 +1054,8 @@ out:
 		xfree(conf.host_address);
 	xfree(conf.conf_file);
 	xfree(conf.lock_file);
+	if (conf.ssl_cache != NULL)
+		xfree(conf.ssl_cache);
 	xfree(conf.tmp_dir);
 	xfree(conf.strip_chars);
 	free_strings(&conf.incl);
@@ -58,17 +58,27 @@
 #define DEFLOCKTIMEOUT	10
 #define MAXQUEUEVALUE	50
 #define DEFMAILQUEUE	2
+#define DEFGROUPCOUNT	32
+#define DEFGROUPDELAY	100
 #define DEFMAILSIZE	(32 * 1024 * 1024)		/* 32 MB */
 #define MAXMAILSIZE	(1 * 1024 * 1024 * 1024)	/*  1 GB */
+#define MAILHEADROOM	1024	/* space for the received header */
 #define DEFSTRIPCHARS	"\\<>$%^&*|{}[]\"'`;"
 #define MAXACTIONCHAIN	5
 #define DEFTIMEOUT	(900 * 1000)
+
+/* Delay before trying the next address when connecting, in milliseconds. */
+#define DEFCONNECTSTAGGER 250
 #define LOCKSLEEPTIME	10000				/* 0.1 seconds */
 #define MAXNAMESIZE	64
 #define DEFUMASK	(S_IRWXG|S_IRWXO)
 #define FILEMODE	(S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)
 #define DIRMODE		(S_IRWXU|S_IRWXG|S_IRWXO)
 #define MAXUSERLEN	256
+#define DEFBLOOMSIZE	(16 * 1024 * 1024)		/* 16 MB */
+#define DEFBLOOMRATE	100				/* 1 in 100 */
+#define MAXCOPROCS	16
+#define BLOOM_MAXHASHES	16
 
 extern char	*__progname;
 
@@ -98,6 +108,12 @@ extern char	*__progname;
 #ifndef letoh64
 #define letoh64
 #endif
+#ifndef htole32
+#define htole32
+#endif
+#ifndef letoh32
+#define letoh32
+#endif
 
 /* Fatal errors. */
 #define fatal(msg) log_fatal("%s: %s", __func__, msg);
@@ -233,6 +249,13 @@ struct shm {
 /* Generic array of strings. */
 ARRAY_DECL(strings, char *);
 
+/* How file deliveries are synced to disk. */
+enum durability {
+	DURABILITY_PERMAIL,	/* sync each mail before reporting success */
+	DURABILITY_GROUP,	/* sync groups of mails in the parent */
+	DURABILITY_NONE
+};
+
 /* Options for final mail handling. */
 enum decision {
 	DECISION_NONE,
@@ -302,18 +325,64 @@ struct rmlist {
 #define RE_NOSUBST 0x2
 
 /* Cache data. */
+struct cachepending {
+	char			*key;
+	int			 add;		/* 0 to remove */
+
+	RB_ENTRY(cachepending)	 entry;
+};
+RB_HEAD(cachependings, cachepending);
+struct bloom {
+	u_char			*data;
+	uint64_t		 bits;
+	u_int			 hashes;
+};
 struct cache {
 	TDB_CONTEXT		*db;
 
 	char			*path;
 	uint64_t		 expire;
 
+	size_t			 bloom_size;	/* 0 for no filter */
+	u_int			 bloom_rate;
+	struct bloom		*bloom;
+	struct cachemark	*bloom_mark;
+
+	uint64_t		 write_behind;	/* 0 to write immediately */
+	struct cachependings	 pendings;
+	time_t			 flushed;
+
 	TAILQ_ENTRY(cache)	 entry;
 };
 struct cacheitem {
 	uint64_t		 tim;
 	uint32_t		 pad[4];
 } __packed;
+struct cacheheader {
+	uint32_t		 magic;
+	uint32_t		 version;
+	uint64_t		 first;		/* oldest bucket */
+	uint32_t		 pad[6];
+} __packed;
+struct cacheshard {
+	uint64_t		 items;
+	uint64_t		 bucket;	/* bucket keys are added to */
+	uint64_t		 chunk;		/* and its last chunk */
+	uint32_t		 keys;		/* keys in that chunk */
+	uint32_t		 size;		/* and its size */
+	uint32_t		 pad[2];
+} __packed;
+#define DB_MAGIC	0x666d6463
+#define DB_VERSION	2
+#define DB_SHARDS	16
+#define DB_CHUNKKEYS	64
+#define DB_BUCKETTIME	3600
+#define DB_BUCKETKEYLEN	48
+#define DB_MARKBUCKETS	24
+struct cachemark {		/* how far a filter has read each shard */
+	int			 seqnum[DB_SHARDS];
+	struct cacheshard	 shard[DB_SHARDS];
+};
 
 /* A single mail. */
 struct mail {
@@ -323,6 +392,7 @@ struct mail {
 	struct strb		*tags;
 
 	struct shm		 shm;
+	int			 mapped;	/* mapped from file, not in shm */
 
 	struct attach		*attach;
 	int			 attach_built;
@@ -477,6 +547,8 @@ struct child_deliver_data {
 	struct mail_ctx		*mctx;
 
 	struct match_command_data *cmddata;
+
+	struct coproc		*coproc; /* started by the parent, if any */
 };
 
 /* Account entry. */
@@ -506,6 +578,8 @@ struct actitem {
 	struct deliver		*deliver;
 	void			*data;
 
+	struct replpath		*coproc;	/* command if coprocess */
+
 	TAILQ_ENTRY(actitem)	 entry;
 };
 
@@ -521,7 +595,9 @@ struct action {
 	struct actlist		*list;
 
 	TAILQ_ENTRY(action)	 entry;
+	RB_ENTRY(action)	 tentry;
 };
+RB_HEAD(actiontree, action);
 
 /* Actions arrays. */
 ARRAY_DECL(actions, struct action *);
@@ -607,6 +683,7 @@ struct conf {
 
 	char			*user_home;
 	struct userfunctions	*user_order;
+	long long		 lookup_expire;
 
 	char			*host_name;
 	char			*host_fqdn;
@@ -619,7 +696,12 @@ struct conf {
 	int			 keep_all;
 	int			 no_received;
 	int			 no_create;
+	int			 maildir_links;
 	int			 verify_certs;
+	char			*ssl_cache;
+	enum durability		 durability;
+	u_int			 group_count;
+	int			 group_delay;
 	u_int			 purge_after;
 	enum decision		 impl_act;
 	int			 max_accts;
@@ -636,6 +718,7 @@ struct conf {
 
 	size_t			 max_size;
 	int			 timeout;
+	int			 connect_stagger;
 	int			 del_big;
 	int			 ignore_errors;
 	u_int			 lock_types;
@@ -646,6 +729,7 @@ struct conf {
 	TAILQ_HEAD(, cache)	 caches;
 	TAILQ_HEAD(, account)	 accounts;
 	TAILQ_HEAD(, action)	 actions;
+	struct actiontree	 action_tree;
 	struct rules		 rules;
 };
 extern struct conf		 conf;
@@ -654,6 +738,7 @@ extern struct conf		 conf;
 #define CMD_IN	0x1
 #define CMD_OUT 0x2
 #define CMD_ONCE 0x4
+#define CMD_RAW 0x8	/* return stdout in blocks with cmd_read */
 
 /* Command data. */
 struct cmd {
@@ -664,11 +749,29 @@ struct cmd {
 	const char	*buf;
 	size_t		 len;
 
+	int		 fd;		/* file holding buf, -1 if none */
+	off_t		 off;
+
 	struct io	*io_in;
 	struct io	*io_out;
 	struct io	*io_err;
 };
 
+/* Coprocess. */
+struct coproc {
+	char		*cmd;
+	uid_t		 uid;
+	pid_t		 pid;		/* -1 if closed */
+
+	int		 in;
+	int		 out;
+	int		 lock;
+
+	u_int		 used;		/* for stopping the least recent */
+
+	TAILQ_ENTRY(coproc) entry;
+};
+
 /* Comparison operators. */
 enum cmp {
 	CMP_EQ,
@@ -711,6 +814,7 @@ size_t		 strlcat(char *, const char *, size_t);
 /* shm.c */
 char		*shm_path(struct shm *);
 void		*shm_create(struct shm *, size_t);
+void		*shm_copy(struct shm *, size_t, const void *, int, size_t);
 int		 shm_owner(struct shm *, uid_t, gid_t);
 void		 shm_destroy(struct shm *);
 void		 shm_close(struct shm *);
@@ -735,7 +839,10 @@ char		*fmt_replstrs(const char *, struct replstrs *);
 char		*fmt_strings(const char *, struct strings *);
 int		 have_accounts(char *);
 struct account	*find_account(char *);
-struct action	*find_action(char *);
+int		 action_cmp(struct action *, struct action *);
+RB_PROTOTYPE(actiontree, action, tentry, action_cmp);
+struct action	*find_action(const char *);
+struct actions	*find_actions(const char *);
 struct actions	*match_actions(const char *);
 struct macro	*extract_macro(char *);
 struct macro	*find_macro(const char *);
@@ -767,6 +874,8 @@ int		 check_incl(const char *);
 int		 check_excl(const char *);
 int		 use_account(struct account *, char **);
 void		 fill_host(void);
+void		 fill_users(void);
+void		 expire_caches(void);
 __dead void	 usage(void);
 
 /* cache-op.c */
@@ -787,6 +896,7 @@ void		 attach_free(struct attach *);
 
 /* lookup.c */
 struct userdata *user_lookup(const char *, struct userfunctions *);
+void		 user_cache_free(void);
 void		 user_free(struct userdata *);
 struct userdata *user_copy(struct userdata *);
 
@@ -803,8 +913,19 @@ int		 privsep_recv(struct io *, struct msg *, struct msgbuf *);
 struct cmd	*cmd_start(const char *, int, const char *, size_t, char **);
 int		 cmd_poll(struct cmd *, char **, char **, char **, size_t *,
 		     int, char **);
+void		 cmd_set_file(struct cmd *, int, off_t);
+size_t		 cmd_pending(struct cmd *);
+void		 cmd_read(struct cmd *, void *, size_t);
 void		 cmd_free(struct cmd *);
 
+/* coproc.c */
+struct coproc	*coproc_start(const char *, uid_t, gid_t, char **);
+int		 coproc_died(pid_t);
+void		 coproc_stop(void);
+void		 coproc_close(uid_t);
+int		 coproc_run(struct coproc *, const char *, size_t, int *,
+		     char **, size_t *, int, char **);
+
 /* child.c */
 int		 child_fork(void);
 __dead void	 child_exit(int);
@@ -815,6 +936,10 @@ struct child	*child_start(struct children *, uid_t, gid_t,
 
 /* child-fetch.c */
 int		 open_cache(struct account *, struct cache *);
+int		 cache_flush(struct account *);
+int		 cache_add(struct account *, struct cache *, char *);
+int		 cache_remove(struct account *, struct cache *, char *);
+int		 cache_contains(struct account *, struct cache *, char *);
 int		 child_fetch(struct child *, struct io *);
 
 /* child-deliver.c */
@@ -829,6 +954,10 @@ int		 parent_fetch(struct child *, struct msg *, struct msgbuf *);
 
 /* parent-deliver.c */
 int		 parent_deliver(struct child *, struct msg *, struct msgbuf *);
+void		 parent_deliver_send(struct child *, struct account *,
+		     struct mail *, struct msg *);
+int		 parent_deliver_timeout(void);
+void		 parent_deliver_flush(void);
 
 /* timer.c */
 int		 timer_expired(void);
@@ -839,11 +968,13 @@ void		 timer_cancel(void);
 char		*sslerror(const char *);
 char		*sslerror2(int, const char *);
 SSL		*makessl(struct server *, int, int, int, char **);
+void		 sslreport(const char *);
 void		 getaddrs(const char *, char **, char **);
 struct proxy	*getproxy(const char *);
 struct io	*connectproxy(struct server *, int, struct proxy *,
 		     const char *, int, char **);
 struct io	*connectio(struct server *, int, const char *, int, char **);
+struct io	*connectunix(const char *, const char *, char **);
 
 /* file.c */
 int printflike3	 ppath(char *, size_t, const char *, ...);
@@ -862,8 +993,11 @@ int		 safemove(const char *, const char *);
 
 /* mail.c */
 int		 mail_open(struct mail *, size_t);
+int		 mail_open_file(struct mail *, int, off_t, size_t);
+int		 mail_share(struct mail *);
 void		 mail_send(struct mail *, struct msg *);
 int		 mail_receive(struct mail *, struct msg *, int);
+int		 mail_write(struct mail *, int);
 void		 mail_close(struct mail *);
 void		 mail_destroy(struct mail *);
 int		 mail_resize(struct mail *, size_t);
@@ -893,13 +1027,27 @@ int		 mail_deliver(struct mail_ctx *, struct msg *, struct msgbuf *);
 /* db-tdb.c */
 TDB_CONTEXT	*db_open(char *);
 void		 db_close(TDB_CONTEXT *);
-int		 db_add(TDB_CONTEXT *, char *);
-int		 db_remove(TDB_CONTEXT *, char *);
+int		 db_add(TDB_CONTEXT *, char *, struct cachemark *);
+int		 db_remove(TDB_CONTEXT *, char *, struct cachemark *);
 int		 db_contains(TDB_CONTEXT *, char *);
 int		 db_size(TDB_CONTEXT *);
 int		 db_print(TDB_CONTEXT *, void (*)(const char *, ...));
 int		 db_expire(TDB_CONTEXT *, uint64_t);
 int		 db_clear(TDB_CONTEXT *);
+u_int		 db_version(TDB_CONTEXT *);
+int		 db_upgrade(TDB_CONTEXT *);
+int		 db_begin(TDB_CONTEXT *);
+int		 db_commit(TDB_CONTEXT *);
+void		 db_cancel(TDB_CONTEXT *);
+int		 db_fill_bloom(TDB_CONTEXT *, struct bloom *, struct cachemark *);
+int		 db_update_bloom(
+		     TDB_CONTEXT *, struct bloom *, struct cachemark *, char *);
+
+/* bloom.c */
+struct bloom	*bloom_create(u_int, u_int, size_t);
+void		 bloom_free(struct bloom *);
+void		 bloom_add(struct bloom *, const void *, size_t);
+int		 bloom_check(struct bloom *, const void *, size_t);
 
 /* cleanup.c */
 void		 cleanup_check(void);
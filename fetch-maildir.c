@@ -43,6 +43,14 @@ void	fetch_maildir_freepaths(struct account *);
 
 int	fetch_maildir_poll(struct account *);
 
+int	fetch_maildir_cmp(struct fetch_maildir_entry *,
+	    struct fetch_maildir_entry *);
+void	fetch_maildir_freeindex(struct account *);
+int	fetch_maildir_load(struct account *);
+int	fetch_maildir_save(struct account *, int);
+int	fetch_maildir_indexed(struct account *, DIR *, struct dirent *);
+void	fetch_maildir_update(struct account *, struct mail *);
+
 int	fetch_maildir_state_init(struct account *, struct fetch_ctx *);
 int	fetch_maildir_state_build(struct account *, struct fetch_ctx *);
 int	fetch_maildir_state_next(struct account *, struct fetch_ctx *);
@@ -60,6 +68,11 @@ struct fetch fetch_maildir = {
 	fetch_maildir_desc
 };
 
+RB_PROTOTYPE(fetch_maildir_tree, fetch_maildir_entry, entry,
+    fetch_maildir_cmp);
+RB_GENERATE(fetch_maildir_tree, fetch_maildir_entry, entry,
+    fetch_maildir_cmp);
+
 void
 fetch_maildir_free(void *ptr)
 {
@@ -147,16 +160,19 @@ fetch_maildir_freepaths(struct account *a)
 	data->paths = NULL;
 }
 
-/* Count maildir total. */
+/*
+ * Count maildir total. This only needs a count, so where the file system does
+ * not give the type of an entry, anything not starting with a dot is assumed
+ * to be a mail rather than calling stat on it.
+ */
 int
 fetch_maildir_poll(struct account *a)
 {
 	struct fetch_maildir_data	*data = a->data;
 	u_int				 i;
-	char				*path, entry[MAXPATHLEN];
+	char				*path;
 	DIR				*dirp;
 	struct dirent			*dp;
-	struct stat			 sb;
 
 	data->total = 0;
 	for (i = 0; i < ARRAY_LENGTH(data->paths); i++) {
@@ -169,29 +185,16 @@ fetch_maildir_poll(struct account *a)
 		}
 
 		while ((dp = readdir(dirp)) != NULL) {
-			if (dp->d_type == DT_REG) {
+			switch (dp->d_type) {
+			case DT_REG:
+			case DT_LNK:
 				data->total++;
-				continue;
+				break;
+			case DT_UNKNOWN:
+				if (*dp->d_name != '.')
+					data->total++;
+				break;
 			}
-			if (dp->d_type != DT_UNKNOWN)
-				continue;
-
-			if (ppath(entry, sizeof entry, "%s/%s", path,
-			    dp->d_name) != 0) {
-				log_warn("%s: %s: printpath", a->name, path);
-				closedir(dirp);
-				return (-1);
-			}
-
-			if (stat(entry, &sb) != 0) {
-				log_warn("%s: %s: stat", a->name, entry);
-				closedir(dirp);
-				return (-1);
-			}
-			if (!S_ISREG(sb.st_mode))
-				continue;
-
-			data->total++;
 		}
 
 		if (closedir(dirp) != 0) {
@@ -203,6 +206,262 @@ fetch_maildir_poll(struct account *a)
 	return (0);
 }
 
+int
+fetch_maildir_cmp(struct fetch_maildir_entry *e1,
+    struct fetch_maildir_entry *e2)
+{
+	return (strcmp(e1->name, e2->name));
+}
+
+void
+fetch_maildir_freeindex(struct account *a)
+{
+	struct fetch_maildir_data	*data = a->data;
+	struct fetch_maildir_entry	*e;
+
+	while (!RB_EMPTY(&data->entries)) {
+		e = RB_ROOT(&data->entries);
+		RB_REMOVE(fetch_maildir_tree, &data->entries, e);
+		xfree(e->name);
+		xfree(e);
+	}
+}
+
+/*
+ * Load the index file. Each line is the length of the name, the unique part
+ * of the mail file name (before any ':'), and its inode and modification time.
+ */
+int
+fetch_maildir_load(struct account *a)
+{
+	struct fetch_maildir_data	*data = a->data;
+	struct fetch_maildir_entry	*e;
+	int				 fd;
+	FILE				*f = NULL;
+	char				*name;
+	size_t				 namelen;
+	uintmax_t			 ino;
+	intmax_t			 mtime;
+	u_int				 n;
+
+	if (data->path == NULL)
+		return (0);
+
+	if ((fd = openlock(data->path, O_RDONLY, conf.lock_types)) == -1) {
+		if (errno == ENOENT)
+			return (0);
+		log_warn("%s: %s", a->name, data->path);
+		goto error;
+	}
+	if ((f = fdopen(fd, "r")) == NULL) {
+		log_warn("%s: %s", a->name, data->path);
+		goto error;
+	}
+
+	n = 0;
+	for (;;) {
+		if (fscanf(f, "%zu ", &namelen) != 1) {
+			/* EOF is allowed only at the start of a line. */
+			if (feof(f))
+				break;
+			goto invalid;
+		}
+		if (namelen == 0 || namelen > MAXNAMLEN)
+			goto invalid;
+		name = xmalloc(namelen + 1);
+		if (fread(name, namelen, 1, f) != 1) {
+			xfree(name);
+			goto invalid;
+		}
+		name[namelen] = '\0';
+		if (fscanf(f, " %ju %jd ", &ino, &mtime) != 2) {
+			xfree(name);
+			goto invalid;
+		}
+
+		e = xmalloc(sizeof *e);
+		e->name = name;
+		e->ino = ino;
+		e->mtime = mtime;
+		e->seen = 0;
+		if (RB_INSERT(fetch_maildir_tree, &data->entries, e) != NULL) {
+			xfree(e->name);
+			xfree(e);
+			continue;
+		}
+		n++;
+	}
+	log_debug2("%s: loaded index %s: %u entries", a->name, data->path, n);
+
+	fclose(f);
+	closelock(fd, data->path, conf.lock_types);
+	return (0);
+
+invalid:
+	log_warnx("%s: invalid index entry", a->name);
+
+error:
+	if (f != NULL)
+		fclose(f);
+	if (fd != -1)
+		closelock(fd, data->path, conf.lock_types);
+	return (-1);
+}
+
+/*
+ * Save the index file. If expire is set, entries for mails which were not seen
+ * during this fetch are removed first.
+ */
+int
+fetch_maildir_save(struct account *a, int expire)
+{
+	struct fetch_maildir_data	*data = a->data;
+	struct fetch_maildir_entry	*e, *e1;
+	char				*path = NULL, tmp[MAXPATHLEN];
+	int				 fd = -1;
+	FILE				*f = NULL;
+	u_int				 n;
+
+	if (data->path == NULL || data->only == FETCH_ONLY_OLD)
+		return (0);
+
+	if (expire) {
+		e = RB_MIN(fetch_maildir_tree, &data->entries);
+		while (e != NULL) {
+			e1 = e;
+			e = RB_NEXT(fetch_maildir_tree, &data->entries, e);
+			if (e1->seen)
+				continue;
+
+			log_debug3("%s: expiring from index: %s", a->name,
+			    e1->name);
+			RB_REMOVE(fetch_maildir_tree, &data->entries, e1);
+			xfree(e1->name);
+			xfree(e1);
+			data->dirty = 1;
+		}
+	}
+	if (!data->dirty)
+		return (0);
+
+	if (ppath(tmp, sizeof tmp, "%s.XXXXXXXXXX", data->path) != 0)
+		goto error;
+	if ((fd = mkstemp(tmp)) == -1)
+		goto error;
+	path = tmp;
+	cleanup_register(path);
+
+	if ((f = fdopen(fd, "r+")) == NULL)
+		goto error;
+	fd = -1;
+
+	n = 0;
+	RB_FOREACH(e, fetch_maildir_tree, &data->entries) {
+		fprintf(f, "%zu %s %ju %jd\n", strlen(e->name), e->name,
+		    (uintmax_t) e->ino, (intmax_t) e->mtime);
+		n++;
+	}
+	log_debug2("%s: saved index %s: %u entries", a->name, data->path, n);
+
+	if (fflush(f) != 0)
+		goto error;
+	if (fsync(fileno(f)) != 0)
+		goto error;
+	fclose(f);
+	f = NULL;
+
+	if (rename(path, data->path) == -1)
+		goto error;
+	cleanup_deregister(path);
+	data->dirty = 0;
+	return (0);
+
+error:
+	log_warn("%s: %s", a->name, data->path);
+
+	if (f != NULL)
+		fclose(f);
+	if (fd != -1)
+		close(fd);
+
+	if (path != NULL) {
+		if (unlink(tmp) != 0)
+			fatal("unlink failed");
+		cleanup_deregister(path);
+	}
+	return (-1);
+}
+
+/*
+ * Check if a mail file is in the index and is still the same file: the inode
+ * from the directory entry must match and then the modification time. Entries
+ * which are found are marked as seen so they are not expired.
+ */
+int
+fetch_maildir_indexed(struct account *a, DIR *dirp, struct dirent *dp)
+{
+	struct fetch_maildir_data	*data = a->data;
+	struct fetch_maildir_entry	 find, *e;
+	struct stat			 sb;
+	char				 name[MAXNAMLEN + 1];
+
+	strlcpy(name, dp->d_name, sizeof name);
+	name[strcspn(name, ":")] = '\0';
+
+	find.name = name;
+	if ((e = RB_FIND(fetch_maildir_tree, &data->entries, &find)) == NULL)
+		return (0);
+	if (dp->d_ino != e->ino)
+		return (0);
+	if (fstatat(dirfd(dirp), dp->d_name, &sb, 0) != 0)
+		return (0);
+	if (sb.st_ino != e->ino || sb.st_mtime != e->mtime)
+		return (0);
+
+	e->seen = 1;
+	return (1);
+}
+
+/* Add or update the index entry for a mail, or remove it if dropped. */
+void
+fetch_maildir_update(struct account *a, struct mail *m)
+{
+	struct fetch_maildir_data	*data = a->data;
+	struct fetch_maildir_mail	*aux = m->auxdata;
+	struct fetch_maildir_entry	 find, *e;
+	char				*ptr, name[MAXNAMLEN + 1];
+
+	if ((ptr = strrchr(aux->path, '/')) == NULL)
+		ptr = aux->path;
+	else
+		ptr++;
+	strlcpy(name, ptr, sizeof name);
+	name[strcspn(name, ":")] = '\0';
+
+	find.name = name;
+	e = RB_FIND(fetch_maildir_tree, &data->entries, &find);
+
+	if (m->decision == DECISION_DROP) {
+		if (e != NULL) {
+			RB_REMOVE(fetch_maildir_tree, &data->entries, e);
+			xfree(e->name);
+			xfree(e);
+			data->dirty = 1;
+		}
+		return;
+	}
+
+	if (e == NULL) {
+		e = xmalloc(sizeof *e);
+		e->name = xstrdup(name);
+		RB_INSERT(fetch_maildir_tree, &data->entries, e);
+	}
+	e->ino = aux->ino;
+	e->mtime = aux->mtime;
+	e->seen = 1;
+	data->dirty = 1;
+}
+
 /* Commit mail. */
 int
 fetch_maildir_commit(struct account *a, struct mail *m)
@@ -210,7 +469,11 @@ fetch_maildir_commit(struct account *a, struct mail *m)
 	struct fetch_maildir_data	*data = a->data;
 	struct fetch_maildir_mail	*aux;
 
-	aux = m->auxdata;
+	if ((aux = m->auxdata) == NULL)
+		return (FETCH_AGAIN);
+	if (data->path != NULL)
+		fetch_maildir_update(a, m);
+
 	if (m->decision == DECISION_DROP) {
 		/* Add mail to the unlink list. */
 		ARRAY_ADD(&data->unlinklist, xstrdup(aux->path));
@@ -233,6 +496,7 @@ fetch_maildir_abort(struct account *a)
 	if (data->dirp != NULL)
 		closedir(data->dirp);
 	fetch_maildir_freepaths(a);
+	fetch_maildir_freeindex(a);
 }
 
 /* Return total mails. */
@@ -260,6 +524,8 @@ fetch_maildir_state_init(struct account *a, struct fetch_ctx *fctx)
 	data->index = 0;
 	data->dirp = NULL;
 	ARRAY_INIT(&data->unlinklist);
+	RB_INIT(&data->entries);
+	data->dirty = 0;
 
 	/* Poll counts mails and exits. */
 	if (fctx->flags & FETCH_POLL) {
@@ -269,6 +535,9 @@ fetch_maildir_state_init(struct account *a, struct fetch_ctx *fctx)
 		return (FETCH_EXIT);
 	}
 
+	if (fetch_maildir_load(a) != 0)
+		return (FETCH_ERROR);
+
 	fctx->state = fetch_maildir_state_open;
 	return (FETCH_AGAIN);
 }
@@ -281,6 +550,8 @@ fetch_maildir_state_next(struct account *a, struct fetch_ctx *fctx)
 	char				*path;
 	u_int				 i;
 
+	if (!ARRAY_EMPTY(&data->unlinklist) && cache_flush(a) != 0)
+		return (FETCH_ERROR);
 	for (i = 0; i < ARRAY_LENGTH(&data->unlinklist); i++) {
 		path = ARRAY_ITEM(&data->unlinklist, i);
 		log_debug2("%s: unlinking: %s", a->name, path);
@@ -292,13 +563,20 @@ fetch_maildir_state_next(struct account *a, struct fetch_ctx *fctx)
 	}
 	ARRAY_FREE(&data->unlinklist);
 
-	if (data->index < ARRAY_LENGTH(data->paths))
+	/* Save the index after each directory. */
+	if (data->index < ARRAY_LENGTH(data->paths)) {
 		data->index++;
+		if (fetch_maildir_save(a, 0) != 0)
+			return (FETCH_ERROR);
+	}
 
 	if (data->index == ARRAY_LENGTH(data->paths)) {
 		if (!(fctx->flags & FETCH_EMPTY))
 			return (FETCH_BLOCK);
+		if (fetch_maildir_save(a, 1) != 0)
+			return (FETCH_ERROR);
 		fetch_maildir_freepaths(a);
+		fetch_maildir_freeindex(a);
 		return (FETCH_EXIT);
 	}
 
@@ -337,8 +615,7 @@ fetch_maildir_state_mail(struct account *a, struct fetch_ctx *fctx)
 	char				*path, *maildir, name[MAXPATHLEN];
 	struct stat			 sb;
 	uintmax_t			 size;
-	int				 fd;
-	ssize_t				 n;
+	int				 fd, indexed;
 
 	path = ARRAY_ITEM(data->paths, data->index);
 
@@ -356,39 +633,68 @@ restart:
 		return (FETCH_AGAIN);
 	}
 
+	/*
+	 * Skip anything which is not a file. Entries the file system gives
+	 * the type of are trusted; otherwise stat relative to the directory.
+	 */
+	if (dp->d_type != DT_REG) {
+		if (dp->d_type != DT_UNKNOWN && dp->d_type != DT_LNK)
+			goto restart;
+		if (fstatat(dirfd(data->dirp), dp->d_name, &sb, 0) != 0) {
+			log_warn("%s: %s/%s: stat", a->name, path, dp->d_name);
+			return (FETCH_ERROR);
+		}
+		if (!S_ISREG(sb.st_mode))
+			goto restart;
+	}
+
+	/* Skip mails in or not in the index. */
+	if (data->path != NULL && data->only != FETCH_ONLY_ALL) {
+		indexed = fetch_maildir_indexed(a, data->dirp, dp);
+		if (data->only == FETCH_ONLY_NEW && indexed)
+			goto restart;
+		if (data->only == FETCH_ONLY_OLD && !indexed)
+			goto restart;
+	}
+
 	if (ppath(name, sizeof name, "%s/%s", path, dp->d_name) != 0) {
 		log_warn("%s: %s: printpath", a->name, path);
 		return (FETCH_ERROR);
 	}
-	if (stat(name, &sb) != 0) {
-		log_warn("%s: %s: stat", a->name, name);
+
+	/* Open the file and find its size. */
+	if ((fd = openat(dirfd(data->dirp), dp->d_name, O_RDONLY, 0)) == -1) {
+		log_warn("%s: %s: open", a->name, name);
 		return (FETCH_ERROR);
 	}
-	if (!S_ISREG(sb.st_mode))
-		goto restart;
-
-	/* Open the mail. */
-	if (mail_open(m, sb.st_size) != 0) {
-		log_warn("%s: failed to create mail", a->name);
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		log_warn("%s: %s: stat", a->name, name);
 		return (FETCH_ERROR);
 	}
 
-	/* Got a valid entry, start reading it. */
-	log_debug2("%s: reading mail from: %s", a->name, name);
+	/*
+	 * Empty and oversize mails are not read. Otherwise the mail is taken
+	 * from the file in one go.
+	 */
 	size = sb.st_size;
-	if (sb.st_size <= 0) {
-		m->size = 0;
-		return (FETCH_MAIL);
-	} else if (size > SIZE_MAX || size > conf.max_size) {
-		m->size = SIZE_MAX;
+	if (sb.st_size <= 0 || size > SIZE_MAX || size > conf.max_size) {
+		close(fd);
+		if (mail_open(m, 0) != 0) {
+			log_warn("%s: failed to create mail", a->name);
+			return (FETCH_ERROR);
+		}
+		m->size = sb.st_size <= 0 ? 0 : SIZE_MAX;
 		return (FETCH_MAIL);
 	}
-
-	/* Open the file. */
-	if ((fd = open(name, O_RDONLY, 0)) == -1) {
-		log_warn("%s: %s: open", a->name, name);
+	log_debug2("%s: reading mail from: %s", a->name, name);
+	if (mail_open_file(m, fd, 0, size) != 0) {
+		close(fd);
+		log_warn("%s: %s: read", a->name, name);
 		return (FETCH_ERROR);
 	}
+	close(fd);
+	log_debug2("%s: read %ju bytes", a->name, size);
 
 	/* Add the tags. */
 	maildir = xbasename(xdirname(path));
@@ -400,20 +706,11 @@ restart:
 	/* Add aux data. */
 	aux = xmalloc(sizeof *aux);
 	strlcpy(aux->path, name, sizeof aux->path);
+	aux->ino = sb.st_ino;
+	aux->mtime = sb.st_mtime;
 	m->auxdata = aux;
 	m->auxfree = fetch_maildir_free;
 
-	/* Read the mail. */
-	if ((n = read(fd, m->data, size)) == -1 || (size_t) n != size) {
-		close(fd);
-		log_warn("%s: %s: read", a->name, name);
-		return (FETCH_ERROR);
-	}
-	close(fd);
-
-	log_debug2("%s: read %ju bytes", a->name, size);
-	m->size = size;
-
 	return (FETCH_MAIL);
 }
 
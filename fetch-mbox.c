@@ -41,6 +41,10 @@ void	fetch_mbox_free(void *);
 
 int	fetch_mbox_make(struct account *);
 int	fetch_mbox_save(struct account *, struct fetch_mbox_mbox *);
+void	fetch_mbox_index(struct fetch_mbox_mbox *);
+void	fetch_mbox_addmsg(
+	    struct fetch_mbox_mbox *, struct fetch_mbox_msg *, size_t);
+int	fetch_mbox_poll(struct account *);
 
 int	fetch_mbox_state_init(struct account *, struct fetch_ctx *);
 int	fetch_mbox_state_next(struct account *, struct fetch_ctx *);
@@ -55,7 +59,7 @@ struct fetch fetch_mbox = {
 	NULL,
 	fetch_mbox_commit,
 	fetch_mbox_abort,
-	NULL,
+	fetch_mbox_total,
 	fetch_mbox_desc
 };
 
@@ -117,6 +121,66 @@ error:
 	return (-1);
 }
 
+/*
+ * Index the messages in an mbox in one pass over the mapping. A message
+ * starts at a "From " line at the start of the mbox or following a blank line
+ * (\n or \r\n); other "From " lines may be escaped by prepending '>'s and a
+ * message containing any must be read line by line to remove one again.
+ */
+void
+fetch_mbox_index(struct fetch_mbox_mbox *fmbox)
+{
+	struct fetch_mbox_msg	 msg;
+	char			*base = fmbox->base, *end, *ptr, *lptr;
+
+	ARRAY_INIT(&fmbox->msgs);
+	fmbox->next = 0;
+
+	msg.off = 0;
+	msg.rewrite = 0;
+
+	/* Skip the first "From " line, it is the start of the first message. */
+	end = base + fmbox->size;
+	ptr = base + 5;
+	while ((ptr = memmem(ptr, end - ptr, "From ", 5)) != NULL) {
+		if (ptr[-1] == '>') {
+			for (lptr = ptr - 1; *lptr == '>'; lptr--)
+				;
+			if (*lptr == '\n')
+				msg.rewrite = 1;
+		} else if (ptr[-1] == '\n' && (ptr[-2] == '\n' ||
+		    (ptr[-2] == '\r' && ptr[-3] == '\n'))) {
+			fetch_mbox_addmsg(fmbox, &msg, ptr - base);
+
+			msg.off = ptr - base;
+			msg.rewrite = 0;
+		}
+		ptr += 5;
+	}
+	fetch_mbox_addmsg(fmbox, &msg, fmbox->size);
+}
+
+/* Add a message ending at end to the index. */
+void
+fetch_mbox_addmsg(
+    struct fetch_mbox_mbox *fmbox, struct fetch_mbox_msg *msg, size_t end)
+{
+	char	*base = fmbox->base;
+
+	/*
+	 * Remove the blank line between mails if there is one. If the last
+	 * mail has no final newline, it must be read line by line so one is
+	 * added.
+	 */
+	msg->size = end - msg->off;
+	if (msg->size >= 2 && base[end - 1] == '\n' && base[end - 2] == '\n')
+		msg->size -= 2;
+	else if (base[end - 1] != '\n')
+		msg->rewrite = 1;
+
+	ARRAY_ADD(&fmbox->msgs, *msg);
+}
+
 /* Save mbox changes. */
 int
 fetch_mbox_save(struct account *a, struct fetch_mbox_mbox *fmbox)
@@ -266,6 +330,7 @@ fetch_mbox_abort(struct account *a)
 			munmap(fmbox->base, fmbox->size);
 		if (fmbox->fd != -1)
 			closelock(fmbox->fd, fmbox->path, conf.lock_types);
+		ARRAY_FREE(&fmbox->msgs);
 
 		xfree(fmbox->path);
 		xfree(fmbox);
@@ -274,6 +339,83 @@ fetch_mbox_abort(struct account *a)
 	ARRAY_FREE(&data->fmboxes);
 }
 
+/* Return total mails. */
+u_int
+fetch_mbox_total(struct account *a)
+{
+	struct fetch_mbox_data	*data = a->data;
+
+	return (data->total);
+}
+
+/*
+ * Count the mails in all the mboxes. They are only read so they are not
+ * locked.
+ */
+int
+fetch_mbox_poll(struct account *a)
+{
+	struct fetch_mbox_data	*data = a->data;
+	struct fetch_mbox_mbox	*fmbox;
+	struct stat		 sb;
+	u_int			 i;
+	int			 fd;
+
+	data->total = 0;
+	for (i = 0; i < ARRAY_LENGTH(&data->fmboxes); i++) {
+		fmbox = ARRAY_ITEM(&data->fmboxes, i);
+
+		log_debug2("%s: trying path: %s", a->name, fmbox->path);
+		if ((fd = open(fmbox->path, O_RDONLY, 0)) == -1)
+			goto error;
+		if (fstat(fd, &sb) != 0)
+			goto error;
+		if (S_ISDIR(sb.st_mode)) {
+			errno = EISDIR;
+			goto error;
+		}
+		if (sb.st_size == 0) {
+			close(fd);
+			continue;
+		}
+		if (sb.st_size < 5 || (uintmax_t) sb.st_size > SIZE_MAX) {
+			log_warnx("%s: %s: bad mbox size", a->name, fmbox->path);
+			close(fd);
+			return (-1);
+		}
+		fmbox->size = sb.st_size;
+
+		fmbox->base = mmap(
+		    NULL, fmbox->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (fmbox->base == MAP_FAILED) {
+			fmbox->base = NULL;
+			goto error;
+		}
+		close(fd);
+
+		if (strncmp(fmbox->base, "From ", 5) != 0) {
+			log_warnx("%s: %s: not an mbox", a->name, fmbox->path);
+			munmap(fmbox->base, fmbox->size);
+			fmbox->base = NULL;
+			return (-1);
+		}
+		fetch_mbox_index(fmbox);
+		data->total += ARRAY_LENGTH(&fmbox->msgs);
+
+		ARRAY_FREE(&fmbox->msgs);
+		munmap(fmbox->base, fmbox->size);
+		fmbox->base = NULL;
+	}
+
+	return (0);
+
+error:
+	if (fd != -1)
+		close(fd);
+	log_warn("%s: %s", a->name, fmbox->path);
+	return (-1);
+}
+
 /* Initial state. */
 int
 fetch_mbox_state_init(struct account *a, struct fetch_ctx *fctx)
@@ -287,7 +429,15 @@ fetch_mbox_state_init(struct account *a, struct fetch_ctx *fctx)
 		return (-1);
 	}
 
+	if (fctx->flags & FETCH_POLL) {
+		if (fetch_mbox_poll(a) != 0)
+			return (FETCH_ERROR);
+		fetch_mbox_abort(a);
+		return (FETCH_EXIT);
+	}
+
 	data->index = 0;
+	data->total = 0;
 
 	TAILQ_INIT(&data->kept);
 
@@ -301,7 +451,6 @@ fetch_mbox_state_open(struct account *a, struct fetch_ctx *fctx)
 {
 	struct fetch_mbox_data	*data = a->data;
 	struct fetch_mbox_mbox	*fmbox;
-	char			*ptr;
 	struct stat		 sb;
 	uintmax_t		 size;
 	long long		 used;
@@ -352,13 +501,14 @@ fetch_mbox_state_open(struct account *a, struct fetch_ctx *fctx)
 		fmbox->base = NULL;
 		goto error;
 	}
-	data->off = 0;
 
-	ptr = memchr(fmbox->base, '\n', fmbox->size);
 	if (strncmp(fmbox->base, "From ", 5) != 0) {
 		log_warnx("%s: %s: not an mbox", a->name, fmbox->path);
 		return (FETCH_ERROR);
 	}
+	fetch_mbox_index(fmbox);
+	data->total += ARRAY_LENGTH(&fmbox->msgs);
+	log_debug3("%s: found %u mails", a->name, ARRAY_LENGTH(&fmbox->msgs));
 
 	fctx->state = fetch_mbox_state_mail;
 	return (FETCH_AGAIN);
@@ -404,33 +554,81 @@ fetch_mbox_state_mail(struct account *a, struct fetch_ctx *fctx)
 	struct mail			*m = fctx->mail;
 	struct fetch_mbox_mbox		*fmbox;
 	struct fetch_mbox_mail		*aux;
-	char				*line, *ptr, *last_line, *lptr;
-	size_t				 llen, n;
-	int				 flushing, from;
+	struct fetch_mbox_msg		*msg;
+	char				*line, *ptr, *end, *lptr;
+	size_t				 llen;
 
 	/* Find current mbox and check for EOF. */
 	fmbox = ARRAY_ITEM(&data->fmboxes, data->index);
-	if (data->off == fmbox->size) {
+	if (fmbox->next == ARRAY_LENGTH(&fmbox->msgs)) {
 		fctx->state = fetch_mbox_state_next;
 		return (FETCH_AGAIN);
 	}
+	msg = &ARRAY_ITEM(&fmbox->msgs, fmbox->next);
+	fmbox->next++;
 
-	/* Open the mail. */
-	if (mail_open(m, IO_BLOCKSIZE) != 0) {
-		log_warn("%s: failed to create mail", a->name);
-		mail_destroy(m);
-		return (FETCH_ERROR);
+	/*
+	 * Open the mail. Oversize mails are left empty, and mails with nothing
+	 * to unquote are taken straight from the mbox. We start at the "From "
+	 * line and include it in the mail (it can be trimmed later with
+	 * minimal penalty).
+	 */
+	if (msg->size > conf.max_size) {
+		if (mail_open(m, 0) != 0)
+			goto error;
+		m->size = msg->size;
+	} else if (!msg->rewrite) {
+		if (mail_open_file(m, fmbox->fd, msg->off, msg->size) != 0)
+			goto error;
+	} else {
+		if (mail_open(m, msg->size + MAILHEADROOM) != 0)
+			goto error;
+
+		/*
+		 * Read up to the start of the next mail, so the last line has
+		 * a newline added if it is missing, then remove any blank line
+		 * between them again.
+		 */
+		line = fmbox->base + msg->off;
+		if (fmbox->next == ARRAY_LENGTH(&fmbox->msgs))
+			end = fmbox->base + fmbox->size;
+		else
+			end = fmbox->base + ARRAY_ITEM(&fmbox->msgs, fmbox->next).off;
+		while (line != end) {
+			ptr = memchr(line, '\n', end - line);
+			if (ptr == NULL)
+				ptr = end;
+
+			/* Trim >s from From. */
+			if (*line == '>') {
+				lptr = line;
+				llen = ptr - line;
+				while (*lptr == '>' && llen > 0) {
+					lptr++;
+					llen--;
+				}
+
+				if (llen >= 5 && strncmp(lptr, "From ", 5) == 0)
+					line++;
+			}
+
+			if (append_line(m, line, ptr - line) != 0)
+				goto error;
+			line = ptr == end ? end : ptr + 1;
+		}
+		m->size -= (end - fmbox->base) - (msg->off + msg->size);
 	}
 
 	/* Create aux data. */
 	aux = xmalloc(sizeof *aux);
-	aux->off = data->off;
-	aux->size = 0;
+	aux->off = msg->off;
+	aux->size = msg->size;
 	aux->fmbox = fmbox;
 	if (++fmbox->reference == 0)
 		fatalx("reference count overflow");
 	m->auxdata = aux;
 	m->auxfree = fetch_mbox_free;
+	fmbox->total++;
 
 	/* Tag mail. */
 	default_tags(&m->tags, NULL);
@@ -438,106 +636,18 @@ fetch_mbox_state_mail(struct account *a, struct fetch_ctx *fctx)
 	add_tag(&m->tags, "mbox_path", "%s", xdirname(fmbox->path));
 	add_tag(&m->tags, "mbox_file", "%s", fmbox->path);
 
-	/*
-	 * We start at a "From " line and include it in the mail (it can be
-	 * trimmed later with minimal penalty).
-	 */
-	flushing = 0;
-	for (last_line = NULL;; last_line = line) {
-		/* Check for EOF. */
-		if (data->off == fmbox->size) {
-			aux->size = data->off - aux->off;
-			break;
-		}
-
-		/* Locate the EOL. */
-		line = fmbox->base + data->off;
-		ptr = memchr(line, '\n', fmbox->size - data->off);
-		if (ptr == NULL) {
-			ptr = fmbox->base + fmbox->size;
-			data->off = fmbox->size;
-		} else
-			data->off += ptr - line + 1;
-
-		/*
-		 * Check if we have reached the end of this message at the next
-		 * message's "From " line. To allow "From " inside message
-		 * bodes, they can be escaped by prepending with '>'. Some
-		 * tools escape all "From " lines; others only escape if they
-		 * immediately follow a blank line. We accept only "From" lines
-		 * which follow a blank line (\n or \r\n).
-		 */
-		from = 1;
-		if (line == fmbox->base || last_line == NULL)
-			from = 0;
-		else {
-			n = line - last_line;
-			if (n != 1 && n != 2)
-				from = 0;
-			else if (n == 1 && *last_line != '\n')
-				from = 0;
-			else if (n == 2 && memcmp(last_line, "\r\n", 2) != 0)
-				from = 0;
-		}
-		if (from && ptr - line >= 5 && memcmp(line, "From ", 5) == 0) {
-			aux->size = (line - fmbox->base) - aux->off;
-			break;
-		}
-
-		/* Trim >s from From. */
-		if (*line == '>') {
-			lptr = line;
-			llen = ptr - line;
-			while (*lptr == '>' && llen > 0) {
-				lptr++;
-				llen--;
-			}
-
-			if (llen >= 5 && strncmp(lptr, "From ", 5) == 0)
-				line++;
-		}
-
-		if (flushing)
-			continue;
-
-		/*
-		 * If we have just found the end of the first line (the "From "
-		 * line), save it as mbox_from tag.
-		 */
-		if (last_line == NULL) {
-			*ptr = '\0';
-			add_tag(&m->tags, "mbox_from", "%s", line);
-			*ptr = '\n';
-		}
-
-		if (append_line(m, line, ptr - line) != 0) {
-			log_warn("%s: failed to resize mail", a->name);
-			mail_destroy(m);
-			return (FETCH_ERROR);
-		}
-		if (m->size > conf.max_size)
-			flushing = 1;
-	}
-	fmbox->total++;
-
-	/*
-	 * Since data->off has already counted the "From " line of the next
-	 * message, must reset data->off to be the exact message size.
-	 */
-	data->off = aux->off + aux->size;
-
-	/*
-	 * Check if there was a blank line between the mails and remove it if
-	 * so.
-	 */
-	if (aux->size >= 2 &&
-	    fmbox->base[aux->off + aux->size - 1] == '\n' &&
-	    fmbox->base[aux->off + aux->size - 2] == '\n') {
-		aux->size -= 2;
-		m->size -= 2;
-	}
+	/* Save the "From " line as mbox_from tag. */
+	line = fmbox->base + msg->off;
+	ptr = memchr(line, '\n', msg->size);
+	llen = ptr == NULL ? msg->size : (size_t) (ptr - line);
+	add_tag(&m->tags, "mbox_from", "%.*s", (int) llen, line);
 
 	return (FETCH_MAIL);
+
+error:
+	log_warn("%s: failed to create mail", a->name);
+	mail_destroy(m);
+	return (FETCH_ERROR);
 }
 
 /* Clean up and free data. */
@@ -547,6 +657,8 @@ fetch_mbox_state_exit(struct account *a, unused struct fetch_ctx *fctx)
 	struct fetch_mbox_data	*data = a->data;
 	u_int			 i;
 
+	if (cache_flush(a) != 0)
+		return (FETCH_ERROR);
 	for (i = 0; i < ARRAY_LENGTH(&data->fmboxes); i++) {
 		if (fetch_mbox_save(a, ARRAY_ITEM(&data->fmboxes, i)) != 0)
 			return (FETCH_ERROR);
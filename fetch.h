@@ -61,10 +61,28 @@ enum fetch_only {
 	FETCH_ONLY_ALL
 };
 
+/* Fetch maildir index entry and tree. */
+struct fetch_maildir_entry {
+	char		*name;
+	ino_t		 ino;
+	time_t		 mtime;
+	int		 seen;
+
+	RB_ENTRY(fetch_maildir_entry) entry;
+};
+RB_HEAD(fetch_maildir_tree, fetch_maildir_entry);
+
 /* Fetch maildir data. */
 struct fetch_maildir_data {
 	struct strings	*maildirs;
 
+	char		*path;
+	enum fetch_only	 only;
+
+	/* Mails in the index file. */
+	struct fetch_maildir_tree entries;
+	int		 dirty;
+
 	u_int		 total;
 
 	struct strings	 unlinklist;
@@ -76,6 +94,8 @@ struct fetch_maildir_data {
 
 struct fetch_maildir_mail {
 	char		 path[MAXPATHLEN];
+	ino_t		 ino;
+	time_t		 mtime;
 };
 
 /* Fetch mbox data. */
@@ -85,11 +105,17 @@ struct fetch_mbox_data {
 	ARRAY_DECL(, struct fetch_mbox_mbox *) fmboxes;
 	u_int		 index;
 
-	size_t		 off;
+	u_int		 total;
 
 	TAILQ_HEAD(, fetch_mbox_mail) kept;
 };
 
+struct fetch_mbox_msg {
+	size_t		 off;
+	size_t		 size;
+	int		 rewrite;	/* must be read line by line */
+};
+
 struct fetch_mbox_mbox {
 	char		*path;
 	u_int		 reference;
@@ -98,6 +124,9 @@ struct fetch_mbox_mbox {
 	int		 fd;
 	char		*base;
 	size_t		 size;
+
+	ARRAY_DECL(, struct fetch_mbox_msg) msgs;
+	u_int		 next;
 };
 
 struct fetch_mbox_mail {
@@ -252,6 +281,7 @@ struct fetch_imap_mail {
 #define IMAP_CAPA_STARTTLS 0x4
 #define IMAP_CAPA_NOSPACE 0x8
 #define IMAP_CAPA_GMEXT 0x10
+#define IMAP_CAPA_LITERALPLUS 0x20
 
 /* fetch-maildir.c */
 extern struct fetch	 fetch_maildir;
@@ -412,6 +412,10 @@ imap_state_capability1(struct account *a, struct fetch_ctx *fctx)
 	if (strstr(line, "STARTTLS") != NULL)
 		data->capa |= IMAP_CAPA_STARTTLS;
 
+	/* Non-synchronizing literals, used when delivering. */
+	if (strstr(line, "LITERAL+") != NULL)
+		data->capa |= IMAP_CAPA_LITERALPLUS;
+
 	fctx->state = imap_state_capability2;
 	return (FETCH_AGAIN);
 }
@@ -813,6 +817,8 @@ imap_state_next(struct account *a, struct fetch_ctx *fctx)
 		if (fctx->flags & FETCH_EMPTY) {
 			fctx->flags &= ~FETCH_PURGE;
 
+			if (cache_flush(a) != 0)
+				return (FETCH_ERROR);
 			if (imap_putln(a, "%u EXPUNGE", ++data->tag) != 0)
 				return (FETCH_ERROR);
 			fctx->state = imap_state_expunge;
@@ -830,6 +836,8 @@ imap_state_next(struct account *a, struct fetch_ctx *fctx)
 	if (ARRAY_EMPTY(&data->wanted)) {
 		if (data->committed != data->total)
 			return (FETCH_BLOCK);
+		if (cache_flush(a) != 0)
+			return (FETCH_ERROR);
 		if (imap_putln(a, "%u CLOSE", ++data->tag) != 0)
 			return (FETCH_ERROR);
 		fctx->state = imap_state_close;
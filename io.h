@@ -53,7 +53,7 @@ struct buffer {
 #define IO_FLUSHSIZE (2 * IO_BLOCKSIZE)
 
 /* IO macros. */
-#define IO_ROUND(n) (((n / IO_BLOCKSIZE) + 1) * IO_BLOCKSIZE)
+#define IO_ROUND(n) ((((n) / IO_BLOCKSIZE) + 1) * IO_BLOCKSIZE)
 #define IO_CLOSED(io) ((io)->flags & IOF_CLOSED)
 #define IO_ERROR(io) ((io)->error)
 #define IO_RDSIZE(io) (BUFFER_USED((io)->rd))
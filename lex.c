@@ -75,6 +75,7 @@ static const struct token tokens[] = {
 	{ "append", TOKAPPEND },
 	{ "attachment", TOKATTACHMENT },
 	{ "b", TOKBYTES },
+	{ "bloom-filter", TOKBLOOMFILTER },
 	{ "body", TOKBODY },
 	{ "byte", TOKBYTES },
 	{ "bytes", TOKBYTES },
@@ -82,18 +83,23 @@ static const struct token tokens[] = {
 	{ "case", TOKCASE },
 	{ "command-user", TOKCMDUSER },
 	{ "compress", TOKCOMPRESS },
+	{ "connect-stagger", TOKCONNECTSTAGGER },
 	{ "continue", TOKCONTINUE },
+	{ "coprocess", TOKCOPROCESS },
 	{ "count", TOKCOUNT },
 	{ "day", TOKDAYS },
 	{ "days", TOKDAYS },
 	{ "default-user", TOKDEFUSER },
+	{ "delay", TOKDELAY },
 	{ "delete-oversized", TOKDELTOOBIG },
 	{ "disabled", TOKDISABLED },
 	{ "domain", TOKDOMAIN },
 	{ "dotlock", TOKDOTLOCK },
 	{ "drop", TOKDROP },
+	{ "durability", TOKDURABILITY },
 	{ "exec", TOKEXEC },
 	{ "expire", TOKEXPIRE },
+	{ "false-positives", TOKFALSEPOSITIVES },
 	{ "fcntl", TOKFCNTL },
 	{ "file-group", TOKFILEGROUP },
 	{ "file-umask", TOKFILEUMASK },
@@ -116,6 +122,7 @@ static const struct token tokens[] = {
 	{ "imaps", TOKIMAPS },
 	{ "in", TOKIN },
 	{ "in-cache", TOKINCACHE },
+	{ "in-file", TOKINFILE },
 	{ "insecure", TOKINSECURE },
 	{ "invalid", TOKINVALID },
 	{ "k", TOKKILOBYTES },
@@ -124,14 +131,17 @@ static const struct token tokens[] = {
 	{ "key", TOKKEY },
 	{ "kilobyte", TOKKILOBYTES },
 	{ "kilobytes", TOKKILOBYTES },
+	{ "lmtp", TOKLMTP },
 	{ "lock-file", TOKLOCKFILE },
 	{ "lock-timeout", TOKLOCKTIMEOUT },
 	{ "lock-type", TOKLOCKTYPES },
 	{ "lock-types", TOKLOCKTYPES },
 	{ "lock-wait", TOKLOCKWAIT },
+	{ "lookup-cache", TOKLOOKUPCACHE },
 	{ "lookup-order", TOKLOOKUPORDER },
 	{ "m", TOKMEGABYTES },
 	{ "maildir", TOKMAILDIR },
+	{ "maildir-links", TOKMAILDIRLINKS },
 	{ "maildirs", TOKMAILDIRS },
 	{ "match", TOKMATCH },
 	{ "matched", TOKMATCHED },
@@ -162,6 +172,7 @@ static const struct token tokens[] = {
 	{ "parallel-accounts", TOKPARALLELACCOUNTS },
 	{ "pass", TOKPASS },
 	{ "passwd", TOKPASSWD },
+	{ "per-mail", TOKPERMAIL },
 	{ "pipe", TOKPIPE },
 	{ "pop3", TOKPOP3 },
 	{ "pop3s", TOKPOP3S },
@@ -181,6 +192,8 @@ static const struct token tokens[] = {
 	{ "set", TOKSET },
 	{ "size", TOKSIZE },
 	{ "smtp", TOKSMTP },
+	{ "socket", TOKSOCKET },
+	{ "ssl-session-cache", TOKSSLSESSIONCACHE },
 	{ "starttls", TOKSTARTTLS },
 	{ "stdin", TOKSTDIN },
 	{ "stdout", TOKSTDOUT },
@@ -201,6 +214,7 @@ static const struct token tokens[] = {
 	{ "week", TOKWEEKS },
 	{ "weeks", TOKWEEKS },
 	{ "write", TOKWRITE },
+	{ "write-behind", TOKWRITEBEHIND },
 	{ "year", TOKYEARS },
 	{ "years", TOKYEARS }
 };
@@ -18,12 +18,69 @@
 
 #include <sys/types.h>
 
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "fdm.h"
 
+/* Cached user lookup result. */
+struct usercache {
+	char			*user;
+	struct userdata		*ud;	/* NULL if the user was not found */
+	time_t			 tim;
+
+	RB_ENTRY(usercache)	 entry;
+};
+RB_HEAD(usercaches, usercache);
+
+int		 user_cmp(struct usercache *, struct usercache *);
+struct userdata	*user_lookup1(const char *, struct userfunctions *);
+struct usercache *user_cache_find(const char *);
+void		 user_cache_add(const char *, struct userdata *);
+
+RB_PROTOTYPE(usercaches, usercache, entry, user_cmp);
+RB_GENERATE(usercaches, usercache, entry, user_cmp);
+
+/*
+ * Lookup results are kept for the whole run (or until lookup-cache expire).
+ * The parent fills this before forking so the children start with the users
+ * from the configuration already resolved.
+ */
+struct usercaches	 user_cache = RB_INITIALIZER(&user_cache);
+
+int
+user_cmp(struct usercache *uc1, struct usercache *uc2)
+{
+	return (strcmp(uc1->user, uc2->user));
+}
+
 struct userdata *
 user_lookup(const char *user, struct userfunctions *order)
+{
+	struct usercache	*uc;
+	struct userdata		*ud;
+
+	if (conf.lookup_expire == 0)
+		return (user_lookup1(user, order));
+
+	if ((uc = user_cache_find(user)) != NULL) {
+		log_debug3("found user in cache: %s", user);
+		if (uc->ud == NULL)
+			return (NULL);
+		return (user_copy(uc->ud));
+	}
+
+	ud = user_lookup1(user, order);
+	user_cache_add(user, ud);
+	if (ud != NULL && strcmp(ud->name, user) != 0 &&
+	    user_cache_find(ud->name) == NULL)
+		user_cache_add(ud->name, ud);
+	return (ud);
+}
+
+struct userdata *
+user_lookup1(const char *user, struct userfunctions *order)
 {
 	struct userdata	*ud;
 	u_int		 i;
@@ -35,6 +92,56 @@ user_lookup(const char *user, struct userfunctions *order)
 	return (NULL);
 }
 
+/* Find a cache entry, discarding it if it has expired. */
+struct usercache *
+user_cache_find(const char *user)
+{
+	struct usercache	 find, *uc;
+
+	find.user = (char *) user;
+	if ((uc = RB_FIND(usercaches, &user_cache, &find)) == NULL)
+		return (NULL);
+
+	if (conf.lookup_expire < 0 || time(NULL) - uc->tim < conf.lookup_expire)
+		return (uc);
+
+	RB_REMOVE(usercaches, &user_cache, uc);
+	if (uc->ud != NULL)
+		user_free(uc->ud);
+	xfree(uc->user);
+	xfree(uc);
+	return (NULL);
+}
+
+void
+user_cache_add(const char *user, struct userdata *ud)
+{
+	struct usercache	*uc;
+
+	uc = xcalloc(1, sizeof *uc);
+	uc->user = xstrdup(user);
+	if (ud != NULL)
+		uc->ud = user_copy(ud);
+	uc->tim = time(NULL);
+
+	RB_INSERT(usercaches, &user_cache, uc);
+}
+
+void
+user_cache_free(void)
+{
+	struct usercache	*uc;
+
+	while (!RB_EMPTY(&user_cache)) {
+		uc = RB_ROOT(&user_cache);
+		RB_REMOVE(usercaches, &user_cache, uc);
+		if (uc->ud != NULL)
+			user_free(uc->ud);
+		xfree(uc->user);
+		xfree(uc);
+	}
+}
+
 void
 user_free(struct userdata *ud)
 {
@@ -371,12 +371,20 @@ fill_from_string(struct mail_ctx *mctx, struct rule *r, struct replstr *rs)
 	u_int		 i;
 	char		*s;
 	struct replstrs *users;
-	int		 should_free;
+	int		 should_free, cached;
 
 	s = replacestr(rs, m->tags, m, &m->rml);
 
+	/*
+	 * Only cache the result for names which are the same for every mail,
+	 * otherwise there could be a new entry for each.
+	 */
 	log_debug2("%s: looking for actions matching: %s", a->name, s);
-	ta = match_actions(s);
+	cached = strchr(rs->str, '%') == NULL;
+	if (cached)
+		ta = match_actions(s);
+	else
+		ta = find_actions(s);
 	if (ARRAY_EMPTY(ta))
 		goto empty;
 	xfree(s);
@@ -389,7 +397,8 @@ fill_from_string(struct mail_ctx *mctx, struct rule *r, struct replstr *rs)
 		if (fill_from_action(mctx, r, t, users) != 0) {
 			if (should_free)
 				ARRAY_FREEALL(users);
-			ARRAY_FREEALL(ta);
+			if (!cached)
+				ARRAY_FREEALL(ta);
 			return (-1);
 		}
 
@@ -397,13 +406,15 @@ fill_from_string(struct mail_ctx *mctx, struct rule *r, struct replstr *rs)
 			ARRAY_FREEALL(users);
 	}
 
-	ARRAY_FREEALL(ta);
+	if (!cached)
+		ARRAY_FREEALL(ta);
 	return (0);
 
 empty:
 	log_warnx("%s: no actions matching: %s (%s)", a->name, s, rs->str);
 	xfree(s);
-	ARRAY_FREEALL(ta);
+	if (!cached)
+		ARRAY_FREEALL(ta);
 	return (-1);
 }
 
@@ -476,6 +487,7 @@ start_action(struct mail_ctx *mctx, struct deliver_ctx *dctx)
 	struct mail	*m = dctx->mail;
 	struct msg	 msg;
 	struct msgbuf	 msgbuf;
+	int		 error;
 
 	dctx->tim = get_time();
 	log_debug2("%s: message %u, running action %s:%u (%s) as user %s",
@@ -486,9 +498,16 @@ start_action(struct mail_ctx *mctx, struct deliver_ctx *dctx)
 
 	update_tags(&m->tags, dctx->udata);
 
-	/* Just deliver now for in-child delivery. */
+	/*
+	 * Just deliver now for in-child delivery, unless it was already done
+	 * together with an earlier action.
+	 */
 	if (ti->deliver->type == DELIVER_INCHILD) {
-		if (ti->deliver->deliver(dctx, ti) != DELIVER_SUCCESS) {
+		if (dctx->batched)
+			error = dctx->result;
+		else
+			error = ti->deliver->deliver(dctx, ti);
+		if (error != DELIVER_SUCCESS) {
 			reset_tags(&m->tags);
 			return (ACTION_ERROR);
 		}
@@ -510,6 +529,11 @@ start_action(struct mail_ctx *mctx, struct deliver_ctx *dctx)
 	msgbuf.buf = m->tags;
 	msgbuf.len = STRB_SIZE(m->tags);
 
+	if (mail_share(m) != 0) {
+		log_warn("%s: failed to copy mail", a->name);
+		reset_tags(&m->tags);
+		return (ACTION_ERROR);
+	}
 	mail_send(m, &msg);
 
 	log_debug3("%s: sending action to parent", a->name);
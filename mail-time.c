@@ -105,7 +105,8 @@ mailtime(struct mail *m, time_t *tim)
 		return (-1);
 	/* Make a copy of the header. */
 	s = xmalloc(len + 1);
-	strlcpy(s, hdr, len + 1);
+	memcpy(s, hdr, len);
+	s[len] = '\0';
 
 	/* Skip spaces. */
 	ptr = s;
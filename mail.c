@@ -17,8 +17,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <fnmatch.h>
 #include <limits.h>
 #include <pwd.h>
@@ -41,6 +43,7 @@ mail_open(struct mail *m, size_t size)
 	if ((m->base = shm_create(&m->shm, m->space)) == NULL)
 		return (-1);
 	SHM_REGISTER(&m->shm);
+	m->mapped = 0;
 
 	m->off = 0;
 	m->data = m->base + m->off;
@@ -54,17 +57,155 @@ mail_open(struct mail *m, size_t size)
 	return (0);
 }
 
+/*
+ * Open a mail with the size bytes of a file at off. If possible the file is
+ * mapped privately rather than copied, after space for the headers added
+ * when the mail is fetched, and only copied into shared memory if it must be
+ * resized or passed to another process. Otherwise it is copied now, with the
+ * space for the headers after it. The file must not be truncated while the
+ * mail is open.
+ */
+int
+mail_open_file(struct mail *m, int fd, off_t off, size_t size)
+{
+	size_t	 page, head, pad;
+	char	*base;
+
+	m->size = 0;
+	m->body = 0;
+
+	page = sysconf(_SC_PAGESIZE);
+	head = ((MAILHEADROOM + page - 1) / page) * page;
+	pad = off % page;
+
+	m->space = head + pad + size;
+	base = mmap(NULL, m->space,
+	    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (base != MAP_FAILED && mmap(base + head, pad + size,
+	    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, off - pad) ==
+	    MAP_FAILED) {
+		munmap(base, m->space);
+		base = MAP_FAILED;
+	}
+
+	if (base != MAP_FAILED) {
+		m->base = base;
+		m->shm.fd = -1;
+		*m->shm.name = '\0';
+		m->mapped = 1;
+
+		m->off = head + pad;
+	} else {
+		m->space = IO_ROUND(size + MAILHEADROOM);
+		if (lseek(fd, off, SEEK_SET) == -1)
+			return (-1);
+		m->base = shm_copy(&m->shm, m->space, NULL, fd, size);
+		if (m->base == NULL)
+			return (-1);
+		SHM_REGISTER(&m->shm);
+		m->mapped = 0;
+
+		m->off = 0;
+	}
+	m->data = m->base + m->off;
+	m->size = size;
+
+	strb_create(&m->tags);
+	ARRAY_INIT(&m->wrapped);
+	m->wrapchar = '\0';
+	m->attach = NULL;
+	m->attach_built = 0;
+
+	return (0);
+}
+
+/*
+ * Copy a mail mapped from a file into shared memory. Does nothing if it is
+ * already there.
+ */
+int
+mail_share(struct mail *m)
+{
+	size_t	 space;
+	char	*base;
+
+	if (!m->mapped)
+		return (0);
+
+	space = IO_ROUND(m->size + MAILHEADROOM);
+	if ((base = shm_copy(&m->shm, space, m->data, -1, m->size)) == NULL)
+		return (-1);
+	SHM_REGISTER(&m->shm);
+
+	munmap(m->base, m->space);
+	m->mapped = 0;
+
+	m->base = base;
+	m->space = space;
+	m->off = 0;
+	m->data = m->base + m->off;
+	return (0);
+}
+
 void
 mail_send(struct mail *m, struct msg *msg)
 {
 	struct mail	*mm = &msg->data.mail;
 
+	if (m->mapped)
+		fatalx("mail not in shared memory");
+
 	memcpy(mm, m, sizeof *mm);
 	ARRAY_INIT(&mm->wrapped);
 	mm->wrapchar = '\0';
 	mm->attach = NULL;
 }
 
+/*
+ * Write the mail to a file descriptor. If possible, the kernel copies it
+ * straight from the shared memory file rather than through a user buffer.
+ */
+int
+mail_write(struct mail *m, int fd)
+{
+	const char	*ptr = m->data;
+	size_t		 left = m->size;
+	ssize_t		 n;
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t		 off = m->off;
+
+	while (left > 0 && m->shm.fd != -1) {
+		n = copy_file_range(m->shm.fd, &off, fd, NULL, left, 0);
+		if (n == 0)
+			break;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/* Fall back to write if the kernel can't do it. */
+			if (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP ||
+			    errno == EBADF)
+				break;
+			return (-1);
+		}
+		ptr += n;
+		left -= n;
+	}
+#endif
+
+	while (left > 0) {
+		n = write(fd, ptr, left);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		ptr += n;
+		left -= n;
+	}
+	return (0);
+}
+
 int
 mail_receive(struct mail *m, struct msg *msg, int destroy)
 {
@@ -117,7 +258,10 @@ void
 mail_close(struct mail *m)
 {
 	mail_free(m);
-	if (m->base != NULL) {
+	if (m->mapped) {
+		munmap(m->base, m->space);
+		m->mapped = 0;
+	} else if (m->base != NULL) {
 		SHM_DEREGISTER(&m->shm);
 		shm_close(&m->shm);
 	}
@@ -127,7 +271,10 @@ void
 mail_destroy(struct mail *m)
 {
 	mail_free(m);
-	if (m->base != NULL) {
+	if (m->mapped) {
+		munmap(m->base, m->space);
+		m->mapped = 0;
+	} else if (m->base != NULL) {
 		SHM_DEREGISTER(&m->shm);
 		shm_destroy(&m->shm);
 	}
@@ -138,6 +285,8 @@ mail_resize(struct mail *m, size_t size)
 {
 	if (SIZE_MAX - m->off < size)
 		fatalx("size too large");
+	if (m->mapped && m->space <= (m->off + size) && mail_share(m) != 0)
+		return (-1);
 	while (m->space <= (m->off + size)) {
 		if ((m->base = shm_resize(&m->shm, 2, m->space)) == NULL)
 			return (-1);
@@ -244,13 +393,23 @@ insert_header(struct mail *m, const char *before, const char *fmt, ...)
 	/* Include the newlines. */
 	hdrlen += newlines;
 
-	/* Make space for the header. */
-	if (mail_resize(m, m->size + hdrlen) != 0) {
-		xfree(hdr);
-		return (-1);
+	/*
+	 * Make space for the header. If there is room before the mail, move
+	 * the part before the header back into it rather than moving the rest
+	 * of the mail forward.
+	 */
+	if (m->off >= hdrlen) {
+		m->off -= hdrlen;
+		m->data = m->base + m->off;
+		memmove(m->data, m->data + hdrlen, off);
+	} else {
+		if (mail_resize(m, m->size + hdrlen) != 0) {
+			xfree(hdr);
+			return (-1);
+		}
+		memmove(m->data + off + hdrlen, m->data + off, m->size - off);
 	}
 	ptr = m->data + off;
-	memmove(ptr + hdrlen, ptr, m->size - off);
 
 	/* Copy the header. */
 	memcpy(ptr, hdr, hdrlen - newlines);
@@ -325,7 +484,8 @@ match_header(struct mail *m, const char *patt, size_t *len, int value)
 		if ((last = memchr(ptr, ':', *len)) != NULL) {
 			hdrlen = last - ptr;
 			hdr = xmalloc(hdrlen + 1);
-			strlcpy(hdr, ptr, hdrlen + 1);
+			memcpy(hdr, ptr, hdrlen);
+			hdr[hdrlen] = '\0';
 
 			if (fnmatch(patt, hdr, FNM_CASEFOLD) == 0)
 				break;
@@ -438,7 +598,8 @@ find_address(char *buf, size_t len, size_t *alen)
 	if (len == 0)
 		return (NULL);
 	hdr = xmalloc(len + 1);
-	strlcpy(hdr, buf, len + 1);
+	memcpy(hdr, buf, len);
+	hdr[len] = '\0';
 
 	/* First, replace any sections in "s with spaces. */
 	ptr = hdr;
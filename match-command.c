@@ -45,6 +45,10 @@ match_command_match(struct mail_ctx *mctx, struct expritem *ei)
 	char				*user;
 
 	set_wrapped(m, '\n');
+	if (mail_share(m) != 0) {
+		log_warn("%s: failed to copy mail", a->name);
+		return (MATCH_ERROR);
+	}
 
 	/*
 	 * We are called as the child so to change uid this needs to be done
@@ -91,32 +95,33 @@ match_command_desc(struct expritem *ei, char *buf, size_t len)
 {
 	struct match_command_data	*data = ei->data;
 	char				ret[11];
-	const char			*type;
+	const char			*type, *cp;
 
 	*ret = '\0';
 	if (data->ret != -1)
 		xsnprintf(ret, sizeof ret, "%d", data->ret);
 	type = data->pipe ? "pipe" : "exec";
+	cp = data->coproc ? " coprocess" : "";
 
 	if (data->re.str == NULL) {
 		if (data->user.str != NULL) {
 			xsnprintf(buf, len,
-			    "%s \"%s\" user \"%s\" returns (%s, )",
-			    type, data->cmd.str, data->user.str, ret);
+			    "%s \"%s\" user \"%s\"%s returns (%s, )",
+			    type, data->cmd.str, data->user.str, cp, ret);
 		} else {
-			xsnprintf(buf, len, "%s \"%s\" returns (%s, )", type,
-			    data->cmd.str, ret);
+			xsnprintf(buf, len, "%s \"%s\"%s returns (%s, )", type,
+			    data->cmd.str, cp, ret);
 		}
 	} else {
 		if (data->user.str != NULL) {
 			xsnprintf(buf, len,
-			    "%s \"%s\" user \"%s\" returns (%s, \"%s\")",
-			    type, data->cmd.str, data->user.str, ret,
+			    "%s \"%s\" user \"%s\"%s returns (%s, \"%s\")",
+			    type, data->cmd.str, data->user.str, cp, ret,
 			    data->re.str);
 		} else {
 			xsnprintf(buf, len,
-			    "%s \"%s\" returns (%s, \"%s\")",
-			    type, data->cmd.str, ret, data->re.str);
+			    "%s \"%s\"%s returns (%s, \"%s\")",
+			    type, data->cmd.str, cp, ret, data->re.str);
 		}
 	}
 }
@@ -52,7 +52,7 @@ match_in_cache_match(struct mail_ctx *mctx, struct expritem *ei)
 		if (strcmp(data->path, cache->path) == 0) {
 			if (open_cache(a, cache) != 0)
 				goto error;
-			if (db_contains(cache->db, key)) {
+			if (cache_contains(a, cache, key)) {
 				xfree(key);
 				return (MATCH_TRUE);
 			}
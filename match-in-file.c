@@ -0,0 +1,256 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fdm.h"
+#include "match.h"
+
+int	match_in_file_match(struct mail_ctx *, struct expritem *);
+void	match_in_file_desc(struct expritem *, char *, size_t);
+
+char   *keyfile_line(FILE *, char **, size_t *);
+int	keyfile_read(struct keyfile *, FILE *, char **);
+
+struct match match_in_file = {
+	"in-file",
+	match_in_file_match,
+	match_in_file_desc
+};
+
+RB_GENERATE(keyents, keyent, entry, keyent_cmp);
+
+/* Files already loaded, shared between all rules using them. */
+TAILQ_HEAD(, keyfile) keyfiles = TAILQ_HEAD_INITIALIZER(keyfiles);
+
+int
+keyent_cmp(struct keyent *ke1, struct keyent *ke2)
+{
+	return (strcasecmp(ke1->key, ke2->key));
+}
+
+/* Read a line into a buffer, growing it as needed. */
+char *
+keyfile_line(FILE *f, char **buf, size_t *len)
+{
+	size_t	off;
+	int	ch;
+
+	off = 0;
+	while ((ch = getc(f)) != EOF) {
+		if (ch == '\n')
+			break;
+		if (off + 1 >= *len) {
+			*buf = xrealloc(*buf, 2, *len);
+			*len *= 2;
+		}
+		(*buf)[off++] = ch;
+	}
+	if (ch == EOF && off == 0)
+		return (NULL);
+	(*buf)[off] = '\0';
+	return (*buf);
+}
+
+/*
+ * Read a lookup file. Each line is a key optionally followed by whitespace and
+ * a value; blank lines and lines starting with # are ignored.
+ */
+int
+keyfile_read(struct keyfile *kf, FILE *f, char **cause)
+{
+	struct keyent	*ke;
+	char		*buf, *line, *ptr;
+	size_t		 len, n;
+
+	len = BUFSIZ;
+	buf = xmalloc(len);
+	while ((line = keyfile_line(f, &buf, &len)) != NULL) {
+		while (isspace((u_char) *line))
+			line++;
+		if (*line == '\0' || *line == '#')
+			continue;
+
+		n = strlen(line);
+		while (n > 0 && isspace((u_char) line[n - 1]))
+			line[--n] = '\0';
+
+		ptr = line + strcspn(line, " \t");
+		if (*ptr != '\0') {
+			*ptr++ = '\0';
+			while (isspace((u_char) *ptr))
+				ptr++;
+		}
+
+		ke = xmalloc(sizeof *ke);
+		ke->key = xstrdup(line);
+		ke->value = xstrdup(*ptr != '\0' ? ptr : line);
+		if (RB_INSERT(keyents, &kf->entries, ke) != NULL) {
+			/* First entry for a key wins. */
+			xfree(ke->key);
+			xfree(ke->value);
+			xfree(ke);
+			continue;
+		}
+		kf->n++;
+	}
+	xfree(buf);
+
+	if (ferror(f)) {
+		xasprintf(cause, "%s: %s", kf->path, strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+/* Load a lookup file, or return it if it has already been loaded. */
+struct keyfile *
+keyfile_load(const char *path, char **cause)
+{
+	struct keyfile	*kf;
+	FILE		*f;
+
+	TAILQ_FOREACH(kf, &keyfiles, entry) {
+		if (strcmp(kf->path, path) == 0) {
+			kf->references++;
+			return (kf);
+		}
+	}
+
+	if ((f = fopen(path, "r")) == NULL) {
+		xasprintf(cause, "%s: %s", path, strerror(errno));
+		return (NULL);
+	}
+
+	kf = xmalloc(sizeof *kf);
+	kf->path = xstrdup(path);
+	RB_INIT(&kf->entries);
+	kf->n = 0;
+	kf->references = 0;
+
+	if (keyfile_read(kf, f, cause) != 0) {
+		fclose(f);
+		keyfile_free(kf);
+		return (NULL);
+	}
+	fclose(f);
+
+	log_debug2("loaded %u keys from %s", kf->n, kf->path);
+	kf->references = 1;
+	TAILQ_INSERT_TAIL(&keyfiles, kf, entry);
+	return (kf);
+}
+
+/* Drop a reference to a lookup file, freeing it when it is no longer used. */
+void
+keyfile_free(struct keyfile *kf)
+{
+	struct keyent	*ke;
+
+	if (kf->references > 1) {
+		kf->references--;
+		return;
+	}
+	if (kf->references == 1)
+		TAILQ_REMOVE(&keyfiles, kf, entry);
+
+	while (!RB_EMPTY(&kf->entries)) {
+		ke = RB_ROOT(&kf->entries);
+		RB_REMOVE(keyents, &kf->entries, ke);
+		xfree(ke->key);
+		xfree(ke->value);
+		xfree(ke);
+	}
+	xfree(kf->path);
+	xfree(kf);
+}
+
+int
+match_in_file_match(struct mail_ctx *mctx, struct expritem *ei)
+{
+	struct match_in_file_data	*data = ei->data;
+	struct account			*a = mctx->account;
+	struct mail			*m = mctx->mail;
+	struct keyent			 find, *ke;
+	char				*key, *tag, *ptr;
+	size_t				 len;
+
+	if (data->hdr != NULL) {
+		ptr = find_header(m, data->hdr, &len, 1);
+		if (ptr == NULL)
+			return (MATCH_FALSE);
+		while (len > 0 && isspace((u_char) ptr[len - 1]))
+			len--;
+		key = xmalloc(len + 1);
+		memcpy(key, ptr, len);
+		key[len] = '\0';
+	} else
+		key = replacestr(&data->key, m->tags, m, &m->rml);
+	if (key == NULL || *key == '\0') {
+		if (key != NULL)
+			xfree(key);
+		return (MATCH_FALSE);
+	}
+	log_debug2("%s: looking up in %s: %s", a->name, data->file->path, key);
+
+	find.key = key;
+	ke = RB_FIND(keyents, &data->file->entries, &find);
+	xfree(key);
+	if (ke == NULL)
+		return (MATCH_FALSE);
+
+	if (data->tag.str != NULL) {
+		tag = replacestr(&data->tag, m->tags, m, &m->rml);
+		if (tag != NULL && *tag != '\0') {
+			log_debug2("%s: tagging message: %s (%s)",
+			    a->name, tag, ke->value);
+			add_tag(&m->tags, tag, "%s", ke->value);
+		}
+		if (tag != NULL)
+			xfree(tag);
+	}
+	return (MATCH_TRUE);
+}
+
+void
+match_in_file_desc(struct expritem *ei, char *buf, size_t len)
+{
+	struct match_in_file_data	*data = ei->data;
+	const char			*what, *s;
+	char				 tag[128];
+
+	if (data->hdr != NULL) {
+		what = "header";
+		s = data->hdr;
+	} else {
+		what = "string";
+		s = data->key.str;
+	}
+
+	*tag = '\0';
+	if (data->tag.str != NULL)
+		xsnprintf(tag, sizeof tag, " tag \"%s\"", data->tag.str);
+
+	xsnprintf(buf, len, "%s \"%s\" in-file \"%s\"%s",
+	    what, s, data->file->path, tag);
+}
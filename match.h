@@ -94,6 +94,7 @@ struct match_command_data {
 	struct replpath	 cmd;
 	struct replstr	 user;
 	int		 pipe;		/* pipe mail to command */
+	int		 coproc;	/* run as coprocess */
 
 	struct re	 re;		/* re->str NULL to not check */
 	int		 ret;		/* -1 to not check */
@@ -105,6 +106,35 @@ struct match_in_cache_data {
 	struct replstr	 key;
 };
 
+/* Lookup file entry. */
+struct keyent {
+	char			*key;
+	char			*value;
+
+	RB_ENTRY(keyent)	 entry;
+};
+RB_HEAD(keyents, keyent);
+
+/* Lookup file, loaded once and shared by all rules using it. */
+struct keyfile {
+	char			*path;
+	struct keyents		 entries;
+	u_int			 n;
+
+	u_int			 references;
+
+	TAILQ_ENTRY(keyfile)	 entry;
+};
+
+/* Match in-file data. */
+struct match_in_file_data {
+	struct keyfile	*file;
+
+	char		*hdr;		/* NULL to use key */
+	struct replstr	 key;
+	struct replstr	 tag;		/* tag->str NULL for none */
+};
+
 /* match-age.c */
 extern struct match	 match_age;
 
@@ -141,4 +171,11 @@ extern struct match	 match_regexp;
 /* match-in-cache.c */
 extern struct match	 match_in_cache;
 
+/* match-in-file.c */
+extern struct match	 match_in_file;
+int			 keyent_cmp(struct keyent *, struct keyent *);
+RB_PROTOTYPE(keyents, keyent, entry, keyent_cmp);
+struct keyfile		*keyfile_load(const char *, char **);
+void			 keyfile_free(struct keyfile *);
+
 #endif
@@ -18,8 +18,10 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
 #include <string.h>
@@ -29,12 +31,43 @@
 #include "deliver.h"
 #include "match.h"
 
+int	parent_deliver_sync(const char *);
+void	parent_deliver_sync_user(uid_t);
+void	parent_deliver_sync_child(uid_t, gid_t);
+
+/*
+ * With group durability, the results of file deliveries are not passed back
+ * to the fetch child until the files and their directories have been synced.
+ * The fetch child does not finish the mail (and so does not delete it from
+ * the server) until it has the result, so the sync is done once for a group
+ * of mails rather than for each. The paths are in directories the users
+ * control, so they are synced by a child running as the user.
+ */
+struct parent_deliver_done {
+	struct child			*child;
+	struct account			*account;
+	struct mail			*mail;
+	struct msg			 msg;
+	char				*path;
+	uid_t				 uid;
+	gid_t				 gid;
+
+	TAILQ_ENTRY(parent_deliver_done) entry;
+};
+TAILQ_HEAD(, parent_deliver_done) parent_deliver_dones =
+    TAILQ_HEAD_INITIALIZER(parent_deliver_dones);
+u_int	parent_deliver_queued;
+double	parent_deliver_first;
+
 int
 parent_deliver(struct child *child, struct msg *msg, struct msgbuf *msgbuf)
 {
 	struct child_deliver_data	*data = child->data;
 	struct account			*a = data->account;
 	struct mail			*m = data->mail;
+	struct parent_deliver_done	*dd;
+	struct deliver			*deliver;
+	const char			*path;
 
 	if (msg->type != MSG_DONE)
 		fatalx("unexpected message");
@@ -50,8 +83,48 @@ parent_deliver(struct child *child, struct msg *msg, struct msgbuf *msgbuf)
 	msg->type = MSG_DONE;
 	msg->id = data->msgid;
 
-	msgbuf->buf = m->tags;
-	msgbuf->len = STRB_SIZE(m->tags);
+	/* Hold the result of file deliveries until the file is synced. */
+	path = NULL;
+	if (conf.durability == DURABILITY_GROUP &&
+	    data->hook == child_deliver_action_hook &&
+	    msg->data.error == DELIVER_SUCCESS) {
+		deliver = data->actitem->deliver;
+		if (deliver == &deliver_maildir)
+			path = find_tag(m->tags, "mail_file");
+		else if (deliver == &deliver_mbox)
+			path = find_tag(m->tags, "mbox_file");
+	}
+	if (path != NULL) {
+		dd = xmalloc(sizeof *dd);
+		dd->child = data->child;
+		dd->account = a;
+		dd->mail = m;
+		memcpy(&dd->msg, msg, sizeof dd->msg);
+		dd->path = xstrdup(path);
+		dd->uid = data->uid;
+		dd->gid = data->gid;
+
+		if (parent_deliver_queued++ == 0)
+			parent_deliver_first = get_time();
+		TAILQ_INSERT_TAIL(&parent_deliver_dones, dd, entry);
+		if (parent_deliver_queued >= conf.group_count)
+			parent_deliver_flush();
+		return (-1);
+	}
+
+	parent_deliver_send(data->child, a, m, msg);
+	return (-1);
+}
+
+/* Send the result of a delivery to the fetch child and free the mail. */
+void
+parent_deliver_send(struct child *child, struct account *a, struct mail *m,
+    struct msg *msg)
+{
+	struct msgbuf	msgbuf;
+
+	msgbuf.buf = m->tags;
+	msgbuf.len = STRB_SIZE(m->tags);
 
 	mail_send(m, msg);
 
@@ -59,12 +132,211 @@ parent_deliver(struct child *child, struct msg *msg, struct msgbuf *msgbuf)
 	 * Try to send to child. Ignore failures which mean the fetch child
 	 * has exited - not much can do about it now.
 	 */
-	child = data->child;
-	if (child->io == NULL || privsep_send(child->io, msg, msgbuf) != 0)
+	if (child->io == NULL || privsep_send(child->io, msg, &msgbuf) != 0)
 		log_debug2("%s: child %ld missing", a->name, (long) child->pid);
 
 	mail_close(m);
 	xfree(m);
+}
 
-	return (-1);
+/*
+ * Return how long until the held results must be synced and sent, for the
+ * parent's poll.
+ */
+int
+parent_deliver_timeout(void)
+{
+	double	left;
+
+	if (parent_deliver_queued == 0)
+		return (INFTIM);
+	left = parent_deliver_first + conf.group_delay / 1000.0 - get_time();
+	if (left <= 0)
+		return (0);
+	return (left * 1000 + 1);
+}
+
+/*
+ * Sync a file or directory. Returns errno or 0. The path is in a directory the
+ * user controls, so it is opened without blocking or following a symlink and
+ * anything which is not a regular file or directory is skipped.
+ */
+int
+parent_deliver_sync(const char *path)
+{
+	struct stat	sb;
+	int		fd, error;
+
+	if ((fd = open(path, O_RDONLY|O_NONBLOCK|O_NOFOLLOW)) == -1) {
+		if (errno == ELOOP)
+			return (0);
+		return (errno);
+	}
+	if (fstat(fd, &sb) != 0) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+	if (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode)) {
+		close(fd);
+		return (0);
+	}
+
+	error = 0;
+	if (fsync(fd) != 0)
+		error = errno;
+	close(fd);
+	return (error);
+}
+
+/*
+ * Sync every file with a held result for a user then each of their
+ * directories, failing the results which depend on a failed sync. Each path
+ * is synced only once.
+ */
+void
+parent_deliver_sync_user(uid_t uid)
+{
+	struct parent_deliver_done	*dd, *dd2;
+	struct strings			 dirs;
+	char				*dir;
+	int				 error;
+	u_int				 i, files, mails;
+
+	ARRAY_INIT(&dirs);
+	files = mails = 0;
+	TAILQ_FOREACH(dd, &parent_deliver_dones, entry) {
+		if (dd->uid != uid)
+			continue;
+		mails++;
+
+		for (dd2 = TAILQ_FIRST(&parent_deliver_dones);
+		    dd2 != dd; dd2 = TAILQ_NEXT(dd2, entry)) {
+			if (dd2->uid == uid && strcmp(dd2->path, dd->path) == 0)
+				break;
+		}
+		if (dd2 != dd) {
+			if (dd2->msg.data.error != DELIVER_SUCCESS)
+				dd->msg.data.error = DELIVER_FAILURE;
+			continue;
+		}
+
+		files++;
+		if ((error = parent_deliver_sync(dd->path)) != 0) {
+			log_warnx("%s: %s: fsync: %s", dd->account->name,
+			    dd->path, strerror(error));
+			dd->msg.data.error = DELIVER_FAILURE;
+		}
+
+		dir = xdirname(dd->path);
+		for (i = 0; i < ARRAY_LENGTH(&dirs); i++) {
+			if (strcmp(ARRAY_ITEM(&dirs, i), dir) == 0)
+				break;
+		}
+		if (i == ARRAY_LENGTH(&dirs))
+			ARRAY_ADD(&dirs, xstrdup(dir));
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(&dirs); i++) {
+		dir = ARRAY_ITEM(&dirs, i);
+		if ((error = parent_deliver_sync(dir)) == 0)
+			continue;
+		log_warnx("parent: %s: fsync: %s", dir, strerror(error));
+		TAILQ_FOREACH(dd, &parent_deliver_dones, entry) {
+			if (dd->uid == uid &&
+			    strcmp(xdirname(dd->path), dir) == 0)
+				dd->msg.data.error = DELIVER_FAILURE;
+		}
+	}
+
+	log_debug2("parent: synced %u files and %u directories for %u mails "
+	    "(uid %lu)", files, ARRAY_LENGTH(&dirs), mails, (u_long) uid);
+	for (i = 0; i < ARRAY_LENGTH(&dirs); i++)
+		xfree(ARRAY_ITEM(&dirs, i));
+	ARRAY_FREE(&dirs);
+}
+
+/*
+ * Sync for a user in a child running as that user, so the parent never opens
+ * the paths as root. The child writes back the result of each of the user's
+ * held deliveries in order; if it fails, they all fail.
+ */
+void
+parent_deliver_sync_child(uid_t uid, gid_t gid)
+{
+	struct parent_deliver_done	*dd;
+	int				 fds[2], error, status;
+	pid_t				 pid;
+	ssize_t				 n;
+
+	if (pipe(fds) != 0)
+		fatal("pipe failed");
+	if ((pid = child_fork()) == 0) {
+		close(fds[0]);
+		dropto(uid, gid);
+
+		parent_deliver_sync_user(uid);
+		TAILQ_FOREACH(dd, &parent_deliver_dones, entry) {
+			if (dd->uid != uid)
+				continue;
+			error = dd->msg.data.error;
+			n = write(fds[1], &error, sizeof error);
+			if (n != sizeof error)
+				child_exit(1);
+		}
+		child_exit(0);
+	}
+	close(fds[1]);
+
+	TAILQ_FOREACH(dd, &parent_deliver_dones, entry) {
+		if (dd->uid != uid)
+			continue;
+		do
+			n = read(fds[0], &error, sizeof error);
+		while (n == -1 && errno == EINTR);
+		if (n != sizeof error) {
+			log_warnx("parent: sync as uid %lu failed", (u_long) uid);
+			error = DELIVER_FAILURE;
+		}
+		dd->msg.data.error = error;
+	}
+	close(fds[0]);
+
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+}
+
+/* Sync the held results for each user, and send them. */
+void
+parent_deliver_flush(void)
+{
+	struct parent_deliver_done	*dd, *dd2;
+
+	if (parent_deliver_queued == 0)
+		return;
+
+	TAILQ_FOREACH(dd, &parent_deliver_dones, entry) {
+		for (dd2 = TAILQ_FIRST(&parent_deliver_dones);
+		    dd2 != dd; dd2 = TAILQ_NEXT(dd2, entry)) {
+			if (dd2->uid == dd->uid)
+				break;
+		}
+		if (dd2 != dd)
+			continue;
+
+		if (geteuid() == 0 && dd->uid != 0)
+			parent_deliver_sync_child(dd->uid, dd->gid);
+		else
+			parent_deliver_sync_user(dd->uid);
+	}
+
+	while (!TAILQ_EMPTY(&parent_deliver_dones)) {
+		dd = TAILQ_FIRST(&parent_deliver_dones);
+		TAILQ_REMOVE(&parent_deliver_dones, dd, entry);
+
+		parent_deliver_send(dd->child, dd->account, dd->mail, &dd->msg);
+		xfree(dd->path);
+		xfree(dd);
+	}
+	parent_deliver_queued = 0;
 }
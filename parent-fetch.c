@@ -34,6 +34,8 @@ void	parent_fetch_action(struct child *, struct children *,
 	    struct deliver_ctx *, struct msg *);
 void	parent_fetch_cmd(struct child *, struct children *, struct mail_ctx *,
 	    struct msg *);
+struct coproc	*parent_fetch_coproc(struct account *, struct replpath *,
+	    struct mail *, uid_t, gid_t);
 
 int
 parent_fetch(struct child *child, struct msg *msg, struct msgbuf *msgbuf)
@@ -97,6 +99,33 @@ parent_fetch_error(struct child *child, struct msg *msg)
 		fatalx("privsep_send error");
 }
 
+/*
+ * Make sure a coprocess is running before starting a child to use it, so the
+ * child inherits it. The command is expanded only here, with the home from the
+ * tags the fetch child sent, and the child is handed the coprocess. If it
+ * can't be started, NULL is returned and the child fails the mail.
+ */
+struct coproc *
+parent_fetch_coproc(struct account *a, struct replpath *rp, struct mail *m,
+    uid_t uid, gid_t gid)
+{
+	struct coproc	*cp;
+	char		*s, *cause;
+
+	s = replacepath(rp, m->tags, m, &m->rml, find_tag(m->tags, "home"));
+	if (s == NULL || *s == '\0') {
+		if (s != NULL)
+			xfree(s);
+		return (NULL);
+	}
+	if ((cp = coproc_start(s, uid, gid, &cause)) == NULL) {
+		log_warnx("%s: %s: %s", a->name, s, cause);
+		xfree(cause);
+	}
+	xfree(s);
+	return (cp);
+}
+
 void
 parent_fetch_action(struct child *child, struct children *children,
     struct deliver_ctx *dctx, struct msg *msg)
@@ -105,6 +134,7 @@ parent_fetch_action(struct child *child, struct children *children,
 	struct mail			*m = dctx->mail;
 	struct mail			*md = &dctx->wr_mail;
 	struct child_deliver_data	*data;
+	struct coproc			*cp = NULL;
 	uid_t				 uid = msg->data.uid;
 	gid_t				 gid = msg->data.gid;
 
@@ -128,6 +158,9 @@ parent_fetch_action(struct child *child, struct children *children,
 		}
 		md->decision = m->decision;
 	}
+	if (ti->coproc != NULL)
+		cp = parent_fetch_coproc(
+		    dctx->account, ti->coproc, m, uid, gid);
 
 	data = xmalloc(sizeof *data);
 	data->child = child;
@@ -140,6 +173,7 @@ parent_fetch_action(struct child *child, struct children *children,
 	data->name = "deliver";
 	data->uid = uid;
 	data->gid = gid;
+	data->coproc = cp;
 	child = child_start(
 	    children, uid, gid, child_deliver, parent_deliver, data, child);
 	log_debug3("parent: deliver "
@@ -154,6 +188,12 @@ parent_fetch_cmd(struct child *child, struct children *children,
 	struct child_deliver_data	*data;
 	uid_t				 uid = msg->data.uid;
 	gid_t				 gid = msg->data.gid;
+	struct match_command_data	*cmddata = msg->data.cmddata;
+	struct coproc			*cp = NULL;
+
+	if (cmddata->coproc)
+		cp = parent_fetch_coproc(
+		    mctx->account, &cmddata->cmd, m, uid, gid);
 
 	data = xmalloc(sizeof *data);
 	data->child = child;
@@ -166,6 +206,7 @@ parent_fetch_cmd(struct child *child, struct children *children,
 	data->name = "command";
 	data->uid = uid;
 	data->gid = gid;
+	data->coproc = cp;
 	child = child_start(
 	    children, uid, gid, child_deliver, parent_deliver, data, child);
 	log_debug3("parent: command "
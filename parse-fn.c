@@ -105,35 +105,91 @@ have_accounts(char *name)
 	return (0);
 }
 
+/* Cached result of matching an expanded action name. */
+struct actionmatch {
+	char			*name;
+	struct actions		*ta;
+
+	RB_ENTRY(actionmatch)	 entry;
+};
+RB_HEAD(actionmatches, actionmatch) action_matches =
+    RB_INITIALIZER(&action_matches);
+
+int	actionmatch_cmp(struct actionmatch *, struct actionmatch *);
+RB_PROTOTYPE(actionmatches, actionmatch, entry, actionmatch_cmp);
+RB_GENERATE(actionmatches, actionmatch, entry, actionmatch_cmp);
+
+RB_GENERATE(actiontree, action, tentry, action_cmp);
+
+int
+action_cmp(struct action *t1, struct action *t2)
+{
+	return (strcmp(t1->name, t2->name));
+}
+
+int
+actionmatch_cmp(struct actionmatch *am1, struct actionmatch *am2)
+{
+	return (strcmp(am1->name, am2->name));
+}
+
 struct action *
-find_action(char *name)
+find_action(const char *name)
 {
-	struct action	*t;
+	struct action	find;
 
-	TAILQ_FOREACH(t, &conf.actions, entry) {
-		if (strcmp(t->name, name) == 0)
-			return (t);
-	}
-	return (NULL);
+	if (strlcpy(find.name, name, sizeof find.name) >= sizeof find.name)
+		return (NULL);
+	return (RB_FIND(actiontree, &conf.action_tree, &find));
 }
 
+/* Find all actions matching a name. The caller must free the result. */
 struct actions *
-match_actions(const char *name)
+find_actions(const char *name)
 {
-	struct action	*t;
 	struct actions	*ta;
+	struct action	*t;
 
 	ta = xmalloc(sizeof *ta);
 	ARRAY_INIT(ta);
 
-	TAILQ_FOREACH(t, &conf.actions, entry) {
-		if (action_match(name, t->name))
+	/* Names without pattern characters can only match themselves. */
+	if (name[strcspn(name, "*?[\\")] == '\0') {
+		if ((t = find_action(name)) != NULL)
 			ARRAY_ADD(ta, t);
+	} else {
+		TAILQ_FOREACH(t, &conf.actions, entry) {
+			if (action_match(name, t->name))
+				ARRAY_ADD(ta, t);
+		}
 	}
 
 	return (ta);
 }
 
+/*
+ * Find all actions matching a name, as find_actions. The result is cached for
+ * the life of the process and must not be modified or freed by the caller,
+ * so this should only be used for names which come straight from the
+ * configuration and not those built for each mail.
+ */
+struct actions *
+match_actions(const char *name)
+{
+	struct actionmatch	 find, *am;
+
+	find.name = (char *) name;
+	if ((am = RB_FIND(actionmatches, &action_matches, &find)) != NULL)
+		return (am->ta);
+
+	am = xmalloc(sizeof *am);
+	am->name = xstrdup(name);
+	am->ta = find_actions(name);
+
+	RB_INSERT(actionmatches, &action_matches, am);
+	return (am->ta);
+}
+
 struct macro *
 extract_macro(char *s)
 {
@@ -419,6 +475,16 @@ free_rule(struct rule *r)
 			struct match_in_cache_data	*data = ei->data;
 			xfree(data->key.str);
 			xfree(data->path);
+		} else if (ei->match == &match_in_file) {
+			struct match_in_file_data	*data = ei->data;
+			if (data->file != NULL)
+				keyfile_free(data->file);
+			if (data->hdr != NULL)
+				xfree(data->hdr);
+			if (data->key.str != NULL)
+				xfree(data->key.str);
+			if (data->tag.str != NULL)
+				xfree(data->tag.str);
 		} else if (ei->match == &match_attachment) {
 			struct match_attachment_data	*data = ei->data;
 			if (data->op == ATTACHOP_ANYTYPE ||
@@ -490,6 +556,8 @@ free_account(struct account *a)
 		struct fetch_maildir_data	*data = a->data;
 		free_strings(data->maildirs);
 		ARRAY_FREEALL(data->maildirs);
+		if (data->path != NULL)
+			xfree(data->path);
 	} else if (a->fetch == &fetch_mbox) {
 		struct fetch_mbox_data	*data = a->data;
 		free_strings(data->mboxes);
@@ -136,24 +136,30 @@ yyerror(const char *fmt, ...)
 %token TOKANYTYPE
 %token TOKAPPEND
 %token TOKATTACHMENT
+%token TOKBLOOMFILTER
 %token TOKBODY
 %token TOKBYTES
 %token TOKCACHE
 %token TOKCASE
 %token TOKCMDUSER
 %token TOKCOMPRESS
+%token TOKCONNECTSTAGGER
 %token TOKCONTINUE
+%token TOKCOPROCESS
 %token TOKCOUNT
 %token TOKDAYS
 %token TOKDEFUSER
+%token TOKDELAY
 %token TOKDELTOOBIG
 %token TOKDISABLED
 %token TOKDOMAIN
 %token TOKDOTLOCK
 %token TOKDROP
+%token TOKDURABILITY
 %token TOKEQ
 %token TOKEXEC
 %token TOKEXPIRE
+%token TOKFALSEPOSITIVES
 %token TOKFCNTL
 %token TOKFILEGROUP
 %token TOKFILEUMASK
@@ -173,17 +179,21 @@ yyerror(const char *fmt, ...)
 %token TOKIMPLACT
 %token TOKIN
 %token TOKINCACHE
+%token TOKINFILE
 %token TOKINSECURE
 %token TOKINVALID
 %token TOKKEEP
 %token TOKKEY
 %token TOKKILOBYTES
+%token TOKLMTP
 %token TOKLOCKFILE
 %token TOKLOCKTIMEOUT
 %token TOKLOCKTYPES
 %token TOKLOCKWAIT
+%token TOKLOOKUPCACHE
 %token TOKLOOKUPORDER
 %token TOKMAILDIR
+%token TOKMAILDIRLINKS
 %token TOKMAILDIRS
 %token TOKMATCH
 %token TOKMATCHED
@@ -211,6 +221,7 @@ yyerror(const char *fmt, ...)
 %token TOKPARALLELACCOUNTS
 %token TOKPASS
 %token TOKPASSWD
+%token TOKPERMAIL
 %token TOKPIPE
 %token TOKPOP3
 %token TOKPOP3S
@@ -229,6 +240,8 @@ yyerror(const char *fmt, ...)
 %token TOKSET
 %token TOKSIZE
 %token TOKSMTP
+%token TOKSOCKET
+%token TOKSSLSESSIONCACHE
 %token TOKSTARTTLS
 %token TOKSTDIN
 %token TOKSTDOUT
@@ -246,6 +259,7 @@ yyerror(const char *fmt, ...)
 %token TOKVERIFYCERTS
 %token TOKWEEKS
 %token TOKWRITE
+%token TOKWRITEBEHIND
 %token TOKYEARS
 
 %union
@@ -291,6 +305,10 @@ yyerror(const char *fmt, ...)
 	} userpass;
 	userfunction		 ufn;
 	struct userfunctions	*ufns;
+	struct {
+		size_t		 size;
+		u_int		 rate;
+	} bloom;
 }
 
 %token NONE
@@ -301,6 +319,7 @@ yyerror(const char *fmt, ...)
 %type  <actitem> actitem
 %type  <actlist> actlist
 %type  <area> area
+%type  <bloom> bloom
 %type  <cmp> cmp ltgt eqne
 %type  <expr> expr exprlist
 %type  <expritem> expritem
@@ -308,18 +327,20 @@ yyerror(const char *fmt, ...)
 %type  <fetch> fetchtype
 %type  <flag> cont not disabled keep execpipe writeappend compress verify
 %type  <flag> apop poptype imaptype nntptype nocrammd5 nologin uidl starttls
-%type  <flag> insecure
+%type  <flag> insecure coprocess
 %type  <localgid> localgid
 %type  <locks> lock locklist
-%type  <number> size time numv retrc expire
+%type  <number> size time numv retrc expire bloomsize bloomrate writebehind
+%type  <number> groupcount groupdelay
 %type  <only> only imaponly
 %type  <poponly> poponly
-%type  <replstrs> replstrslist actions rmheaders accounts users
+%type  <replstrs> replstrslist actions rmheaders accounts users lmtptos
 %type  <re> casere retre
 %type  <rule> perform
 %type  <server> server
 %type  <proxy> proxy
 %type  <string> port to from xstrv strv replstrv replpathv val optval folder1
+%type  <string> opttag
 %type  <string> user
 %type  <strings> stringslist pathslist maildirs mboxes groups folders folderlist
 %type  <userpass> userpass userpassreqd userpassnetrc
@@ -376,6 +397,17 @@ optval: TOKVALUE strv
 		$$ = NULL;
 	}
 
+opttag: TOKTAG strv
+	{
+		if (*$2 == '\0')
+			yyerror("invalid tag");
+		$$ = $2;
+	}
+      | /* empty */
+	{
+		$$ = NULL;
+	}
+
 xstrv: STRCOMMAND
        {
 	       $$ = run_command($1, parse_file->path);
@@ -556,7 +588,79 @@ expire: TOKEXPIRE time
 		$$ = -1;
 	}
 
-cache: TOKCACHE replpathv expire
+bloomsize: TOKSIZE size
+	   {
+#if SIZE_MAX < LLONG_MAX
+		   if ($2 > SIZE_MAX)
+			   yyerror("size too large");
+#endif
+		   if ($2 == 0)
+			   yyerror("zero size");
+		   $$ = $2;
+	   }
+	 | /* empty */
+	   {
+		   $$ = DEFBLOOMSIZE;
+	   }
+
+bloomrate: TOKFALSEPOSITIVES numv
+	   {
+		   if ($2 < 2 || $2 > UINT_MAX)
+			   yyerror("invalid false-positives: %lld", $2);
+		   $$ = $2;
+	   }
+	 | /* empty */
+	   {
+		   $$ = DEFBLOOMRATE;
+	   }
+
+bloom: TOKBLOOMFILTER bloomsize bloomrate
+       {
+	       $$.size = $2;
+	       $$.rate = $3;
+       }
+     | /* empty */
+       {
+	       $$.size = 0;
+	       $$.rate = 0;
+       }
+
+groupcount: TOKCOUNT numv
+	    {
+		    if ($2 == 0)
+			    yyerror("zero durability count");
+		    if ($2 > UINT_MAX)
+			    yyerror("durability count too large: %lld", $2);
+		    $$ = $2;
+	    }
+	  | /* empty */
+	    {
+		    $$ = DEFGROUPCOUNT;
+	    }
+
+groupdelay: TOKDELAY numv
+	    {
+		    if ($2 > INT_MAX)
+			    yyerror("durability delay too long: %lld", $2);
+		    $$ = $2;
+	    }
+	  | /* empty */
+	    {
+		    $$ = DEFGROUPDELAY;
+	    }
+
+writebehind: TOKWRITEBEHIND time
+	     {
+		     if ($2 == 0)
+			     yyerror("zero write-behind time");
+		     $$ = $2;
+	     }
+	   | /* empty */
+	     {
+		     $$ = 0;
+	     }
+
+cache: TOKCACHE replpathv expire bloom writebehind
        {
 	       struct cache	*cache;
 
@@ -568,10 +672,15 @@ cache: TOKCACHE replpathv expire
 	       cache = xcalloc(1, sizeof *cache);
 	       cache->path = $2;
 	       cache->expire = $3;
+	       cache->bloom_size = $4.size;
+	       cache->bloom_rate = $4.rate;
+	       cache->write_behind = $5;
+	       RB_INIT(&cache->pendings);
 
 	       TAILQ_INSERT_TAIL(&conf.caches, cache, entry);
 
-	       log_debug2("added cache \"%s\": expire %lld", cache->path, $3);
+	       log_debug2("added cache \"%s\": expire %lld, bloom-filter %zu, "
+		   "write-behind %lld", cache->path, $3, $4.size, $5);
        }
 
 set: TOKSET TOKMAXSIZE size
@@ -602,6 +711,20 @@ set: TOKSET TOKMAXSIZE size
      {
 	     conf.lock_timeout = $3;
      }
+   | TOKSET TOKDURABILITY TOKPERMAIL
+     {
+	     conf.durability = DURABILITY_PERMAIL;
+     }
+   | TOKSET TOKDURABILITY TOKGROUP groupcount groupdelay
+     {
+	     conf.durability = DURABILITY_GROUP;
+	     conf.group_count = $4;
+	     conf.group_delay = $5;
+     }
+   | TOKSET TOKDURABILITY TOKNONE
+     {
+	     conf.durability = DURABILITY_NONE;
+     }
    | TOKSET TOKDELTOOBIG
      {
 	     conf.del_big = 1;
@@ -637,6 +760,12 @@ set: TOKSET TOKMAXSIZE size
 		     yyerror("timeout too long: %lld", $3);
 	     conf.timeout = $3 * 1000;
      }
+   | TOKSET TOKCONNECTSTAGGER numv
+     {
+	     if ($3 > INT_MAX)
+		     yyerror("connect-stagger too long: %lld", $3);
+	     conf.connect_stagger = $3;
+     }
    | TOKSET TOKQUEUEHIGH numv
      {
 	     if ($3 == 0)
@@ -669,6 +798,15 @@ set: TOKSET TOKMAXSIZE size
      {
 	     conf.verify_certs = 1;
      }
+   | TOKSET TOKSSLSESSIONCACHE replpathv
+     {
+	     if (*$3 == '\0')
+		     yyerror("invalid path");
+
+	     if (conf.ssl_cache != NULL)
+		     xfree(conf.ssl_cache);
+	     conf.ssl_cache = $3;
+     }
    | TOKSET TOKIMPLACT TOKKEEP
      {
 	     conf.impl_act = DECISION_KEEP;
@@ -698,6 +836,10 @@ set: TOKSET TOKMAXSIZE size
      {
 	     conf.no_create = 1;
      }
+   | TOKSET TOKMAILDIRLINKS
+     {
+	     conf.maildir_links = 1;
+     }
    | TOKSET TOKFILEGROUP TOKUSER
      {
 	     conf.file_group = -1;
@@ -716,6 +858,14 @@ set: TOKSET TOKMAXSIZE size
 	     ARRAY_FREEALL(conf.user_order);
 	     conf.user_order = $3;
      }
+   | TOKSET TOKLOOKUPCACHE expire
+     {
+	     conf.lookup_expire = $3;
+     }
+   | TOKSET TOKLOOKUPCACHE TOKNONE
+     {
+	     conf.lookup_expire = 0;
+     }
    | TOKSET TOKFILEUMASK numv
      {
 	     char	s[8];
@@ -1074,6 +1224,25 @@ to: /* empty */
 	    $$ = $2;
     }
 
+lmtptos: /* empty */
+	 {
+		 $$ = NULL;
+	 }
+       | TOKTO strv
+	 {
+		 if (*$2 == '\0')
+			 yyerror("invalid to");
+
+		 $$ = xmalloc(sizeof *$$);
+		 ARRAY_INIT($$);
+		 ARRAY_EXPAND($$, 1);
+		 ARRAY_LAST($$).str = $2;
+	 }
+       | TOKTO '{' replstrslist '}'
+	 {
+		 $$ = $3;
+	 }
+
 from: /* empty */
       {
 	      $$ = NULL;
@@ -1092,7 +1261,7 @@ compress: TOKCOMPRESS
 		  $$ = 0;
 	  }
 
-actitem: execpipe strv
+actitem: execpipe strv coprocess
 	 {
 		 struct deliver_pipe_data	*data;
 
@@ -1107,8 +1276,10 @@ actitem: execpipe strv
 
 		 data->pipe = $1;
 		 data->cmd.str = $2;
+		 if ($3)
+			 $$->coproc = &data->cmd;
 	 }
-       | TOKREWRITE strv
+       | TOKREWRITE strv coprocess
 	 {
 		 struct deliver_rewrite_data	*data;
 
@@ -1122,6 +1293,8 @@ actitem: execpipe strv
 		 $$->data = data;
 
 		 data->cmd.str = $2;
+		 if ($3)
+			 $$->coproc = &data->cmd;
 	 }
        | writeappend strv
 	 {
@@ -1260,6 +1433,42 @@ actitem: execpipe strv
 		 data->from.str = $3;
 		 data->to.str = $4;
 	 }
+       | TOKLMTP server from lmtptos
+	 {
+		 struct deliver_lmtp_data	*data;
+
+		 $$ = xcalloc(1, sizeof *$$);
+		 $$->deliver = &deliver_lmtp;
+
+		 data = xcalloc(1, sizeof *data);
+		 $$->data = data;
+
+		 data->server.host = $2.host;
+		 if ($2.port != NULL)
+			 data->server.port = $2.port;
+		 else
+			 data->server.port = xstrdup("24");
+		 data->server.ai = NULL;
+		 data->from.str = $3;
+		 data->to = $4;
+	 }
+       | TOKLMTP TOKSOCKET strv from lmtptos
+	 {
+		 struct deliver_lmtp_data	*data;
+
+		 if (*$3 == '\0')
+			 yyerror("invalid path");
+
+		 $$ = xcalloc(1, sizeof *$$);
+		 $$->deliver = &deliver_lmtp;
+
+		 data = xcalloc(1, sizeof *data);
+		 $$->data = data;
+
+		 data->path = $3;
+		 data->from.str = $4;
+		 data->to = $5;
+	 }
        | TOKSTDOUT
 	 {
 		 $$ = xcalloc(1, sizeof *$$);
@@ -1384,6 +1593,7 @@ defaction: TOKACTION replstrv users actitem
 
 		   t->users = $3;
 		   TAILQ_INSERT_TAIL(&conf.actions, t, entry);
+		   RB_INSERT(actiontree, &conf.action_tree, t);
 
 		   print_action(t);
 
@@ -1407,6 +1617,7 @@ defaction: TOKACTION replstrv users actitem
 
 		   t->users = $3;
 		   TAILQ_INSERT_TAIL(&conf.actions, t, entry);
+		   RB_INSERT(actiontree, &conf.action_tree, t);
 
 		   print_action(t);
 
@@ -1528,6 +1739,15 @@ execpipe: TOKEXEC
 		  $$ = 1;
 	  }
 
+coprocess: TOKCOPROCESS
+	   {
+		   $$ = 1;
+	   }
+	 | /* empty */
+	   {
+		   $$ = 0;
+	   }
+
 writeappend: TOKWRITE
 	     {
 		     $$ = 0;
@@ -1583,14 +1803,14 @@ expritem: not TOKALL
 
 		  data->accounts = $2;
 	  }
-	| not execpipe strv user TOKRETURNS '(' retrc ',' retre ')'
+	| not execpipe strv user coprocess TOKRETURNS '(' retrc ',' retre ')'
 	  {
 		  struct match_command_data	*data;
 		  char				*cause;
 
 		  if (*$3 == '\0' || ($3[0] == '|' && $3[1] == '\0'))
 			  yyerror("invalid command");
-		  if ($7 == -1 && $9.str == NULL)
+		  if ($8 == -1 && $10.str == NULL)
 			  yyerror("return code or regexp must be specified");
 
 		  $$ = xcalloc(1, sizeof *$$);
@@ -1603,14 +1823,15 @@ expritem: not TOKALL
 		  data->user.str = $4;
 		  data->pipe = $2;
 		  data->cmd.str = $3;
+		  data->coproc = $5;
 
-		  data->ret = $7;
+		  data->ret = $8;
 
-		  if ($9.str != NULL) {
+		  if ($10.str != NULL) {
 			  if (re_compile(
-			      &data->re, $9.str, $9.flags, &cause) != 0)
+			      &data->re, $10.str, $10.flags, &cause) != 0)
 				  yyerror("%s", cause);
-			  xfree($9.str);
+			  xfree($10.str);
 		  }
 
 	  }
@@ -1693,6 +1914,56 @@ expritem: not TOKALL
 		  data->key.str = $5;
 		  data->path = $3;
 	  }
+	| not TOKSTRING strv TOKINFILE replpathv opttag
+	  {
+		  struct match_in_file_data	*data;
+		  char				*cause;
+
+		  if (*$3 == '\0')
+			  yyerror("invalid string");
+		  if (*$5 == '\0')
+			  yyerror("invalid path");
+
+		  $$ = xcalloc(1, sizeof *$$);
+
+		  $$->match = &match_in_file;
+		  $$->inverted = $1;
+
+		  data = xcalloc(1, sizeof *data);
+		  $$->data = data;
+
+		  if ((data->file = keyfile_load($5, &cause)) == NULL)
+			  yyerror("%s", cause);
+		  xfree($5);
+
+		  data->key.str = $3;
+		  data->tag.str = $6;
+	  }
+	| not TOKHEADER strv TOKINFILE replpathv opttag
+	  {
+		  struct match_in_file_data	*data;
+		  char				*cause;
+
+		  if (*$3 == '\0')
+			  yyerror("invalid header");
+		  if (*$5 == '\0')
+			  yyerror("invalid path");
+
+		  $$ = xcalloc(1, sizeof *$$);
+
+		  $$->match = &match_in_file;
+		  $$->inverted = $1;
+
+		  data = xcalloc(1, sizeof *data);
+		  $$->data = data;
+
+		  if ((data->file = keyfile_load($5, &cause)) == NULL)
+			  yyerror("%s", cause);
+		  xfree($5);
+
+		  data->hdr = $3;
+		  data->tag.str = $6;
+	  }
 	| not TOKMATCHED
 	  {
 		  $$ = xcalloc(1, sizeof *$$);
@@ -2301,7 +2572,7 @@ fetchtype: poptype server userpassnetrc poponly apop verify uidl starttls
 	   {
 		   $$.fetch = &fetch_stdin;
 	   }
-	 | maildirs
+	 | maildirs poponly
 	   {
 		   struct fetch_maildir_data	*data;
 
@@ -2309,6 +2580,8 @@ fetchtype: poptype server userpassnetrc poponly apop verify uidl starttls
 		   data = xcalloc(1, sizeof *data);
 		   $$.data = data;
 		   data->maildirs = $1;
+		   data->path = $2.path;
+		   data->only = $2.only;
 	   }
 	 | mboxes
 	   {
@@ -783,6 +783,8 @@ pop3_state_next(struct account *a, struct fetch_ctx *fctx)
 		if (data->committed != data->total)
 			return (FETCH_BLOCK);
 
+		if (cache_flush(a) != 0)
+			return (FETCH_ERROR);
 		if (pop3_putln(a, "QUIT") != 0)
 			return (FETCH_ERROR);
 		fctx->state = pop3_state_quit;
@@ -805,6 +807,8 @@ pop3_state_next(struct account *a, struct fetch_ctx *fctx)
 		if (fctx->flags & FETCH_EMPTY) {
 			fctx->flags &= ~FETCH_PURGE;
 
+			if (cache_flush(a) != 0)
+				return (FETCH_ERROR);
 			if (pop3_putln(a, "QUIT") != 0)
 				return (FETCH_ERROR);
 			fctx->state = pop3_state_reconnect;
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+# Stand-in LMTP server to check fdm's lmtp action. Run as:
+#
+#	python3 regress/lmtp.py ./fdm
+#
+# The server listens on a UNIX domain socket, rejects recipients starting with
+# "bad", gives some replies with no text and records what it is sent. Each test
+# delivers one mail from a maildir, which keeps it exactly as written, and
+# compares what the server received.
+
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+
+class Server(threading.Thread):
+	def __init__(self, path):
+		threading.Thread.__init__(self, daemon=True)
+		self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		self.sock.bind(path)
+		self.sock.listen(5)
+		self.mails = []
+
+	def run(self):
+		while True:
+			conn, addr = self.sock.accept()
+			threading.Thread(target=self.session, args=(conn,),
+			    daemon=True).start()
+
+	def session(self, conn):
+		try:
+			self.lmtp(conn)
+		except OSError:
+			pass
+		conn.close()
+
+	def lmtp(self, conn):
+		f = conn.makefile('rb')
+		def send(s):
+			conn.sendall(s.encode() + b'\r\n')
+		send('220 stand-in')
+		rcpts = []
+		for line in f:
+			cmd = line.decode().rstrip('\r\n')
+			verb = cmd.split(' ')[0].upper()
+			if verb == 'LHLO':
+				send('250-stand-in')
+				send('250 PIPELINING')
+			elif verb == 'MAIL':
+				rcpts = []
+				send('250')
+			elif verb == 'RCPT':
+				to = cmd[cmd.index('<') + 1:cmd.index('>')]
+				if to.startswith('bad'):
+					send('550 5.1.1 no such user')
+				else:
+					rcpts.append(to)
+					send('250')
+			elif verb == 'DATA':
+				if not rcpts:
+					send('503 no recipients')
+					continue
+				send('354 go ahead')
+				data = b''
+				for dline in f:
+					if dline == b'.\r\n':
+						break
+					if dline.startswith(b'.'):
+						dline = dline[1:]
+					data += dline
+				self.mails.append((list(rcpts), data))
+				for to in rcpts:
+					send('250 2.0.0 delivered')
+			elif verb == 'RSET':
+				rcpts = []
+				send('250')
+			elif verb == 'QUIT':
+				send('221 bye')
+				break
+			else:
+				send('500 unknown command')
+
+def run(fdm, tmp, server, to, mail):
+	md = os.path.join(tmp, 'md')
+	shutil.rmtree(md, ignore_errors=True)
+	for d in ('cur', 'new', 'tmp'):
+		os.makedirs(os.path.join(md, d))
+	with open(os.path.join(md, 'new', 'mail'), 'wb') as f:
+		f.write(mail)
+
+	conf = os.path.join(tmp, 'conf')
+	with open(conf, 'w') as f:
+		f.write('set lock-file "%s/lock"\n' % tmp)
+		f.write('account "md" maildir "%s" keep\n' % md)
+		f.write('action "lmtp" lmtp socket "%s/sock" to { %s }\n' %
+		    (tmp, ' '.join('"%s"' % t for t in to)))
+		f.write('match all action "lmtp"\n')
+	os.chmod(conf, 0o644)
+	del server.mails[:]
+	p = subprocess.run([fdm, '-f', conf, 'fetch'],
+	    stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+	return p.stderr.decode(), list(server.mails)
+
+def main():
+	fdm = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './fdm')
+	tmp = tempfile.mkdtemp()
+	os.chmod(tmp, 0o777)
+	server = Server(os.path.join(tmp, 'sock'))
+	os.chmod(os.path.join(tmp, 'sock'), 0o777)
+	server.start()
+
+	head = b'From: a@example.com\nSubject: test\n\n'
+	tests = [
+	    ('plain', ['u1'], head + b'body\n', False, [['u1']]),
+	    ('dot', ['u1'], head + b'.leading\n..two\n.\n', False, [['u1']]),
+	    ('lastdot', ['u1'], head + b'body\n.', False, [['u1']]),
+	    ('lastline', ['u1'], head + b'body\nend', False, [['u1']]),
+	    ('two', ['u1', 'u2'], head + b'body\n', False, [['u1', 'u2']]),
+	    ('rejected', ['u1', 'bad1'], head + b'body\n', True, [['u1']]),
+	    ('none', ['bad1'], head + b'body\n', True, []),
+	]
+	failed = 0
+	for name, to, mail, rejected, rcpts in tests:
+		err, mails = run(fdm, tmp, server, to, mail)
+		ok = ('rejected' in err) == rejected
+		ok = ok and [m[0] for m in mails] == rcpts
+		body = mail.split(b'\n\n', 1)[1].rstrip(b'\n')
+		for m in mails:
+			data = m[1].replace(b'\r\n', b'\n')
+			if data.split(b'\n\n', 1)[-1].rstrip(b'\n') != body:
+				ok = False
+		print('%s: %s' % (name, 'ok' if ok else 'FAILED'))
+		if not ok:
+			print('\t%sgot %r' % (err, mails))
+			failed = 1
+	shutil.rmtree(tmp)
+	sys.exit(failed)
+
+main()
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
@@ -65,6 +66,7 @@ shm_expand(struct shm *shm, size_t size)
 
 	if (lseek(shm->fd, shm->size, SEEK_SET) == -1)
 		return (-1);
+	size -= shm->size;
 
 	/*
 	 * Fill the file using write(2) to avoid fragmentation problems on
@@ -100,12 +102,27 @@ shm_expand(struct shm *shm, size_t size)
 /* Create an shm file and map it. */
 void *
 shm_create(struct shm *shm, size_t size)
+{
+	return (shm_copy(shm, size, NULL, -1, 0));
+}
+
+/*
+ * Create an shm file and map it, with the first len bytes taken from buf or,
+ * if it is NULL, read from fd. These are written or copied by the kernel
+ * where possible rather than filling the file and then reading into it.
+ */
+void *
+shm_copy(struct shm *shm, size_t size, const void *buf, int fd, size_t len)
 {
 	int	 saved_errno;
 	char	*path;
+	size_t	 done;
+	ssize_t	 n;
 
 	if (size == 0)
 		fatalx("zero size");
+	if (len > size)
+		fatalx("len > size");
 
 	if (ppath(
 	    shm->name, sizeof shm->name, "%s.XXXXXXXXXX", __progname) != 0)
@@ -114,8 +131,43 @@ shm_create(struct shm *shm, size_t size)
 		return (NULL);
 	if ((shm->fd = mkstemp(path)) == -1)
 		return (NULL);
+	fcntl(shm->fd, F_SETFD, FD_CLOEXEC);
 	strlcpy(shm->name, xbasename(path), sizeof shm->name);
 
+	done = 0;
+	while (buf != NULL && done < len) {
+		n = write(shm->fd, (const char *) buf + done, len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			goto error;
+		}
+		done += n;
+	}
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < len) {
+		n = copy_file_range(fd, NULL, shm->fd, NULL, len - done, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0) {
+			errno = EIO;
+			goto error;
+		}
+		if (n == -1) {
+			/* Read it instead if nothing was copied. */
+			if (done == 0 && (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP))
+				break;
+			goto error;
+		}
+		done += n;
+	}
+#endif
+
+	/* Fill the rest of the file. */
+	shm->size = done;
 	if (shm_expand(shm, size) != 0)
 		goto error;
 
@@ -123,12 +175,28 @@ shm_create(struct shm *shm, size_t size)
 	if (shm->data == MAP_FAILED)
 		goto error;
 	madvise(shm->data, size, MADV_SEQUENTIAL);
-
 	shm->size = size;
+
+	while (done < len) {
+		n = read(fd, (char *) shm->data + done, len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			saved_errno = errno;
+			munmap(shm->data, shm->size);
+			errno = saved_errno;
+			goto error;
+		}
+		done += n;
+	}
+
 	return (shm->data);
 
 error:
 	saved_errno = errno;
+	close(shm->fd);
 	unlink(path);
 	errno = saved_errno;
 	return (NULL);
@@ -178,6 +246,7 @@ shm_reopen(struct shm *shm)
 		return (NULL);
 	if ((shm->fd = open(path, O_RDWR, 0)) == -1)
 		return (NULL);
+	fcntl(shm->fd, F_SETFD, FD_CLOEXEC);
 
 	shm->data = mmap(NULL, shm->size, SHM_PROT, SHM_FLAGS, shm->fd, 0);
 	if (shm->data == MAP_FAILED)